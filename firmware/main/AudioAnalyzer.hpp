@@ -0,0 +1,445 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <span>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#include <Metrics.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Level meters and spectrum of the output, computed off the audio path for the visualizer
+ *
+ * The output task pushes each chunk it outputs into a lock-free tap. If the tap doesn't have room for the whole
+ * chunk, the chunk is dropped and counted, so the output task never waits. Every PERIOD_MS, a task at the lowest
+ * priority on the other core drains the tap. It updates the peak and RMS meters and counts the samples at full
+ * scale. Then it runs a FFT_SIZE point FFT on the latest frames and sums the bins into BANDS log-spaced bands.
+ *
+ * The cycles spent pushing into the tap on the audio core, and by the analysis task on its core, are exported
+ * as shares of a core.
+ */
+class AudioAnalyzer
+{
+    static constexpr const char* TAG = "AudioAnalyzer";
+
+    static constexpr uint32_t SAMPLE_RATE = 48000;
+    static constexpr uint8_t CHANNELS = 2;
+
+    // 20 updates per second
+    static constexpr uint32_t PERIOD_MS = 50;
+
+    // 47 Hz bins, the bands below 200 Hz are narrower and read the bin of their center
+    static constexpr size_t FFT_SIZE = 1024;
+    static constexpr int FFT_BITS = 10;
+
+    // 170 ms, over three periods, in PSRAM since it is only touched at the output rate
+    static constexpr size_t TAP_FRAMES = 8192;
+
+    static constexpr float MIN_FREQUENCY = 20.0f;
+    static constexpr float MAX_FREQUENCY = 20000.0f;
+
+    // Reported for silence instead of -inf
+    static constexpr float FLOOR_DB = -120.0f;
+
+    // Lowest priority above idle, on the core of the decoder so the output task is never preempted
+    static constexpr uint32_t STACK_SIZE = 4096;
+    static constexpr UBaseType_t PRIORITY = 1;
+    static constexpr BaseType_t CORE = 0;
+    static constexpr uint32_t CPU_HZ = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000 * 1000;
+
+public:
+
+    static constexpr size_t BANDS = 32;
+
+    struct Snapshot
+    {
+        // Per channel, over the last period
+        std::array<float, CHANNELS> peak_dbfs;
+        std::array<float, CHANNELS> rms_dbfs;
+        uint32_t clipped;
+        // Level of each band relative to a full scale sine
+        std::array<float, BANDS> bands_db;
+        uint32_t dropped_frames;
+        uint32_t sequence;
+    };
+
+    AudioAnalyzer()
+        : tap_(TAP_FRAMES * CHANNELS * sizeof(int16_t), "Analyzer tap", MALLOC_CAP_SPIRAM)
+        , dropped_(Metrics::get_instance().counter("cactus_analyzer_dropped_frames_total",
+                "Output frames the analyzer tap had no room for"))
+        , clipped_(Metrics::get_instance().counter("cactus_output_clipped_samples_total",
+                "Output samples at full scale"))
+        , tap_load_(Metrics::get_instance().gauge("cactus_analyzer_tap_core_pct",
+                "Share of the audio core spent pushing the output into the analyzer tap"))
+        , analysis_load_(Metrics::get_instance().gauge("cactus_analyzer_core_pct",
+                "Share of core 0 spent by the analysis task, including preemptions"))
+    {
+        mutex_ = xSemaphoreCreateMutex();
+
+        fft_ = static_cast<float*>(heap_caps_malloc(FFT_SIZE * 2 * sizeof(float), MALLOC_CAP_INTERNAL));
+        twiddles_ = static_cast<float*>(heap_caps_malloc(FFT_SIZE * sizeof(float), MALLOC_CAP_INTERNAL));
+        window_ = static_cast<float*>(heap_caps_malloc(FFT_SIZE * sizeof(float), MALLOC_CAP_INTERNAL));
+        history_ = static_cast<float*>(heap_caps_calloc(FFT_SIZE, sizeof(float), MALLOC_CAP_INTERNAL));
+
+        // Also off the stack of the player task, where the sink holding the analyzer lives
+        first_bin_ = static_cast<size_t*>(heap_caps_malloc(BANDS * 2 * sizeof(size_t), MALLOC_CAP_INTERNAL));
+        last_bin_ = first_bin_ + BANDS;
+        snapshot_ = static_cast<Snapshot*>(heap_caps_malloc(sizeof(Snapshot), MALLOC_CAP_INTERNAL));
+
+        // Like the sink holding it, the output can't run without it
+        ESP_ERROR_CHECK(fft_ != nullptr && twiddles_ != nullptr && window_ != nullptr && history_ != nullptr &&
+                first_bin_ != nullptr && snapshot_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+
+        for (size_t i = 0; i < FFT_SIZE / 2; i++)
+        {
+            twiddles_[i * 2] = std::cos(2 * M_PI * i / FFT_SIZE);
+            twiddles_[i * 2 + 1] = -std::sin(2 * M_PI * i / FFT_SIZE);
+        }
+
+        for (size_t i = 0; i < FFT_SIZE; i++)
+        {
+            window_[i] = 0.5f - 0.5f * std::cos(2 * M_PI * i / FFT_SIZE);
+        }
+
+        // Log-spaced edges, each band covers at least the bin of its center
+        float bin_hz = static_cast<float>(SAMPLE_RATE) / FFT_SIZE;
+
+        for (size_t band = 0; band < BANDS; band++)
+        {
+            float low = MIN_FREQUENCY * std::pow(MAX_FREQUENCY / MIN_FREQUENCY, static_cast<float>(band) / BANDS);
+            float high = MIN_FREQUENCY * std::pow(MAX_FREQUENCY / MIN_FREQUENCY, static_cast<float>(band + 1) / BANDS);
+            size_t center = std::max<size_t>(std::lround(std::sqrt(low * high) / bin_hz), 1);
+
+            first_bin_[band] = std::min<size_t>(std::ceil(low / bin_hz), center);
+            last_bin_[band] = std::max<size_t>(std::ceil(high / bin_hz), center + 1);
+        }
+
+        *snapshot_ = {};
+        snapshot_->peak_dbfs.fill(FLOOR_DB);
+        snapshot_->rms_dbfs.fill(FLOOR_DB);
+        snapshot_->bands_db.fill(FLOOR_DB);
+
+        xTaskCreatePinnedToCore(
+            AudioAnalyzer::task,
+            "Analyzer",
+            STACK_SIZE,
+            this,
+            PRIORITY,
+            &task_,
+            CORE
+            );
+    }
+
+    ~AudioAnalyzer()
+    {
+        vTaskDelete(task_);
+        vSemaphoreDelete(mutex_);
+        heap_caps_free(fft_);
+        heap_caps_free(twiddles_);
+        heap_caps_free(window_);
+        heap_caps_free(history_);
+        heap_caps_free(first_bin_);
+        heap_caps_free(snapshot_);
+    }
+
+    AudioAnalyzer(const AudioAnalyzer&) = delete;
+    AudioAnalyzer& operator=(const AudioAnalyzer&) = delete;
+
+    /**
+     * @brief Copies the output into the tap, from the output task, never waits
+     *
+     * @param samples Interleaved stereo as sent to the DMA
+     */
+    void push(
+            std::span<const int16_t> samples)
+    {
+        uint32_t start = esp_cpu_get_cycle_count();
+
+        if (tap_.free_space() < samples.size_bytes())
+        {
+            dropped_frames_.fetch_add(samples.size() / CHANNELS, std::memory_order_relaxed);
+        }
+        else
+        {
+            tap_.write(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(samples.data()),
+                    samples.size_bytes()));
+        }
+
+        tap_cycles_.fetch_add(esp_cpu_get_cycle_count() - start, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Same for 32-bit slots, only their upper half is kept
+     */
+    void push(
+            std::span<const int32_t> samples)
+    {
+        uint32_t start = esp_cpu_get_cycle_count();
+
+        if (tap_.free_space() < samples.size() * sizeof(int16_t))
+        {
+            dropped_frames_.fetch_add(samples.size() / CHANNELS, std::memory_order_relaxed);
+        }
+        else
+        {
+            // At most two slots, where the ring wraps
+            for (size_t position = 0; position < samples.size();)
+            {
+                std::span<uint8_t> slot = tap_.max_write_slot();
+                int16_t* tap = reinterpret_cast<int16_t*>(slot.data());
+                size_t count = std::min(slot.size() / sizeof(int16_t), samples.size() - position);
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    tap[i] = samples[position + i] >> 16;
+                }
+
+                tap_.commit_write(count * sizeof(int16_t));
+                position += count;
+            }
+        }
+
+        tap_cycles_.fetch_add(esp_cpu_get_cycle_count() - start, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Latest meters and spectrum, can be called from any task
+     */
+    Snapshot snapshot() const
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        Snapshot snapshot = *snapshot_;
+        xSemaphoreGive(mutex_);
+
+        return snapshot;
+    }
+
+private:
+
+    friend class DSPBenchmark;
+
+    static void task(
+            void* arg)
+    {
+        AudioAnalyzer& analyzer = *static_cast<AudioAnalyzer*>(arg);
+        TickType_t wake = xTaskGetTickCount();
+
+        while (true)
+        {
+            xTaskDelayUntil(&wake, pdMS_TO_TICKS(PERIOD_MS));
+
+            uint32_t start = esp_cpu_get_cycle_count();
+            analyzer.analyze();
+            uint32_t cycles = esp_cpu_get_cycle_count() - start;
+
+            float period_cycles = static_cast<float>(CPU_HZ) * PERIOD_MS / 1000;
+            analyzer.analysis_load_.set(100.0f * cycles / period_cycles);
+            analyzer.tap_load_.set(100.0f * analyzer.tap_cycles_.exchange(0, std::memory_order_relaxed) /
+                    period_cycles);
+        }
+    }
+
+    static float to_db(
+            float power)
+    {
+        return power > 0.0f ? std::max(10.0f * std::log10(power), FLOOR_DB) : FLOOR_DB;
+    }
+
+    void analyze()
+    {
+        std::array<int32_t, CHANNELS> peak = {};
+        std::array<float, CHANNELS> sum = {};
+        uint32_t clipped = 0;
+        size_t frames = 0;
+
+        // Drain the tap, frames stay whole as the output task only writes whole chunks
+        while (true)
+        {
+            std::span<uint8_t> slot = tap_.max_read_slot();
+
+            if (slot.empty())
+            {
+                break;
+            }
+
+            const int16_t* samples = reinterpret_cast<const int16_t*>(slot.data());
+            size_t count = slot.size() / (CHANNELS * sizeof(int16_t));
+
+            for (size_t i = 0; i < count; i++)
+            {
+                for (uint8_t channel = 0; channel < CHANNELS; channel++)
+                {
+                    int32_t sample = samples[i * CHANNELS + channel];
+                    int32_t magnitude = std::abs(sample);
+
+                    peak[channel] = std::max(peak[channel], magnitude);
+                    sum[channel] += static_cast<float>(sample) * sample;
+                    clipped += magnitude >= INT16_MAX;
+                }
+
+                history_[history_index_] = (samples[i * CHANNELS] + samples[i * CHANNELS + 1]) / 65536.0f;
+                history_index_ = (history_index_ + 1) % FFT_SIZE;
+            }
+
+            tap_.commit_read(count * CHANNELS * sizeof(int16_t));
+            frames += count;
+        }
+
+        uint32_t dropped = dropped_frames_.exchange(0, std::memory_order_relaxed);
+        dropped_.add(dropped);
+        clipped_.add(clipped);
+
+        // Nothing played, e.g. paused, reads as silence
+        std::array<float, BANDS> bands;
+
+        if (frames == 0)
+        {
+            bands.fill(FLOOR_DB);
+        }
+        else
+        {
+            bands = spectrum();
+        }
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+
+        for (uint8_t channel = 0; channel < CHANNELS; channel++)
+        {
+            float scale = 1.0f / (32768.0f * 32768.0f);
+
+            snapshot_->peak_dbfs[channel] = to_db(static_cast<float>(peak[channel]) * peak[channel] * scale);
+            snapshot_->rms_dbfs[channel] = frames == 0 ? FLOOR_DB : to_db(sum[channel] / frames * scale);
+        }
+
+        snapshot_->clipped = clipped;
+        snapshot_->bands_db = bands;
+        snapshot_->dropped_frames = dropped;
+        snapshot_->sequence++;
+
+        xSemaphoreGive(mutex_);
+    }
+
+    /**
+     * @brief Band levels of the latest FFT_SIZE frames, a full scale sine reads 0 dB
+     */
+    std::array<float, BANDS> spectrum()
+    {
+        for (size_t i = 0; i < FFT_SIZE; i++)
+        {
+            fft_[i * 2] = history_[(history_index_ + i) % FFT_SIZE] * window_[i];
+            fft_[i * 2 + 1] = 0.0f;
+        }
+
+        transform();
+
+        // The Hann window halves the amplitude, so a sine of amplitude 1 peaks at FFT_SIZE / 4, and spreads the
+        // sine over 1.5 bins of power
+        float scale = 16.0f / (1.5f * FFT_SIZE * FFT_SIZE);
+        std::array<float, BANDS> bands;
+
+        for (size_t band = 0; band < BANDS; band++)
+        {
+            float power = 0.0f;
+
+            for (size_t bin = first_bin_[band]; bin < last_bin_[band] && bin < FFT_SIZE / 2; bin++)
+            {
+                power += fft_[bin * 2] * fft_[bin * 2] + fft_[bin * 2 + 1] * fft_[bin * 2 + 1];
+            }
+
+            bands[band] = to_db(power * scale);
+        }
+
+        return bands;
+    }
+
+    /**
+     * @brief In-place radix-2 complex FFT of fft_
+     */
+    void transform()
+    {
+        for (size_t i = 0; i < FFT_SIZE; i++)
+        {
+            size_t j = reverse(i);
+
+            if (j > i)
+            {
+                std::swap(fft_[i * 2], fft_[j * 2]);
+                std::swap(fft_[i * 2 + 1], fft_[j * 2 + 1]);
+            }
+        }
+
+        for (size_t size = 2; size <= FFT_SIZE; size *= 2)
+        {
+            size_t half = size / 2;
+            size_t stride = FFT_SIZE / size;
+
+            for (size_t start = 0; start < FFT_SIZE; start += size)
+            {
+                for (size_t k = 0; k < half; k++)
+                {
+                    float wr = twiddles_[k * stride * 2];
+                    float wi = twiddles_[k * stride * 2 + 1];
+                    float* a = fft_ + (start + k) * 2;
+                    float* b = fft_ + (start + k + half) * 2;
+
+                    float tr = b[0] * wr - b[1] * wi;
+                    float ti = b[0] * wi + b[1] * wr;
+
+                    b[0] = a[0] - tr;
+                    b[1] = a[1] - ti;
+                    a[0] += tr;
+                    a[1] += ti;
+                }
+            }
+        }
+    }
+
+    static size_t reverse(
+            size_t index)
+    {
+        size_t reversed = 0;
+
+        for (int bit = 0; bit < FFT_BITS; bit++)
+        {
+            reversed = (reversed << 1) | ((index >> bit) & 1);
+        }
+
+        return reversed;
+    }
+
+    RingBuffer tap_;
+    std::atomic<uint32_t> dropped_frames_ = 0;
+    std::atomic<uint32_t> tap_cycles_ = 0;
+
+    // Interleaved complex, and the mono history of the latest frames
+    float* fft_;
+    float* twiddles_;
+    float* window_;
+    float* history_;
+    size_t history_index_ = 0;
+
+    // Range of the bins summed by each band
+    size_t* first_bin_;
+    size_t* last_bin_;
+
+    mutable SemaphoreHandle_t mutex_;
+    Snapshot* snapshot_;
+
+    Metric& dropped_;
+    Metric& clipped_;
+    Metric& tap_load_;
+    Metric& analysis_load_;
+
+    TaskHandle_t task_ = nullptr;
+};
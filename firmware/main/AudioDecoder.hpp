@@ -0,0 +1,51 @@
+#pragma once
+
+#include <simple_dec/esp_audio_simple_dec.h>
+
+#include <RingBuffer.hpp>
+
+enum class AudioCodec
+{
+    UNKNOWN,
+    MP3,
+    AAC,
+    M4A,
+    FLAC,
+    OPUS,
+    WAV,
+    COUNT
+};
+
+/**
+ * @brief Decoder turning the compressed stream of a ring buffer into 16 bits interleaved PCM
+ */
+class AudioDecoder
+{
+public:
+
+    virtual ~AudioDecoder() = default;
+
+    /**
+     * @brief Decodes as much input as fits in the output
+     */
+    virtual void process(
+            RingBuffer& input,
+            RingBuffer& output) = 0;
+
+    /**
+     * @brief Gets the format of the decoded audio, sample rate is zero until known
+     */
+    virtual esp_audio_simple_dec_info_t get_info() = 0;
+
+    /**
+     * @brief Gets the codec name, used in logs and playback reports
+     */
+    virtual const char* name() const = 0;
+
+    virtual AudioCodec codec() const = 0;
+
+    /**
+     * @brief Drops the state of the previous track so the instance can decode a new one
+     */
+    virtual void reset() = 0;
+};
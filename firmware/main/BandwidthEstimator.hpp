@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <Metrics.hpp>
+
+/**
+ * @brief Rolling estimator of the network goodput
+ *
+ * Every HTTP read reports the bytes received and the time it took. Reads are aggregated into samples of at
+ * least SAMPLE_MIN_US of transfer time, so tiny reads served from the socket buffer do not produce absurd
+ * rates. Each sample updates an EWMA and a window with the last WINDOW_SIZE samples used for min/max.
+ *
+ * The estimator lives for the whole firmware lifetime so a new song starts with the history of the previous ones.
+ */
+class BandwidthEstimator
+{
+    static constexpr const char* TAG = "BandwidthEstimator";
+
+    static constexpr int64_t SAMPLE_MIN_US = 250 * 1000;
+    static constexpr size_t SAMPLE_MIN_BYTES = 4 * 1024;
+    static constexpr size_t WINDOW_SIZE = 16;
+    static constexpr float EWMA_ALPHA = 0.2f;
+
+    // A read blocked this long is a stall even if it returned some data
+    static constexpr int64_t STALL_US = 500 * 1000;
+
+public:
+
+    // Bitrate assumed when the decoder has not reported one yet
+    static constexpr uint32_t DEFAULT_BITRATE_BPS = 128000;
+
+    static BandwidthEstimator& get_instance()
+    {
+        static BandwidthEstimator estimator;
+
+        return estimator;
+    }
+
+    /**
+     * @brief Reports a completed read
+     *
+     * @param bytes Bytes received
+     * @param elapsed_us Time spent in the read call
+     */
+    void on_read(
+            size_t bytes,
+            int64_t elapsed_us)
+    {
+        pending_bytes_ += bytes;
+        pending_us_ += elapsed_us;
+        bytes_total_.add(bytes);
+
+        if (elapsed_us >= STALL_US)
+        {
+            stalls_total_.add();
+        }
+
+        if (pending_us_ < SAMPLE_MIN_US || pending_bytes_ < SAMPLE_MIN_BYTES)
+        {
+            return;
+        }
+
+        float sample_bps = (pending_bytes_ * 8.0f * 1e6f) / pending_us_;
+
+        pending_bytes_ = 0;
+        pending_us_ = 0;
+
+        add_sample(sample_bps);
+    }
+
+    /**
+     * @brief Reports a read that timed out without data, counts as zero throughput for its duration
+     */
+    void on_stall(
+            int64_t elapsed_us)
+    {
+        pending_us_ += elapsed_us;
+        stalls_total_.add();
+    }
+
+    bool has_estimate() const
+    {
+        return ewma_bps() > 0.0f;
+    }
+
+    float ewma_bps() const
+    {
+        return ewma_bps_.load(std::memory_order_relaxed);
+    }
+
+    float window_min_bps() const
+    {
+        return window_min_bps_.load(std::memory_order_relaxed);
+    }
+
+    float window_max_bps() const
+    {
+        return window_max_bps_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Amount of audio to buffer before starting playback
+     *
+     * The pessimistic side of the estimate (window minimum) is compared with the stream bitrate: the closer the
+     * link is to the bitrate, the longer the prebuffer needed to ride out dips.
+     *
+     * @param bitrate_bps Stream bitrate, 0 if unknown
+     * @return Prebuffer duration in milliseconds
+     */
+    uint32_t prebuffer_ms(
+            uint32_t bitrate_bps) const
+    {
+        if (!has_estimate())
+        {
+            return 1000;
+        }
+
+        float headroom = window_min_bps() / (bitrate_bps > 0 ? bitrate_bps : DEFAULT_BITRATE_BPS);
+
+        if (headroom >= 4.0f)
+        {
+            return 300;
+        }
+        else if (headroom >= 2.0f)
+        {
+            return 700;
+        }
+        else if (headroom >= 1.2f)
+        {
+            return 1500;
+        }
+
+        return 4000;
+    }
+
+    /**
+     * @brief Amount of audio to prefetch ahead of the playback position
+     *
+     * The configured lookahead is stretched when the link is close to the stream bitrate, so fetching starts
+     * earlier and more segments are kept buffered.
+     *
+     * @param base_ms Configured lookahead
+     * @param bitrate_bps Stream bitrate, 0 if unknown
+     * @return Lookahead duration in milliseconds
+     */
+    uint32_t lookahead_ms(
+            uint32_t base_ms,
+            uint32_t bitrate_bps) const
+    {
+        if (!has_estimate())
+        {
+            return base_ms;
+        }
+
+        float headroom = window_min_bps() / (bitrate_bps > 0 ? bitrate_bps : DEFAULT_BITRATE_BPS);
+
+        if (headroom < 1.2f)
+        {
+            return base_ms * 2;
+        }
+        else if (headroom < 2.0f)
+        {
+            return base_ms * 3 / 2;
+        }
+
+        return base_ms;
+    }
+
+private:
+
+    BandwidthEstimator()
+        : ewma_metric_(Metrics::get_instance().gauge("cactus_net_goodput_ewma_bps",
+                "EWMA of the HTTP goodput in bits per second"))
+        , min_metric_(Metrics::get_instance().gauge("cactus_net_goodput_min_bps",
+                "Minimum HTTP goodput over the last window in bits per second"))
+        , max_metric_(Metrics::get_instance().gauge("cactus_net_goodput_max_bps",
+                "Maximum HTTP goodput over the last window in bits per second"))
+        , bytes_total_(Metrics::get_instance().counter("cactus_net_bytes_total",
+                "Total bytes received from HTTP streams"))
+        , stalls_total_(Metrics::get_instance().counter("cactus_net_stalls_total",
+                "HTTP reads that timed out or blocked for more than 500 ms"))
+    {
+    }
+
+    void add_sample(
+            float sample_bps)
+    {
+        window_[window_pos_] = sample_bps;
+        window_pos_ = (window_pos_ + 1) % WINDOW_SIZE;
+        samples_++;
+
+        size_t valid = std::min(samples_, WINDOW_SIZE);
+        auto [min_it, max_it] = std::minmax_element(window_.begin(), window_.begin() + valid);
+
+        float ewma = (samples_ == 1) ? sample_bps : ewma_bps() + EWMA_ALPHA * (sample_bps - ewma_bps());
+
+        ewma_bps_.store(ewma, std::memory_order_relaxed);
+        window_min_bps_.store(*min_it, std::memory_order_relaxed);
+        window_max_bps_.store(*max_it, std::memory_order_relaxed);
+
+        ewma_metric_.set(ewma);
+        min_metric_.set(*min_it);
+        max_metric_.set(*max_it);
+
+        ESP_LOGD(TAG, "Goodput sample: %.0f bps, EWMA: %.0f bps, min: %.0f bps, max: %.0f bps",
+                sample_bps, ewma, *min_it, *max_it);
+    }
+
+    // Only touched by the network task
+    size_t pending_bytes_ = 0;
+    int64_t pending_us_ = 0;
+    std::array<float, WINDOW_SIZE> window_ = {};
+    size_t window_pos_ = 0;
+    size_t samples_ = 0;
+
+    // Read from any task
+    std::atomic<float> ewma_bps_ = 0.0f;
+    std::atomic<float> window_min_bps_ = 0.0f;
+    std::atomic<float> window_max_bps_ = 0.0f;
+
+    Metric& ewma_metric_;
+    Metric& min_metric_;
+    Metric& max_metric_;
+    Metric& bytes_total_;
+    Metric& stalls_total_;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Second order filter sections of the equalizer, designed in double and quantized to Q28
+ *
+ * The responses are the usual cookbook ones (R. Bristow-Johnson). Q28 keeps 28 fractional bits, enough for poles a
+ * few Hz from DC at 48 kHz, and coefficients up to 8 so that shelves of up to MAX_GAIN_DB still fit.
+ */
+class Biquad
+{
+public:
+
+    static constexpr int FRACTION_BITS = 28;
+    static constexpr float MAX_GAIN_DB = 15.0f;
+
+    enum class Type : uint8_t
+    {
+        OFF,
+        LOW_SHELF,
+        HIGH_SHELF,
+        PEAKING,
+        HIGH_PASS,
+        // Coefficients given as is, e.g. exported by a room measurement tool
+        RAW,
+        COUNT
+    };
+
+    static constexpr const char* NAMES[] = {"off", "low_shelf", "high_shelf", "peaking", "high_pass", "raw"};
+
+    /**
+     * @brief y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2], normalized to a0 = 1
+     */
+    struct Coefficients
+    {
+        int32_t b0;
+        int32_t b1;
+        int32_t b2;
+        int32_t a1;
+        int32_t a2;
+    };
+
+    static const char* name(
+            Type type)
+    {
+        return type < Type::COUNT ? NAMES[static_cast<size_t>(type)] : "unknown";
+    }
+
+    /**
+     * @return false if the name is unknown
+     */
+    static bool parse(
+            const char* name,
+            Type& type)
+    {
+        for (size_t i = 0; i < static_cast<size_t>(Type::COUNT); i++)
+        {
+            if (strcmp(name, NAMES[i]) == 0)
+            {
+                type = static_cast<Type>(i);
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @param frequency Corner or center frequency in Hz
+     * @param gain_db Gain of the shelf or peak, ignored by the high-pass
+     * @param q Quality factor, 0.707 for a flat high-pass or shelf
+     * @return false if a parameter is out of range
+     */
+    static bool design(
+            Type type,
+            float frequency,
+            float gain_db,
+            float q,
+            uint32_t sample_rate,
+            Coefficients& coefficients)
+    {
+        if (!(frequency >= 10.0f && frequency <= sample_rate * 0.45f) || !(q >= 0.1f && q <= 20.0f) ||
+                !(std::fabs(gain_db) <= MAX_GAIN_DB))
+        {
+            return false;
+        }
+
+        double a = std::pow(10.0, gain_db / 40.0);
+        double w0 = 2.0 * M_PI * frequency / sample_rate;
+        double cos_w0 = std::cos(w0);
+        double alpha = std::sin(w0) / (2.0 * q);
+        double shelf = 2.0 * std::sqrt(a) * alpha;
+
+        double b[3];
+        double den[3];
+
+        switch (type)
+        {
+        case Type::LOW_SHELF:
+            b[0] = a * ((a + 1) - (a - 1) * cos_w0 + shelf);
+            b[1] = 2 * a * ((a - 1) - (a + 1) * cos_w0);
+            b[2] = a * ((a + 1) - (a - 1) * cos_w0 - shelf);
+            den[0] = (a + 1) + (a - 1) * cos_w0 + shelf;
+            den[1] = -2 * ((a - 1) + (a + 1) * cos_w0);
+            den[2] = (a + 1) + (a - 1) * cos_w0 - shelf;
+            break;
+
+        case Type::HIGH_SHELF:
+            b[0] = a * ((a + 1) + (a - 1) * cos_w0 + shelf);
+            b[1] = -2 * a * ((a - 1) + (a + 1) * cos_w0);
+            b[2] = a * ((a + 1) + (a - 1) * cos_w0 - shelf);
+            den[0] = (a + 1) - (a - 1) * cos_w0 + shelf;
+            den[1] = 2 * ((a - 1) - (a + 1) * cos_w0);
+            den[2] = (a + 1) - (a - 1) * cos_w0 - shelf;
+            break;
+
+        case Type::PEAKING:
+            b[0] = 1 + alpha * a;
+            b[1] = -2 * cos_w0;
+            b[2] = 1 - alpha * a;
+            den[0] = 1 + alpha / a;
+            den[1] = -2 * cos_w0;
+            den[2] = 1 - alpha / a;
+            break;
+
+        case Type::HIGH_PASS:
+            b[0] = (1 + cos_w0) / 2;
+            b[1] = -(1 + cos_w0);
+            b[2] = (1 + cos_w0) / 2;
+            den[0] = 1 + alpha;
+            den[1] = -2 * cos_w0;
+            den[2] = 1 - alpha;
+            break;
+
+        default:
+            return false;
+        }
+
+        return quantize(b[0] / den[0], b[1] / den[0], b[2] / den[0], den[1] / den[0], den[2] / den[0], coefficients);
+    }
+
+    /**
+     * @return false if a coefficient doesn't fit in Q28 or the poles are outside the unit circle
+     */
+    static bool quantize(
+            double b0,
+            double b1,
+            double b2,
+            double a1,
+            double a2,
+            Coefficients& coefficients)
+    {
+        static constexpr double ONE = 1 << FRACTION_BITS;
+        static constexpr double LIMIT = INT32_MAX / ONE;
+
+        if (!(std::fabs(b0) < LIMIT && std::fabs(b1) < LIMIT && std::fabs(b2) < LIMIT && std::fabs(a1) < LIMIT &&
+                std::fabs(a2) < LIMIT))
+        {
+            return false;
+        }
+
+        // Stability triangle
+        if (!(std::fabs(a2) < 1.0 && std::fabs(a1) < 1.0 + a2))
+        {
+            return false;
+        }
+
+        coefficients.b0 = std::lround(b0 * ONE);
+        coefficients.b1 = std::lround(b1 * ONE);
+        coefficients.b2 = std::lround(b2 * ONE);
+        coefficients.a1 = std::lround(a1 * ONE);
+        coefficients.a2 = std::lround(a2 * ONE);
+
+        return true;
+    }
+
+    static double to_double(
+            int32_t coefficient)
+    {
+        return static_cast<double>(coefficient) / (1 << FRACTION_BITS);
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <string>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <esp_http_server.h>
+
+#include <Metrics.hpp>
+
+/**
+ * @brief HTTP server available once the device is connected, used to export metrics and control the player
+ */
+class ControlServer
+{
+    static constexpr const char* TAG = "ControlServer";
+
+public:
+
+    static ControlServer& get_instance()
+    {
+        static ControlServer server;
+
+        return server;
+    }
+
+    /**
+     * @brief Starts the HTTP server, shall be called after the Wi-Fi connection is established
+     */
+    void start()
+    {
+        if (server_ != nullptr)
+        {
+            return;
+        }
+
+        httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+        config.lru_purge_enable = true;
+        config.core_id = 0;
+        config.max_uri_handlers = 16;
+
+        ESP_ERROR_CHECK(httpd_start(&server_, &config));
+
+        register_uri("/metrics", HTTP_GET, ControlServer::serve_metrics, this);
+
+        ESP_LOGI(TAG, "Control server started");
+    }
+
+    /**
+     * @brief Registers a handler on the control server
+     *
+     * @param uri URI to serve
+     * @param method HTTP method
+     * @param handler Request handler
+     * @param ctx Context available in the handler as req->user_ctx
+     */
+    void register_uri(
+            const char* uri,
+            httpd_method_t method,
+            esp_err_t (* handler)(httpd_req_t* req),
+            void* ctx)
+    {
+        httpd_uri_t config = {};
+        config.uri = uri;
+        config.method = method;
+        config.handler = handler;
+        config.user_ctx = ctx;
+
+        if (ESP_OK != httpd_register_uri_handler(server_, &config))
+        {
+            ESP_LOGE(TAG, "Failed to register handler for %s", uri);
+        }
+    }
+
+private:
+
+    ControlServer()
+        : rssi_(Metrics::get_instance().gauge("cactus_wifi_rssi_dbm", "RSSI of the connected access point"))
+        , core_load_{
+            &Metrics::get_instance().gauge("cactus_cpu0_load_pct", "Core 0 time not spent idle since the last scrape"),
+            &Metrics::get_instance().gauge("cactus_cpu1_load_pct", "Core 1 time not spent idle since the last scrape")}
+    {
+    }
+
+    void update_core_load()
+    {
+        int64_t now = esp_timer_get_time();
+
+        for (BaseType_t core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            // Run time counters are in microseconds of esp_timer
+            uint32_t idle_us = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+
+            if (last_scrape_us_ != 0 && now > last_scrape_us_)
+            {
+                float idle = static_cast<float>(idle_us - last_idle_us_[core]) / (now - last_scrape_us_);
+                core_load_[core]->set(std::max(0.0f, 100.0f * (1.0f - idle)));
+            }
+
+            last_idle_us_[core] = idle_us;
+        }
+
+        last_scrape_us_ = now;
+    }
+
+    static esp_err_t serve_metrics(
+            httpd_req_t* req)
+    {
+        ControlServer& server = *static_cast<ControlServer*>(req->user_ctx);
+
+        // Wi-Fi conditions are sampled on each scrape to correlate them with the network metrics
+        wifi_ap_record_t ap_info = {};
+
+        if (ESP_OK == esp_wifi_sta_get_ap_info(&ap_info))
+        {
+            server.rssi_.set(ap_info.rssi);
+        }
+
+        server.update_core_load();
+
+        std::string body = Metrics::get_instance().render();
+
+        httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+        return httpd_resp_send(req, body.c_str(), body.size());
+    }
+
+    httpd_handle_t server_ = nullptr;
+    Metric& rssi_;
+
+    std::array<Metric*, portNUM_PROCESSORS> core_load_;
+    std::array<uint32_t, portNUM_PROCESSORS> last_idle_us_ = {};
+    int64_t last_scrape_us_ = 0;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+/**
+ * @brief Busy task loading the decoder core, to check how the pipeline behaves under CPU contention
+ *
+ * It runs above the base priority of the decoder and below its boosted priority, so the scenario reports
+ * show the underruns the priority boost avoids.
+ */
+class CpuStress
+{
+    static constexpr const char* TAG = "CpuStress";
+
+    static constexpr uint32_t PERIOD_MS = 100;
+    static constexpr UBaseType_t PRIORITY = 7;
+
+public:
+
+    /**
+     * @param load_pct Share of each period spent busy
+     */
+    static void start(
+            uint32_t load_pct)
+    {
+        xTaskCreatePinnedToCore(stress_task, "CPU_Stress", 2048, reinterpret_cast<void*>(load_pct), PRIORITY, NULL,
+                0);
+
+        ESP_LOGW(TAG, "Loading core 0 at %lu%%", load_pct);
+    }
+
+private:
+
+    static void stress_task(
+            void* arg)
+    {
+        uint32_t busy_us = reinterpret_cast<uintptr_t>(arg) * PERIOD_MS * 10;
+
+        while (true)
+        {
+            int64_t start = esp_timer_get_time();
+
+            while (esp_timer_get_time() - start < busy_us)
+            {
+            }
+
+            vTaskDelay(pdMS_TO_TICKS(PERIOD_MS) - pdMS_TO_TICKS(busy_us / 1000));
+        }
+    }
+};
@@ -0,0 +1,604 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include <sdkconfig.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_cpu.h>
+
+#include <AudioAnalyzer.hpp>
+#include <Dynamics.hpp>
+#include <Equalizer.hpp>
+#include <GainRamp.hpp>
+#include <LoudnessMeter.hpp>
+#include <MixBus.hpp>
+#include <Mixer.hpp>
+#include <Q15Gain.hpp>
+#include <Resampler.hpp>
+
+/**
+ * @brief Measures the cycles per sample of the audio kernels on the target and checks they are bit-exact
+ *
+ * Each kernel processes the same block of pseudo random samples ITERATIONS times, the best run is kept so that
+ * interrupts don't skew the result.
+ */
+class DSPBenchmark
+{
+    static constexpr const char* TAG = "DSPBenchmark";
+
+    // 1024 stereo samples, about the DMA buffer of the sink
+    static constexpr size_t SAMPLES = 2048;
+    static constexpr int ITERATIONS = 20;
+    static constexpr uint32_t GAIN = 18000;
+    static constexpr uint32_t CPU_HZ = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1000 * 1000;
+
+    // Budget of each equalizer section, 8 sections at 48 kHz stereo take 12.8% of a core
+    static constexpr float EQUALIZER_SECTION_CYCLES = 40.0f;
+
+public:
+
+    static void run()
+    {
+        ESP_LOGI(TAG, "Benchmarking audio kernels on %zu samples", SAMPLES);
+
+        benchmark_gain();
+        benchmark_mixer();
+        benchmark_pack();
+        benchmark_resampler();
+        benchmark_equalizer();
+        benchmark_dynamics();
+        benchmark_loudness();
+        benchmark_analyzer();
+    }
+
+private:
+
+    static void fill(
+            int16_t* data,
+            size_t count,
+            uint32_t seed = 12345)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            data[i] = seed >> 16;
+        }
+    }
+
+    /**
+     * @brief The same samples widened to the MixBus
+     */
+    static void fill(
+            int32_t* data,
+            size_t count,
+            uint32_t seed = 12345)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            data[i] = MixBus::widen(seed >> 16);
+        }
+    }
+
+    template<typename Sample, typename Kernel>
+    static float cycles_per_sample(
+            Sample* data,
+            Kernel kernel)
+    {
+        uint32_t best = UINT32_MAX;
+
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            fill(data, SAMPLES);
+
+            uint32_t start = esp_cpu_get_cycle_count();
+            kernel();
+            best = std::min(best, esp_cpu_get_cycle_count() - start);
+        }
+
+        return static_cast<float>(best) / SAMPLES;
+    }
+
+    /**
+     * @brief The Q15 gain on 16 bits samples, before the output moved to the MixBus
+     *
+     * On the ESP32-S3 the aligned part is scaled 8 samples per instruction with the PIE vector extensions, the rest
+     * uses the scalar loop. Both round down like an arithmetic shift, so they give the same output.
+     */
+    static void apply_gain(
+            std::span<int16_t> samples,
+            uint32_t gain)
+    {
+        int16_t* data = samples.data();
+        size_t count = samples.size();
+
+#if CONFIG_IDF_TARGET_ESP32S3
+        // Vector loads and stores ignore the low 4 bits of the address, scale the head until it is aligned
+        size_t head = std::min(count, ((16 - (reinterpret_cast<uintptr_t>(data) & 15)) / 2) & 7);
+        apply_gain_scalar(data, head, gain);
+        data += head;
+        count -= head;
+
+        size_t blocks = count / 8;
+
+        if (blocks > 0)
+        {
+            apply_gain_pie(data, blocks, gain);
+            data += blocks * 8;
+            count -= blocks * 8;
+        }
+#endif // CONFIG_IDF_TARGET_ESP32S3
+
+        apply_gain_scalar(data, count, gain);
+    }
+
+    static void apply_gain_scalar(
+            int16_t* data,
+            size_t count,
+            uint32_t gain)
+    {
+        int32_t scale = gain;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            data[i] = (data[i] * scale) >> 15;
+        }
+    }
+
+#if CONFIG_IDF_TARGET_ESP32S3
+    /**
+     * @brief Scales blocks of 8 samples with EE.VMUL.S16, which shifts each product right by SAR
+     *
+     * @param data 16 bytes aligned
+     * @param blocks Number of 8 samples blocks, at least 1
+     */
+    static void apply_gain_pie(
+            int16_t* data,
+            size_t blocks,
+            uint32_t gain)
+    {
+        int16_t scale = gain;
+
+        // q0 and q1 aren't declared, like in Resampler::dot_pie GCC doesn't allocate them. Neither does it keep a
+        // value in SAR, it sets SAR right before each variable shift.
+        asm volatile (
+            "wsr.sar %[shift]\n"
+            "ee.vldbc.16 q1, %[scale]\n"
+            "1:\n"
+            "ee.vld.128.ip q0, %[data], 0\n"
+            "ee.vmul.s16 q0, q0, q1\n"
+            "ee.vst.128.ip q0, %[data], 16\n"
+            "addi %[blocks], %[blocks], -1\n"
+            "bnez %[blocks], 1b\n"
+            : [data] "+r" (data), [blocks] "+r" (blocks)
+            : [scale] "r" (&scale), [shift] "r" (15)
+            : "memory");
+    }
+#endif // CONFIG_IDF_TARGET_ESP32S3
+
+    static void benchmark_gain()
+    {
+        alignas(16) static int16_t data[SAMPLES];
+        alignas(16) static int16_t reference[SAMPLES];
+        alignas(16) static int32_t bus_data[SAMPLES];
+
+        // The loop I2SSink::write used before the Q15 kernel, one stereo sample at a time
+        float legacy = cycles_per_sample(data, []()
+                {
+                    uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+
+                    for (size_t i = 0; i + 3 < SAMPLES * sizeof(int16_t); i += 4)
+                    {
+                        if (reinterpret_cast<uintptr_t>(&bytes[i]) % 2 != 0 ||
+                                reinterpret_cast<uintptr_t>(&bytes[i + 2]) % 2 != 0)
+                        {
+                            continue;
+                        }
+
+                        int16_t& left = *reinterpret_cast<int16_t*>(&bytes[i]);
+                        int16_t& right = *reinterpret_cast<int16_t*>(&bytes[i + 2]);
+
+                        left = (static_cast<int32_t>(left) * GAIN) >> 15;
+                        right = (static_cast<int32_t>(right) * GAIN) >> 15;
+                    }
+                });
+
+        memcpy(reference, data, sizeof(reference));
+
+        float scalar = cycles_per_sample(data, []()
+                {
+                    apply_gain_scalar(data, SAMPLES, GAIN);
+                });
+
+        bool scalar_exact = memcmp(reference, data, sizeof(reference)) == 0;
+
+        float vector = cycles_per_sample(data, []()
+                {
+                    apply_gain(std::span<int16_t>(data, SAMPLES), GAIN);
+                });
+
+        bool vector_exact = memcmp(reference, data, sizeof(reference)) == 0;
+
+        // Misaligned by one stereo sample to include the scalar head and tail
+        float misaligned = cycles_per_sample(data, []()
+                {
+                    apply_gain(std::span<int16_t>(data + 2, SAMPLES - 4), GAIN);
+                });
+
+        // The same gain on the MixBus, scalar, the only one the player uses once the volume ramp settled
+        float bus = cycles_per_sample(bus_data, []()
+                {
+                    Q15Gain::apply(std::span<int32_t>(bus_data, SAMPLES), GAIN);
+                });
+
+        ESP_LOGI(TAG, "Gain: legacy %.2f, Q15 scalar %.2f (%s), Q15 PIE %.2f (%s), Q15 PIE misaligned %.2f, bus %.2f "
+                "cycles/sample (%.2f%% of a core)", legacy, scalar, scalar_exact ? "bit-exact" : "MISMATCH", vector,
+                vector_exact ? "bit-exact" : "MISMATCH", misaligned, bus,
+                bus * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 / CPU_HZ);
+    }
+
+    static void benchmark_mixer()
+    {
+        static constexpr size_t VOICES = 3;
+
+        alignas(16) static int16_t data[SAMPLES];
+        alignas(16) static int32_t bus[SAMPLES];
+        alignas(16) static int16_t voice_data[VOICES][SAMPLES];
+        static int32_t reference[SAMPLES];
+        static GainRamp gain(GAIN);
+
+        for (size_t v = 0; v < VOICES; v++)
+        {
+            fill(voice_data[v], SAMPLES, v + 1);
+        }
+
+        // The voices end at different points to exercise the segments
+        static const std::span<const int16_t> voices[VOICES] = {
+            std::span<const int16_t>(voice_data[0], SAMPLES),
+            std::span<const int16_t>(voice_data[1], SAMPLES / 2),
+            std::span<const int16_t>(voice_data[2], SAMPLES / 4)
+        };
+
+        // The passes I2SSink::write did before the fused mixer: gain, mute, then one wrapping loop per beep
+        float legacy = cycles_per_sample(data, []()
+                {
+                    apply_gain_scalar(data, SAMPLES, GAIN);
+
+                    for (const auto& voice : voices)
+                    {
+                        for (size_t i = 0; i < voice.size(); i++)
+                        {
+                            data[i] += voice[i];
+                        }
+                    }
+                });
+
+        float fused[VOICES + 1];
+        bool exact = true;
+
+        for (size_t count = 0; count <= VOICES; count++)
+        {
+            fused[count] = cycles_per_sample(bus, [count]()
+                    {
+                        Mixer::mix(std::span<int32_t>(bus, SAMPLES), gain,
+                                std::span<const std::span<const int16_t>>(voices, count));
+                    });
+
+            // Reference: the same mix on the bus pass by pass, saturated at the end
+            fill(reference, SAMPLES);
+
+            for (size_t i = 0; i < SAMPLES; i++)
+            {
+                reference[i] = (static_cast<int64_t>(reference[i]) * GAIN) >> 15;
+            }
+
+            for (size_t v = 0; v < count; v++)
+            {
+                for (size_t i = 0; i < voices[v].size(); i++)
+                {
+                    reference[i] += MixBus::widen(voices[v][i]);
+                }
+            }
+
+            for (size_t i = 0; i < SAMPLES; i++)
+            {
+                exact = exact && bus[i] == std::clamp<int32_t>(reference[i], -MixBus::HEADROOM, MixBus::HEADROOM);
+            }
+        }
+
+        // A volume change ramping over the whole block, the worst case of fast knob turns
+        gain.set_length(SAMPLES);
+
+        float ramping = cycles_per_sample(bus, []()
+                {
+                    gain.set_target(gain.target() == GAIN ? GAIN / 2 : GAIN);
+                    Mixer::mix(std::span<int32_t>(bus, SAMPLES), gain, {});
+                });
+
+        ESP_LOGI(TAG, "Mixer: legacy 3 beeps %.2f, fused 0 voices %.2f, 1 voice %.2f, 3 voices %.2f, ramping %.2f "
+                "cycles/sample (%s)", legacy, fused[0], fused[1], fused[3], ramping, exact ? "bit-exact" : "MISMATCH");
+    }
+
+    static void benchmark_pack()
+    {
+        alignas(16) static int32_t bus[SAMPLES];
+        alignas(16) static int16_t output[SAMPLES];
+        alignas(16) static int32_t slots[SAMPLES];
+        alignas(16) static int16_t reference[SAMPLES];
+        static MixBus packer(0);
+
+        // Widened 16-bit samples have no fraction, they aren't dithered and come back unchanged
+        float exact_cycles = cycles_per_sample(bus, []()
+                {
+                    packer.pack(std::span<const int32_t>(bus, SAMPLES), std::span<int16_t>(output, SAMPLES));
+                });
+
+        fill(reference, SAMPLES);
+        bool exact = memcmp(reference, output, sizeof(output)) == 0;
+
+        // After a gain nearly every sample has a fraction and is dithered
+        uint32_t best = UINT32_MAX;
+
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            fill(bus, SAMPLES);
+            Q15Gain::apply(std::span<int32_t>(bus, SAMPLES), GAIN);
+
+            uint32_t start = esp_cpu_get_cycle_count();
+            packer.pack(std::span<const int32_t>(bus, SAMPLES), std::span<int16_t>(output, SAMPLES));
+            best = std::min(best, esp_cpu_get_cycle_count() - start);
+        }
+
+        float dithered = static_cast<float>(best) / SAMPLES;
+
+        float wide = cycles_per_sample(bus, []()
+                {
+                    packer.pack(std::span<const int32_t>(bus, SAMPLES), std::span<int32_t>(slots, SAMPLES));
+                });
+
+        ESP_LOGI(TAG, "Pack: 16 bits %.2f (%s), dithered %.2f, 32 bits %.2f cycles/sample", exact_cycles,
+                exact ? "bit-exact" : "MISMATCH", dithered, wide);
+    }
+
+    static void benchmark_resampler()
+    {
+        struct Ratio
+        {
+            uint32_t sample_rate;
+            uint8_t channels;
+        };
+
+        static constexpr Ratio RATIOS[] = {{44100, 2}, {44100, 1}, {22050, 2}, {32000, 2}, {16000, 1}, {96000, 2},
+                {48000, 2}, {48000, 1}};
+
+        // Half as many input frames as the other kernels, the output has up to 3 times more
+        static constexpr size_t FRAMES = SAMPLES / 2;
+
+        alignas(16) static int16_t input[SAMPLES];
+        static int32_t output[SAMPLES * 3 + Resampler::TAPS * 2];
+        static int32_t reference[SAMPLES * 3 + Resampler::TAPS * 2];
+        static Resampler resampler;
+
+        for (const Ratio& ratio : RATIOS)
+        {
+            if (!resampler.configure(ratio.sample_rate, ratio.channels))
+            {
+                continue;
+            }
+
+            // The same input for both kernels, restarting from an empty history
+            std::span<const int16_t> block(input, FRAMES * ratio.channels);
+            size_t consumed = 0;
+            size_t frames = 0;
+            uint32_t scalar = UINT32_MAX;
+            uint32_t vector = UINT32_MAX;
+
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                fill(input, SAMPLES);
+                resampler.reset();
+
+                uint32_t start = esp_cpu_get_cycle_count();
+                frames = resampler.process_scalar(block, reference, consumed);
+                scalar = std::min(scalar, esp_cpu_get_cycle_count() - start);
+
+                resampler.reset();
+
+                start = esp_cpu_get_cycle_count();
+                resampler.process(block, output, consumed);
+                vector = std::min(vector, esp_cpu_get_cycle_count() - start);
+            }
+
+            bool exact = memcmp(reference, output, frames * Resampler::OUTPUT_CHANNELS * sizeof(int32_t)) == 0;
+
+            // Cost per output frame and share of a core at the output rate
+            float scalar_cycles = static_cast<float>(scalar) / frames;
+            float vector_cycles = static_cast<float>(vector) / frames;
+
+            ESP_LOGI(TAG, "Resampler %lu Hz %u ch: scalar %.2f, vector %.2f cycles/frame (%.2f%% of a core, %s)",
+                    ratio.sample_rate, ratio.channels, scalar_cycles, vector_cycles,
+                    vector_cycles * Resampler::OUTPUT_RATE * 100 / CPU_HZ, exact ? "bit-exact" : "MISMATCH");
+        }
+    }
+
+    static void benchmark_equalizer()
+    {
+        static constexpr size_t SECTIONS[] = {2, 4, 8};
+
+        alignas(16) static int32_t data[SAMPLES];
+        static double reference[SAMPLES];
+        static Equalizer equalizer(Resampler::OUTPUT_RATE);
+
+        for (size_t count : SECTIONS)
+        {
+            // Alternating boosts and cuts an octave apart from 60 Hz
+            for (size_t i = 0; i < Equalizer::MAX_SECTIONS; i++)
+            {
+                equalizer.set_section(i, i < count ? Biquad::Type::PEAKING : Biquad::Type::OFF, 60 << i,
+                        i % 2 == 0 ? 6.0f : -6.0f, 1.0f);
+            }
+
+            float cycles = cycles_per_sample(data, []()
+                    {
+                        equalizer.process(std::span<int32_t>(data, SAMPLES));
+                    });
+
+            // Reference: the same quantized coefficients in double, from silence, 12 dB below full scale
+            Equalizer::Settings settings = equalizer.settings();
+
+            fill(data, SAMPLES);
+
+            for (size_t i = 0; i < SAMPLES; i++)
+            {
+                data[i] /= 4;
+                reference[i] = data[i];
+            }
+
+            for (size_t s = 0; s < count; s++)
+            {
+                const Biquad::Coefficients& c = settings.sections[s].coefficients;
+                double state[2][4] = {};
+
+                for (size_t i = 0; i < SAMPLES; i++)
+                {
+                    double* z = state[i % 2];
+                    double x = reference[i];
+                    double y = Biquad::to_double(c.b0) * x + Biquad::to_double(c.b1) * z[0] +
+                            Biquad::to_double(c.b2) * z[1] - Biquad::to_double(c.a1) * z[2] -
+                            Biquad::to_double(c.a2) * z[3];
+
+                    z[1] = z[0];
+                    z[0] = x;
+                    z[3] = z[2];
+                    z[2] = y;
+                    reference[i] = y;
+                }
+            }
+
+            equalizer.reset();
+            equalizer.process(std::span<int32_t>(data, SAMPLES));
+
+            // In 16-bit LSB
+            double error = 0;
+
+            for (size_t i = 0; i < SAMPLES; i++)
+            {
+                error = std::max(error, std::fabs(data[i] - reference[i]) / (1 << MixBus::EXTRA_BITS));
+            }
+
+            float budget = EQUALIZER_SECTION_CYCLES * count;
+
+            ESP_LOGI(TAG, "Equalizer %zu sections: %.2f cycles/sample (%.2f%% of a core, budget %.2f%%), max error "
+                    "%.2f LSB", count, cycles, cycles * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 /
+                    CPU_HZ, budget * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 / CPU_HZ, error);
+        }
+    }
+
+    static void benchmark_dynamics()
+    {
+        // 8 dB of makeup over full scale noise, so that the limiter works on every block
+        static constexpr Dynamics::Settings SETTINGS = {-12.0f, 3.0f, 5.0f, 150.0f, 8.0f, -1.0f};
+
+        alignas(16) static int32_t data[SAMPLES];
+        static Dynamics dynamics(Resampler::OUTPUT_RATE, SETTINGS);
+
+        float cycles = cycles_per_sample(data, []()
+                {
+                    dynamics.process(std::span<int32_t>(data, SAMPLES));
+                });
+
+        int32_t peak = 0;
+
+        for (size_t i = 0; i < SAMPLES; i++)
+        {
+            peak = std::max<int32_t>(peak, std::abs(data[i]));
+        }
+
+        int32_t ceiling = std::lround(std::pow(10.0f, SETTINGS.ceiling_db / 20.0f) * MixBus::FULL_SCALE);
+
+        ESP_LOGI(TAG, "Dynamics: %.2f cycles/sample (%.2f%% of a core), reduction %.1f dB, peak %ld (%s)", cycles,
+                cycles * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 / CPU_HZ,
+                dynamics.take_reduction_db(), peak, peak <= ceiling ? "under the ceiling" : "OVER THE CEILING");
+    }
+
+    static void benchmark_loudness()
+    {
+        alignas(16) static int32_t data[SAMPLES];
+        static LoudnessMeter meter;
+
+        float cycles = cycles_per_sample(data, []()
+                {
+                    meter.process(std::span<const int32_t>(data, SAMPLES));
+                });
+
+        // Reference: a 1 kHz sine at -20 dBFS on both channels reads -20 LUFS
+        meter.reset();
+
+        for (size_t frame = 0; meter.seconds() < 5.0f;)
+        {
+            for (size_t i = 0; i < SAMPLES; i += 2, frame++)
+            {
+                data[i] = MixBus::widen(std::lround(3277 * std::sin(2 * M_PI * 1000 * frame / Resampler::OUTPUT_RATE)));
+                data[i + 1] = data[i];
+            }
+
+            meter.process(std::span<const int32_t>(data, SAMPLES));
+        }
+
+        float lufs = 0;
+        meter.integrated(lufs);
+
+        ESP_LOGI(TAG, "Loudness meter: %.2f cycles/sample (%.2f%% of a core), 1 kHz at -20 dBFS reads %.2f LUFS",
+                cycles, cycles * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 / CPU_HZ, lufs);
+    }
+
+    static void benchmark_analyzer()
+    {
+        alignas(16) static int16_t data[SAMPLES];
+        static AudioAnalyzer analyzer;
+
+        // Nothing was pushed yet, so the analysis task doesn't use the FFT buffers
+        for (size_t i = 0; i < AudioAnalyzer::FFT_SIZE; i++)
+        {
+            analyzer.history_[i] = std::sin(2 * M_PI * 1000 * i / Resampler::OUTPUT_RATE);
+        }
+
+        uint32_t start = esp_cpu_get_cycle_count();
+        std::array<float, AudioAnalyzer::BANDS> bands = analyzer.spectrum();
+        uint32_t spectrum = esp_cpu_get_cycle_count() - start;
+
+        float level = *std::max_element(bands.begin(), bands.end());
+
+        // The tap is drained between pushes, so that each one is a copy rather than a drop
+        uint32_t best = UINT32_MAX;
+        fill(data, SAMPLES);
+
+        for (int i = 0; i < ITERATIONS; i++)
+        {
+            vTaskDelay(pdMS_TO_TICKS(AudioAnalyzer::PERIOD_MS * 2));
+
+            start = esp_cpu_get_cycle_count();
+            analyzer.push(std::span<const int16_t>(data, SAMPLES));
+            best = std::min(best, esp_cpu_get_cycle_count() - start);
+        }
+
+        float push = static_cast<float>(best) / SAMPLES;
+
+        ESP_LOGI(TAG, "Analyzer tap: %.2f cycles/sample (%.2f%% of a core), %.0f frames dropped", push,
+                push * Resampler::OUTPUT_RATE * Resampler::OUTPUT_CHANNELS * 100 / CPU_HZ,
+                analyzer.dropped_.get());
+        ESP_LOGI(TAG, "Analyzer spectrum: %lu cycles (%.2f%% of a core at %lu Hz), 1 kHz sine peaks at %.2f dB",
+                spectrum, spectrum * 100.0f * 1000 / AudioAnalyzer::PERIOD_MS / CPU_HZ,
+                1000 / AudioAnalyzer::PERIOD_MS, level);
+    }
+};
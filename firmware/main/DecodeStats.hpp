@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include <esp_cpu.h>
+
+#include <Metrics.hpp>
+
+/**
+ * @brief Decode timing and health counters shared by all the decoders
+ *
+ * Each decode call is timed with the cycle counter of the core running it. The decoder task is pinned to a core,
+ * so the delta is valid, although it also includes the time the task was preempted. The real-time factor is the
+ * decode time over the duration of the decoded audio, computed over windows of WINDOW_US of audio: the closer it
+ * gets to 1, the closer the decoder core is to missing its deadline.
+ *
+ * Only the decoder task records frames, the window isn't protected against concurrent use.
+ */
+class DecodeStats
+{
+    static constexpr uint32_t CYCLES_PER_US = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    static constexpr uint64_t WINDOW_US = 1000 * 1000;
+
+    // An MP3 frame lasts 24-26 ms at 44.1-48 kHz, an Opus packet usually 20 ms
+    static constexpr std::array<float, 10> FRAME_US_BUCKETS = {
+        250, 500, 1000, 1500, 2000, 3000, 5000, 10000, 20000, 40000
+    };
+
+public:
+
+    static DecodeStats& get_instance()
+    {
+        static DecodeStats stats;
+
+        return stats;
+    }
+
+    /**
+     * @brief Gets the current cycle count, to be passed to frame_decoded after the decode call
+     */
+    static uint32_t start()
+    {
+        return esp_cpu_get_cycle_count();
+    }
+
+    /**
+     * @brief Records a decode call
+     *
+     * @param start_cycles Value returned by start before the call
+     * @param samples Samples per channel decoded by the call
+     * @param sample_rate Sample rate of the decoded audio
+     */
+    void frame_decoded(
+            uint32_t start_cycles,
+            uint32_t samples,
+            uint32_t sample_rate)
+    {
+        // Unsigned arithmetic handles the counter wrapping, every ~18 s at 240 MHz
+        uint32_t decode_us = (esp_cpu_get_cycle_count() - start_cycles) / CYCLES_PER_US;
+
+        frame_us_.observe(decode_us);
+        frames_.add();
+
+        if (samples == 0 || sample_rate == 0)
+        {
+            return;
+        }
+
+        uint64_t audio_us = static_cast<uint64_t>(samples) * 1000 * 1000 / sample_rate;
+
+        window_decode_us_ += decode_us;
+        window_audio_us_ += audio_us;
+        window_peak_load_ = std::max(window_peak_load_, static_cast<float>(decode_us) / audio_us);
+
+        if (window_audio_us_ >= WINDOW_US)
+        {
+            realtime_factor_.set(static_cast<float>(window_decode_us_) / window_audio_us_);
+            peak_frame_load_.set(window_peak_load_ * 100.0f);
+
+            window_decode_us_ = 0;
+            window_audio_us_ = 0;
+            window_peak_load_ = 0.0f;
+        }
+    }
+
+    /**
+     * @brief Records a decode call that failed, the frame is dropped
+     */
+    void decode_error()
+    {
+        errors_.add();
+    }
+
+    /**
+     * @brief Records the loss of frame or page sync in the middle of a stream
+     */
+    void sync_error()
+    {
+        sync_errors_.add();
+    }
+
+    /**
+     * @brief Records sync acquired again after being lost
+     */
+    void resync()
+    {
+        resyncs_.add();
+    }
+
+    /**
+     * @brief Records bytes dropped while looking for sync
+     */
+    void skipped(
+            size_t bytes)
+    {
+        skipped_bytes_.add(bytes);
+    }
+
+private:
+
+    DecodeStats()
+        : frame_us_(Metrics::get_instance().histogram("cactus_decoder_frame_us",
+                "Time spent in each decode call", FRAME_US_BUCKETS))
+        , realtime_factor_(Metrics::get_instance().gauge("cactus_decoder_realtime_factor",
+                "Decode time over decoded audio duration in the last second"))
+        , peak_frame_load_(Metrics::get_instance().gauge("cactus_decoder_peak_frame_load_pct",
+                "Highest decode time over frame duration in the last second"))
+        , frames_(Metrics::get_instance().counter("cactus_decoder_frames_total", "Frames decoded"))
+        , errors_(Metrics::get_instance().counter("cactus_decoder_errors_total", "Frames the decoder failed to decode"))
+        , sync_errors_(Metrics::get_instance().counter("cactus_decoder_sync_errors_total",
+                "Times frame or page sync was lost"))
+        , resyncs_(Metrics::get_instance().counter("cactus_decoder_resyncs_total",
+                "Times sync was acquired again after being lost"))
+        , skipped_bytes_(Metrics::get_instance().counter("cactus_decoder_skipped_bytes_total",
+                "Bytes dropped while looking for sync"))
+    {
+    }
+
+    Histogram& frame_us_;
+    Metric& realtime_factor_;
+    Metric& peak_frame_load_;
+    Metric& frames_;
+    Metric& errors_;
+    Metric& sync_errors_;
+    Metric& resyncs_;
+    Metric& skipped_bytes_;
+
+    uint64_t window_decode_us_ = 0;
+    uint64_t window_audio_us_ = 0;
+    float window_peak_load_ = 0.0f;
+};
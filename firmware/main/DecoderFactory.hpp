@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <strings.h>
+
+#include <esp_log.h>
+
+#include <AudioDecoder.hpp>
+#include <DecoderPool.hpp>
+
+/**
+ * @brief Gets the decoder matching a stream from its first bytes, falling back to the Content-Type
+ */
+class DecoderFactory
+{
+    static constexpr const char* TAG = "DecoderFactory";
+
+public:
+
+    // Enough for every signature, including the Opus header in the first Ogg page
+    static constexpr size_t SNIFF_SIZE = 64;
+
+    static std::unique_ptr<AudioDecoder> create(
+            std::span<const uint8_t> head,
+            const std::string& content_type)
+    {
+        AudioCodec format = sniff(head);
+
+        if (format == AudioCodec::UNKNOWN)
+        {
+            format = from_content_type(content_type);
+        }
+
+        if (format == AudioCodec::UNKNOWN)
+        {
+            ESP_LOGW(TAG, "Unknown format (Content-Type \"%s\"), assuming MP3", content_type.c_str());
+            format = AudioCodec::MP3;
+        }
+
+        return DecoderPool::get_instance().acquire(format);
+    }
+
+    static AudioCodec sniff(
+            std::span<const uint8_t> head)
+    {
+        auto starts_with = [&](size_t offset, const char* signature)
+                {
+                    size_t length = strlen(signature);
+
+                    return head.size() >= offset + length && memcmp(head.data() + offset, signature, length) == 0;
+                };
+
+        if (starts_with(0, "ID3"))
+        {
+            // Tagged AAC exists but tags are mostly found on MP3
+            return AudioCodec::MP3;
+        }
+
+        if (starts_with(0, "fLaC"))
+        {
+            return AudioCodec::FLAC;
+        }
+
+        if (starts_with(0, "RIFF") && starts_with(8, "WAVE"))
+        {
+            return AudioCodec::WAV;
+        }
+
+        if (starts_with(4, "ftyp"))
+        {
+            return AudioCodec::M4A;
+        }
+
+        if (starts_with(0, "OggS"))
+        {
+            // The identification header is the only packet of the first page
+            std::string_view page(reinterpret_cast<const char*>(head.data()), head.size());
+
+            return page.find("OpusHead") != std::string_view::npos ? AudioCodec::OPUS : AudioCodec::UNKNOWN;
+        }
+
+        if (head.size() >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0)
+        {
+            // Frame sync, the layer bits are 00 for ADTS and never for MPEG audio
+            return (head[1] & 0x06) == 0 ? AudioCodec::AAC : AudioCodec::MP3;
+        }
+
+        return AudioCodec::UNKNOWN;
+    }
+
+    static AudioCodec from_content_type(
+            const std::string& content_type)
+    {
+        auto is = [&](const char* type)
+                {
+                    return strncasecmp(content_type.c_str(), type, strlen(type)) == 0;
+                };
+
+        if (is("audio/mpeg") || is("audio/mp3"))
+        {
+            return AudioCodec::MP3;
+        }
+
+        if (is("audio/aac") || is("audio/aacp") || is("audio/x-aac"))
+        {
+            return AudioCodec::AAC;
+        }
+
+        if (is("audio/mp4") || is("audio/x-m4a") || is("audio/m4a"))
+        {
+            return AudioCodec::M4A;
+        }
+
+        if (is("audio/flac") || is("audio/x-flac"))
+        {
+            return AudioCodec::FLAC;
+        }
+
+        if (is("audio/ogg") || is("audio/opus"))
+        {
+            return AudioCodec::OPUS;
+        }
+
+        if (is("audio/wav") || is("audio/x-wav") || is("audio/wave"))
+        {
+            return AudioCodec::WAV;
+        }
+
+        return AudioCodec::UNKNOWN;
+    }
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <array>
+#include <memory>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <decoder/esp_audio_dec.h>
+#include <simple_dec/esp_audio_simple_dec.h>
+
+#include <AudioDecoder.hpp>
+#include <MP3Decoder.hpp>
+#include <SimpleDecoder.hpp>
+#include <PCMDecoder.hpp>
+#include <OggOpusDecoder.hpp>
+#include <Metrics.hpp>
+
+/**
+ * @brief Keeps the decoder of the previous track of each codec to reuse it for the next one
+ *
+ * A reused decoder is reset instead of reallocated, saving the codec state and buffer allocations on every
+ * track change. Only one track plays at a time so a single idle instance per codec is kept.
+ */
+class DecoderPool
+{
+    static constexpr const char* TAG = "DecoderPool";
+
+public:
+
+    static DecoderPool& get_instance()
+    {
+        static DecoderPool pool;
+
+        return pool;
+    }
+
+    /**
+     * @brief Gets a decoder ready for a new track, reused if one of the codec is idle
+     */
+    std::unique_ptr<AudioDecoder> acquire(
+            AudioCodec codec)
+    {
+        int64_t start = esp_timer_get_time();
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        std::unique_ptr<AudioDecoder> decoder = std::move(idle_[static_cast<size_t>(codec)]);
+        xSemaphoreGive(mutex_);
+
+        bool reused = static_cast<bool>(decoder);
+
+        if (reused)
+        {
+            decoder->reset();
+            hits_.add();
+        }
+        else
+        {
+            decoder = create(codec);
+            misses_.add();
+        }
+
+        last_setup_us_ = esp_timer_get_time() - start;
+        setup_time_.set(last_setup_us_);
+
+        ESP_LOGI(TAG, "%s decoder %s in %lld us", decoder->name(), reused ? "reused" : "created",
+                last_setup_us_);
+
+        return decoder;
+    }
+
+    /**
+     * @brief Returns the decoder of a finished track to the pool
+     */
+    void release(
+            std::unique_ptr<AudioDecoder> decoder)
+    {
+        if (!decoder)
+        {
+            return;
+        }
+
+        size_t index = static_cast<size_t>(decoder->codec());
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        idle_[index] = std::move(decoder);
+        xSemaphoreGive(mutex_);
+    }
+
+    /**
+     * @brief Gets the time the last acquire took, reset or allocation included
+     */
+    int64_t last_setup_us() const
+    {
+        return last_setup_us_;
+    }
+
+private:
+
+    DecoderPool()
+        : hits_(Metrics::get_instance().counter("cactus_decoder_pool_hits_total",
+                "Tracks decoded by a reused decoder"))
+        , misses_(Metrics::get_instance().counter("cactus_decoder_pool_misses_total",
+                "Tracks that needed a new decoder"))
+        , setup_time_(Metrics::get_instance().gauge("cactus_decoder_setup_us",
+                "Time to get the decoder of the last track ready, reset or allocation"))
+    {
+        mutex_ = xSemaphoreCreateMutex();
+
+        // Codecs and container parsers are registered once for all decoders
+        esp_audio_err_t ret = esp_audio_dec_register_default();
+
+        if (ret == ESP_AUDIO_ERR_OK)
+        {
+            ret = esp_audio_simple_dec_register_default();
+        }
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGE(TAG, "Failed to register decoders with error %d", ret);
+        }
+    }
+
+    static std::unique_ptr<AudioDecoder> create(
+            AudioCodec codec)
+    {
+        switch (codec)
+        {
+            case AudioCodec::AAC:
+                return std::make_unique<SimpleDecoder>(ESP_AUDIO_SIMPLE_DEC_TYPE_AAC, codec, "AAC");
+
+            case AudioCodec::M4A:
+                return std::make_unique<SimpleDecoder>(ESP_AUDIO_SIMPLE_DEC_TYPE_M4A, codec, "M4A");
+
+            case AudioCodec::FLAC:
+                return std::make_unique<SimpleDecoder>(ESP_AUDIO_SIMPLE_DEC_TYPE_FLAC, codec, "FLAC");
+
+            case AudioCodec::OPUS:
+                return std::make_unique<OggOpusDecoder>();
+
+            case AudioCodec::WAV:
+                return std::make_unique<PCMDecoder>();
+
+            default:
+                return std::make_unique<MP3Decoder>();
+        }
+    }
+
+    SemaphoreHandle_t mutex_;
+    std::array<std::unique_ptr<AudioDecoder>, static_cast<size_t>(AudioCodec::COUNT)> idle_;
+    int64_t last_setup_us_ = 0;
+
+    Metric& hits_;
+    Metric& misses_;
+    Metric& setup_time_;
+};
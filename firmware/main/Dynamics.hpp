@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+
+#include <MixBus.hpp>
+
+/**
+ * @brief Compressor followed by a look-ahead peak limiter, applied to the stereo MixBus in place
+ *
+ * The output is delayed by LOOKAHEAD_FRAMES, two blocks of BLOCK_FRAMES. Once per block, the compressor envelope
+ * follows the peak of the newest block with its attack and release, the level above the threshold is divided by
+ * the ratio and the makeup gain is added. The limiter then lowers that gain just enough for the peaks of the block
+ * about to be output and of the newest one to stay under the ceiling, and recovers with its own release.
+ *
+ * Per sample only the delay line and a linear gain ramp between the gains of consecutive blocks run, in fixed
+ * point. Both ends of the ramp keep the block in between under the ceiling, so no sample exceeds it. The channels
+ * share the gain so the stereo image doesn't move. Peaks above full scale, e.g. beeps over loud music, are seen as
+ * they are and brought under the ceiling too.
+ */
+class Dynamics
+{
+    // The gain is computed once per block, 0.67 ms at 48 kHz
+    static constexpr size_t BLOCK_FRAMES = 32;
+    static constexpr uint8_t CHANNELS = 2;
+
+    // Gains up to twice MAX_MAKEUP_DB in Q24
+    static constexpr int GAIN_BITS = 24;
+
+    static constexpr float LIMITER_RELEASE_MS = 50.0f;
+    static constexpr float FULL_SCALE = MixBus::FULL_SCALE;
+
+    // The ceiling is lowered by a thousandth of a dB so that the float gain computer can't round over it
+    static constexpr float CEILING_MARGIN = 0.9999f;
+
+public:
+
+    static constexpr size_t LOOKAHEAD_FRAMES = BLOCK_FRAMES * 2;
+    static constexpr float MAX_MAKEUP_DB = 12.0f;
+
+    struct Settings
+    {
+        // Level where compression starts, in dBFS
+        float threshold_db;
+        // Level increase above the threshold for 1 dB at the output
+        float ratio;
+        float attack_ms;
+        float release_ms;
+        // Gain after compression, making the music louder
+        float makeup_db;
+        // Highest output peak, in dBFS
+        float ceiling_db;
+    };
+
+    Dynamics(
+            uint32_t sample_rate,
+            const Settings& settings)
+    {
+        float block_ms = 1000.0f * BLOCK_FRAMES / sample_rate;
+
+        threshold_ = std::pow(10.0f, settings.threshold_db / 20.0f);
+        slope_ = 1.0f - 1.0f / std::max(settings.ratio, 1.0f);
+        attack_ = 1.0f - std::exp(-block_ms / std::max(settings.attack_ms, block_ms));
+        release_ = 1.0f - std::exp(-block_ms / std::max(settings.release_ms, block_ms));
+        limiter_release_ = 1.0f - std::exp(-block_ms / LIMITER_RELEASE_MS);
+        makeup_ = std::pow(10.0f, std::clamp(settings.makeup_db, 0.0f, MAX_MAKEUP_DB) / 20.0f);
+        ceiling_ = std::pow(10.0f, std::min(settings.ceiling_db, 0.0f) / 20.0f) * CEILING_MARGIN;
+
+        // On the heap rather than inline, the sink holding it lives on the player task stack
+        delay_ = static_cast<int32_t*>(heap_caps_malloc(LOOKAHEAD_FRAMES * CHANNELS * sizeof(int32_t),
+                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        // Like the sink holding it, the output can't run without it
+        ESP_ERROR_CHECK(delay_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+
+        reset();
+    }
+
+    ~Dynamics()
+    {
+        heap_caps_free(delay_);
+    }
+
+    Dynamics(const Dynamics&) = delete;
+    Dynamics& operator=(const Dynamics&) = delete;
+
+    /**
+     * @brief Clears the delay line and the envelopes
+     */
+    void reset()
+    {
+        std::fill(delay_, delay_ + LOOKAHEAD_FRAMES * CHANNELS, 0);
+        std::fill(std::begin(peaks_), std::end(peaks_), 0);
+        index_ = 0;
+        peak_ = 0;
+        envelope_ = 0.0f;
+        limiter_ = 1.0f;
+        gain_ = to_fixed(makeup_);
+        target_ = gain_;
+        step_ = 0;
+        reduction_ = 1.0f;
+    }
+
+    /**
+     * @brief Adds to the makeup gain from the next block, e.g. to raise a quiet track under the ceiling
+     */
+    void set_trim_db(
+            float trim_db)
+    {
+        trim_ = std::pow(10.0f, std::clamp(trim_db, 0.0f, MAX_MAKEUP_DB) / 20.0f);
+    }
+
+    /**
+     * @brief Deepest gain reduction below the makeup gain since the last call, 0 or less
+     */
+    float take_reduction_db()
+    {
+        float reduction_db = 20.0f * std::log10(reduction_);
+        reduction_ = 1.0f;
+
+        return reduction_db;
+    }
+
+    /**
+     * @param samples Interleaved stereo MixBus samples, replaced by the output LOOKAHEAD_FRAMES earlier
+     */
+    void process(
+            std::span<int32_t> samples)
+    {
+        size_t frames = samples.size() / CHANNELS;
+        size_t position = 0;
+
+        while (position < frames)
+        {
+            size_t count = std::min(frames - position, BLOCK_FRAMES - index_ % BLOCK_FRAMES);
+
+            apply(samples.data() + position * CHANNELS, count);
+            position += count;
+
+            if (index_ % BLOCK_FRAMES == 0)
+            {
+                next_block();
+            }
+        }
+    }
+
+private:
+
+    static int32_t to_fixed(
+            float gain)
+    {
+        // Truncated so that the ramp never exceeds the gain computed
+        return static_cast<int32_t>(gain * (1 << GAIN_BITS));
+    }
+
+    /**
+     * @brief Swaps frames with the delay line within a block, ramping the gain of the delayed ones
+     */
+    void apply(
+            int32_t* samples,
+            size_t frames)
+    {
+        int32_t* delayed = delay_ + index_ * CHANNELS;
+        int32_t gain = gain_;
+        int32_t step = step_;
+        int32_t peak = peak_;
+
+        for (size_t i = 0; i < frames * CHANNELS; i += CHANNELS)
+        {
+            int32_t left = samples[i];
+            int32_t right = samples[i + 1];
+
+            peak = std::max(peak, std::max(std::abs(left), std::abs(right)));
+            gain += step;
+
+            samples[i] = scale(delayed[i], gain);
+            samples[i + 1] = scale(delayed[i + 1], gain);
+            delayed[i] = left;
+            delayed[i + 1] = right;
+        }
+
+        gain_ = gain;
+        peak_ = peak;
+        index_ = (index_ + frames) % LOOKAHEAD_FRAMES;
+    }
+
+    static int32_t scale(
+            int32_t sample,
+            int32_t gain)
+    {
+        int64_t scaled = (static_cast<int64_t>(sample) * gain + (1 << (GAIN_BITS - 1))) >> GAIN_BITS;
+
+        return std::clamp<int64_t>(scaled, -MixBus::HEADROOM, MixBus::HEADROOM);
+    }
+
+    /**
+     * @brief Computes the gain the next block ramps to, once the newest block is in the delay line
+     */
+    void next_block()
+    {
+        // The newest block is the half before index_, the other one is output next
+        size_t newest = index_ == 0 ? 1 : 0;
+        peaks_[newest] = peak_;
+        peak_ = 0;
+
+        float level = peaks_[newest] / FULL_SCALE;
+        envelope_ += (level - envelope_) * (level > envelope_ ? attack_ : release_);
+
+        float makeup = makeup_ * trim_;
+        float gain = makeup;
+
+        if (envelope_ > threshold_)
+        {
+            gain *= std::pow(threshold_ / envelope_, slope_);
+        }
+
+        float peak = std::max(peaks_[0], peaks_[1]) / FULL_SCALE;
+        float needed = peak * gain > ceiling_ ? ceiling_ / (peak * gain) : 1.0f;
+
+        // Instant attack, the ramp spreads it over the block before the peak
+        limiter_ = needed < limiter_ ? needed : limiter_ + (needed - limiter_) * limiter_release_;
+
+        float target = gain * limiter_;
+        reduction_ = std::min(reduction_, target / makeup);
+
+        // Exactly at the previous target, the steps may have rounded
+        gain_ = target_;
+        target_ = to_fixed(target);
+        step_ = (target_ - gain_) / static_cast<int32_t>(BLOCK_FRAMES);
+    }
+
+    float threshold_;
+    float slope_;
+    float attack_;
+    float release_;
+    float limiter_release_;
+    float makeup_;
+    float ceiling_;
+    float trim_ = 1.0f;
+
+    int32_t* delay_ = nullptr;
+    int32_t peaks_[2];
+    size_t index_;
+    int32_t peak_;
+
+    float envelope_;
+    float limiter_;
+    int32_t gain_;
+    int32_t target_;
+    int32_t step_;
+    float reduction_;
+};
@@ -0,0 +1,415 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <span>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <nvs.h>
+
+#include <Biquad.hpp>
+#include <MixBus.hpp>
+
+/**
+ * @brief Cascade of up to MAX_SECTIONS biquads tuning the speaker, applied to the stereo output in place
+ *
+ * Each section is a direct form I filter with 32-bit state and Q28 coefficients summed in 64 bits. The fraction
+ * dropped by each output is added back to the next one (error feedback), which keeps the noise of bass sections
+ * low. The samples are filtered on the MixBus, they saturate at HEADROOM_DB above full scale.
+ *
+ * Like the esp-dsp kernels, the chunk goes through one section at a time with its coefficients and state held in
+ * registers, both channels in the same loop. The settings are changed by the control task and picked up before the
+ * next chunk, they are persisted in NVS with save().
+ */
+class Equalizer
+{
+    static constexpr const char* TAG = "Equalizer";
+
+    static constexpr const char* NVS_NAMESPACE = "cactus";
+    static constexpr const char* NVS_KEY = "eq";
+
+    // Bumped when Settings changes, older blobs are ignored
+    static constexpr uint8_t VERSION = 1;
+
+public:
+
+    static constexpr size_t MAX_SECTIONS = 8;
+    static constexpr uint8_t CHANNELS = 2;
+    static constexpr float HEADROOM_DB = 18.0f;
+    static constexpr float MIN_PREAMP_DB = -24.0f;
+
+    struct Section
+    {
+        Biquad::Type type;
+        float frequency;
+        float gain_db;
+        float q;
+        Biquad::Coefficients coefficients;
+    };
+
+    /**
+     * @brief Stored as is in NVS
+     */
+    struct Settings
+    {
+        uint8_t version;
+        uint32_t sample_rate;
+        // Attenuation ahead of the sections, leaving room for their boosts
+        float preamp_db;
+        std::array<Section, MAX_SECTIONS> sections;
+    };
+
+    explicit Equalizer(
+            uint32_t sample_rate)
+        : sample_rate_(sample_rate)
+    {
+        tables_ = static_cast<Tables*>(heap_caps_calloc(1, sizeof(Tables), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        // Like the sink holding it, the output can't run without it
+        ESP_ERROR_CHECK(tables_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+
+        tables_->settings = {VERSION, sample_rate, 0.0f, {}};
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    ~Equalizer()
+    {
+        vSemaphoreDelete(mutex_);
+        heap_caps_free(tables_);
+    }
+
+    Equalizer(const Equalizer&) = delete;
+    Equalizer& operator=(const Equalizer&) = delete;
+
+    /**
+     * @brief Restores the settings saved in NVS, the equalizer stays flat if there are none
+     */
+    bool load()
+    {
+        nvs_handle_t handle;
+
+        if (ESP_OK != nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle))
+        {
+            ESP_LOGI(TAG, "No saved settings");
+            return false;
+        }
+
+        // Read in place rather than through a copy on the caller's stack, the sink loads it from the player task
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        Settings& settings = tables_->settings;
+        size_t size = sizeof(settings);
+        esp_err_t err = nvs_get_blob(handle, NVS_KEY, &settings, &size);
+        nvs_close(handle);
+
+        bool valid = size == sizeof(settings) && settings.version == VERSION && settings.sample_rate == sample_rate_;
+
+        if (err != ESP_OK || !valid)
+        {
+            settings = {VERSION, sample_rate_, 0.0f, {}};
+        }
+        else
+        {
+            changed_.store(true, std::memory_order_release);
+        }
+
+        xSemaphoreGive(mutex_);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGI(TAG, "No saved settings");
+            return false;
+        }
+
+        if (!valid)
+        {
+            ESP_LOGW(TAG, "Ignoring saved settings of another format");
+            return false;
+        }
+
+        ESP_LOGI(TAG, "Loaded saved settings");
+
+        return true;
+    }
+
+    /**
+     * @brief Persists the current settings in NVS, from the control task
+     */
+    bool save()
+    {
+        Settings settings = this->settings();
+        nvs_handle_t handle;
+
+        if (ESP_OK != nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle))
+        {
+            ESP_LOGE(TAG, "Failed to open NVS");
+            return false;
+        }
+
+        esp_err_t err = nvs_set_blob(handle, NVS_KEY, &settings, sizeof(settings));
+
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+
+        nvs_close(handle);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to save settings: %s", esp_err_to_name(err));
+            return false;
+        }
+
+        return true;
+    }
+
+    Settings settings() const
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        Settings settings = tables_->settings;
+        xSemaphoreGive(mutex_);
+
+        return settings;
+    }
+
+    /**
+     * @brief Designs a section, Biquad::Type::OFF removes it, can be called from any task
+     *
+     * @return false if the index or a parameter is out of range, the section is then unchanged
+     */
+    bool set_section(
+            size_t index,
+            Biquad::Type type,
+            float frequency,
+            float gain_db,
+            float q)
+    {
+        Section section = {type, frequency, gain_db, q, {}};
+
+        if (type != Biquad::Type::OFF &&
+                !Biquad::design(type, frequency, gain_db, q, sample_rate_, section.coefficients))
+        {
+            return false;
+        }
+
+        return set(index, section);
+    }
+
+    /**
+     * @brief Sets the coefficients of a section directly, normalized to a0 = 1, can be called from any task
+     */
+    bool set_coefficients(
+            size_t index,
+            double b0,
+            double b1,
+            double b2,
+            double a1,
+            double a2)
+    {
+        Section section = {Biquad::Type::RAW, 0.0f, 0.0f, 0.0f, {}};
+
+        if (!Biquad::quantize(b0, b1, b2, a1, a2, section.coefficients))
+        {
+            return false;
+        }
+
+        return set(index, section);
+    }
+
+    bool set_preamp(
+            float preamp_db)
+    {
+        if (!(preamp_db >= MIN_PREAMP_DB && preamp_db <= 0.0f))
+        {
+            return false;
+        }
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        tables_->settings.preamp_db = preamp_db;
+        changed_.store(true, std::memory_order_release);
+        xSemaphoreGive(mutex_);
+
+        return true;
+    }
+
+    /**
+     * @brief Clears the filter state, e.g. before processing unrelated audio
+     */
+    void reset()
+    {
+        tables_->states = {};
+    }
+
+    /**
+     * @param samples Interleaved stereo MixBus samples, filtered in place
+     */
+    void process(
+            std::span<int32_t> samples)
+    {
+        update();
+
+        for (size_t section = 0; section < count_; section++)
+        {
+            filter(samples.data(), samples.size() / CHANNELS, section);
+        }
+    }
+
+private:
+
+    struct State
+    {
+        int32_t x1[CHANNELS];
+        int32_t x2[CHANNELS];
+        int32_t y1[CHANNELS];
+        int32_t y2[CHANNELS];
+        uint32_t error[CHANNELS];
+    };
+
+    bool set(
+            size_t index,
+            const Section& section)
+    {
+        if (index >= MAX_SECTIONS)
+        {
+            return false;
+        }
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        tables_->settings.sections[index] = section;
+        changed_.store(true, std::memory_order_release);
+        xSemaphoreGive(mutex_);
+
+        return true;
+    }
+
+    /**
+     * @brief Picks up the new settings from the audio task, without waiting if the control task holds them
+     */
+    void update()
+    {
+        if (!changed_.load(std::memory_order_acquire) || pdTRUE != xSemaphoreTake(mutex_, 0))
+        {
+            return;
+        }
+
+        changed_.store(false, std::memory_order_relaxed);
+        count_ = 0;
+
+        for (size_t slot = 0; slot < MAX_SECTIONS; slot++)
+        {
+            const Section& section = tables_->settings.sections[slot];
+
+            // The state of the sections kept is carried over so that tuning while playing doesn't click
+            if (section.type == Biquad::Type::OFF)
+            {
+                tables_->states[slot] = {};
+                continue;
+            }
+
+            tables_->coefficients[count_] = section.coefficients;
+            tables_->slots[count_] = slot;
+            count_++;
+        }
+
+        if (count_ > 0 && tables_->settings.preamp_db < 0.0f)
+        {
+            // Folded in the numerator of the first section, in Q30
+            int64_t preamp = std::lround(std::pow(10.0, tables_->settings.preamp_db / 20.0) * (1 << 30));
+
+            Biquad::Coefficients& first = tables_->coefficients[0];
+            first.b0 = (first.b0 * preamp) >> 30;
+            first.b1 = (first.b1 * preamp) >> 30;
+            first.b2 = (first.b2 * preamp) >> 30;
+        }
+
+        xSemaphoreGive(mutex_);
+    }
+
+    /**
+     * @brief Output of one channel, saving the dropped fraction for the next one
+     */
+    static int32_t quantize(
+            int64_t sum,
+            uint32_t& error)
+    {
+        error = static_cast<uint32_t>(sum) & ((1u << Biquad::FRACTION_BITS) - 1);
+
+        return std::clamp<int64_t>(sum >> Biquad::FRACTION_BITS, -MixBus::HEADROOM, MixBus::HEADROOM);
+    }
+
+    void filter(
+            int32_t* samples,
+            size_t frames,
+            size_t section)
+    {
+        const int64_t b0 = tables_->coefficients[section].b0;
+        const int64_t b1 = tables_->coefficients[section].b1;
+        const int64_t b2 = tables_->coefficients[section].b2;
+        const int64_t a1 = tables_->coefficients[section].a1;
+        const int64_t a2 = tables_->coefficients[section].a2;
+
+        // Copied to locals so that the loop keeps them in registers
+        State& state = tables_->states[tables_->slots[section]];
+        int32_t left_x1 = state.x1[0];
+        int32_t left_x2 = state.x2[0];
+        int32_t left_y1 = state.y1[0];
+        int32_t left_y2 = state.y2[0];
+        uint32_t left_error = state.error[0];
+        int32_t right_x1 = state.x1[1];
+        int32_t right_x2 = state.x2[1];
+        int32_t right_y1 = state.y1[1];
+        int32_t right_y2 = state.y2[1];
+        uint32_t right_error = state.error[1];
+
+        for (size_t i = 0; i < frames; i++)
+        {
+            int32_t left = samples[i * 2];
+            int32_t right = samples[i * 2 + 1];
+
+            int64_t left_sum = b0 * left + b1 * left_x1 + b2 * left_x2 - a1 * left_y1 - a2 * left_y2 + left_error;
+            int64_t right_sum = b0 * right + b1 * right_x1 + b2 * right_x2 - a1 * right_y1 - a2 * right_y2 +
+                    right_error;
+
+            left_x2 = left_x1;
+            left_x1 = left;
+            left_y2 = left_y1;
+            left_y1 = quantize(left_sum, left_error);
+
+            right_x2 = right_x1;
+            right_x1 = right;
+            right_y2 = right_y1;
+            right_y1 = quantize(right_sum, right_error);
+
+            samples[i * 2] = left_y1;
+            samples[i * 2 + 1] = right_y1;
+        }
+
+        state = {{left_x1, right_x1}, {left_x2, right_x2}, {left_y1, right_y1}, {left_y2, right_y2},
+                {left_error, right_error}};
+    }
+
+    /**
+     * @brief On the heap rather than inline, the sink holding the equalizer lives on the player task stack
+     */
+    struct Tables
+    {
+        Settings settings;
+        // Sections in use, only touched by the audio task
+        std::array<Biquad::Coefficients, MAX_SECTIONS> coefficients;
+        std::array<size_t, MAX_SECTIONS> slots;
+        std::array<State, MAX_SECTIONS> states;
+    };
+
+    const uint32_t sample_rate_;
+    Tables* tables_ = nullptr;
+    mutable SemaphoreHandle_t mutex_;
+    std::atomic<bool> changed_ = false;
+    size_t count_ = 0;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <esp_log.h>
+
+#include <decoder/esp_audio_dec.h>
+
+#include <MP3Backend.hpp>
+
+/**
+ * @brief MP3 backend based on the esp_audio_codec decoder, optimized by Espressif for their cores
+ */
+class EspMP3Backend : public MP3Backend
+{
+    static constexpr const char* TAG = "EspMP3Backend";
+
+public:
+
+    EspMP3Backend()
+    {
+        esp_audio_dec_cfg_t config = {};
+        config.type = ESP_AUDIO_TYPE_MP3;
+
+        esp_audio_err_t ret = esp_audio_dec_open(&config, &handle_);
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open MP3 decoder with error %d", ret);
+            handle_ = NULL;
+        }
+    }
+
+    ~EspMP3Backend() override
+    {
+        if (handle_ != NULL)
+        {
+            esp_audio_dec_close(handle_);
+        }
+    }
+
+    bool decode(
+            std::span<const uint8_t> frame,
+            std::span<uint8_t> pcm,
+            size_t& decoded) override
+    {
+        decoded = 0;
+
+        if (handle_ == NULL)
+        {
+            return false;
+        }
+
+        esp_audio_dec_in_raw_t raw = {};
+        raw.buffer = const_cast<uint8_t*>(frame.data());
+        raw.len = frame.size();
+
+        esp_audio_dec_out_frame_t out = {};
+        out.buffer = pcm.data();
+        out.len = pcm.size();
+
+        esp_audio_err_t ret = esp_audio_dec_process(handle_, &raw, &out);
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGW(TAG, "Failed to decode frame with error %d", ret);
+
+            return false;
+        }
+
+        decoded = out.decoded_size;
+
+        return true;
+    }
+
+    void reset() override
+    {
+        if (handle_ != NULL)
+        {
+            esp_audio_dec_reset(handle_);
+        }
+    }
+
+    const char* name() const override
+    {
+        return "esp_audio_codec";
+    }
+
+private:
+
+    esp_audio_dec_handle_t handle_ = NULL;
+};
@@ -10,7 +10,8 @@ enum class Event
     BUTTON_LONG_CLICKED,
     TURNED_RIGHT,
     TURNED_LEFT,
-    SONG_END
+    SONG_END,
+    STREAM_TITLE_CHANGED
 };
 
 class EventQueue
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#include <Q15Gain.hpp>
+
+/**
+ * @brief Gain moving linearly to its target over a fixed number of samples, applied by Mixer
+ *
+ * The target is set by the control path and picked up by the mixer at the next chunk, the ramp itself is only
+ * touched by the task running the mixer. The gain is kept in Q30 so that slow ramps don't stall on rounding. The
+ * ramp steps every sample, the channels of a frame differ by one step which is far below audibility.
+ */
+class GainRamp
+{
+    static constexpr int EXTRA_BITS = 15;
+
+public:
+
+    /**
+     * @param gain Initial gain in Q15, already reached
+     * @param length Ramp duration in samples
+     */
+    GainRamp(
+            uint32_t gain = Q15Gain::UNITY,
+            uint32_t length = 1)
+        : target_(gain)
+        , reached_(gain)
+        , ramp_target_(gain)
+        , value_(static_cast<int32_t>(gain) << EXTRA_BITS)
+        , length_(length)
+    {
+    }
+
+    /**
+     * @brief Sets the gain to ramp to, can be called from any task
+     */
+    void set_target(
+            uint32_t gain)
+    {
+        target_.store(gain, std::memory_order_relaxed);
+    }
+
+    uint32_t target() const
+    {
+        return target_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Whether the gain reached the target, can be called from any task
+     */
+    bool settled() const
+    {
+        return reached_.load(std::memory_order_relaxed) == target();
+    }
+
+    /**
+     * @brief Sets the ramp duration in samples, from the mixer task
+     */
+    void set_length(
+            uint32_t length)
+    {
+        length_ = length > 0 ? length : 1;
+    }
+
+private:
+
+    friend class Mixer;
+
+    /**
+     * @brief Starts ramping to a new target, called by the mixer before each chunk
+     */
+    void prepare()
+    {
+        uint32_t target = this->target();
+
+        if (target == ramp_target_)
+        {
+            return;
+        }
+
+        ramp_target_ = target;
+
+        int32_t delta = (static_cast<int32_t>(target) << EXTRA_BITS) - value_;
+        remaining_ = length_;
+        step_ = delta / static_cast<int32_t>(length_);
+
+        // Too close to ramp, jump
+        if (step_ == 0)
+        {
+            finish();
+        }
+    }
+
+    uint32_t remaining() const
+    {
+        return remaining_;
+    }
+
+    uint32_t gain() const
+    {
+        return value_ >> EXTRA_BITS;
+    }
+
+    void advance(
+            uint32_t samples)
+    {
+        if (samples >= remaining_)
+        {
+            finish();
+
+            return;
+        }
+
+        value_ += step_ * static_cast<int32_t>(samples);
+        remaining_ -= samples;
+    }
+
+    void finish()
+    {
+        value_ = static_cast<int32_t>(ramp_target_) << EXTRA_BITS;
+        remaining_ = 0;
+        step_ = 0;
+        reached_.store(ramp_target_, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint32_t> target_;
+    std::atomic<uint32_t> reached_;
+
+    // Owned by the mixer task
+    uint32_t ramp_target_;
+    int32_t value_;
+    int32_t step_ = 0;
+    uint32_t remaining_ = 0;
+    uint32_t length_;
+};
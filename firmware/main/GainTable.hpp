@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include <Q15Gain.hpp>
+
+/**
+ * @brief Q15 gain of each volume step, computed at compile time
+ *
+ * Each step is 1 dB, from 0 dB down to MIN_DB which is silence.
+ */
+class GainTable
+{
+public:
+
+    static constexpr int8_t MIN_DB = -100;
+
+    /**
+     * @param db Volume in dB, clamped to MIN_DB..0
+     * @return Gain in Q15, Q15Gain::UNITY at 0 dB and 0 at MIN_DB
+     */
+    static constexpr uint32_t q15(
+            int8_t db)
+    {
+        if (db >= 0)
+        {
+            return Q15Gain::UNITY;
+        }
+
+        return TABLE[db <= MIN_DB ? -MIN_DB : -db];
+    }
+
+private:
+
+    static constexpr std::array<uint32_t, -MIN_DB + 1> TABLE = []()
+            {
+                // 10^(-1/20), the amplitude ratio of 1 dB
+                constexpr double STEP = 0.89125093813374556;
+
+                std::array<uint32_t, -MIN_DB + 1> table = {};
+                double gain = 1.0;
+
+                for (size_t i = 0; i < table.size(); i++)
+                {
+                    table[i] = static_cast<uint32_t>(gain * Q15Gain::UNITY + 0.5);
+                    gain *= STEP;
+                }
+
+                table.back() = 0;
+
+                return table;
+            }();
+};
@@ -0,0 +1,667 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_http_client.h>
+#include <esp_crt_bundle.h>
+
+#include <RingBuffer.hpp>
+#include <StreamSource.hpp>
+#include <TSDemuxer.hpp>
+#include <BandwidthEstimator.hpp>
+#include <Metrics.hpp>
+
+/**
+ * @brief HLS (m3u8) stream source
+ *
+ * A prefetch task loads the playlist and downloads the upcoming segments over a single keep-alive connection,
+ * keeping the configured lookahead buffered. The decoder task pulls whole segments from a queue and demuxes them
+ * into the decoder ring: MPEG-TS segments through TSDemuxer, packed audio segments (.aac, .mp3) as they are.
+ *
+ * Live playlists are reloaded every half target duration once all the known segments are fetched.
+ */
+class HLSStream : public StreamSource
+{
+    static constexpr const char* TAG = "HLSStream";
+
+    static constexpr uint32_t DEFAULT_LOOKAHEAD_S = 12;
+    static constexpr size_t MAX_QUEUED_SEGMENTS = 8;
+    static constexpr size_t MAX_SEGMENT_SIZE = 2 * 1024 * 1024;
+    static constexpr uint32_t MAX_SEGMENT_RETRIES = 3;
+
+    // Retries wait a quarter of the target duration more each time, the stop request is checked this often
+    static constexpr uint32_t RETRY_BACKOFF_DIVISOR = 4;
+    static constexpr uint32_t STOP_POLL_MS = 100;
+
+    // Live streams shall not start closer than three segments from the end of the playlist
+    static constexpr size_t LIVE_START_SEGMENTS = 3;
+
+    struct Segment
+    {
+        std::string url;
+        uint32_t sequence;
+        uint32_t duration_ms;
+    };
+
+    struct SegmentData
+    {
+        std::vector<uint8_t> data;
+        size_t position;
+        uint32_t duration_ms;
+        bool transport_stream;
+    };
+
+public:
+
+    HLSStream(
+            const std::string& url,
+            uint32_t lookahead_s = DEFAULT_LOOKAHEAD_S)
+        : playlist_url_(url)
+        , lookahead_ms_(lookahead_s * 1000)
+        , fetch_time_(Metrics::get_instance().gauge("cactus_hls_segment_fetch_ms",
+                "Time to download the last HLS segment"))
+        , first_byte_time_(Metrics::get_instance().gauge("cactus_hls_segment_first_byte_ms",
+                "Time to the response headers of the last HLS segment"))
+        , buffered_(Metrics::get_instance().gauge("cactus_hls_buffered_ms",
+                "Duration of the prefetched HLS segments"))
+        , segments_total_(Metrics::get_instance().counter("cactus_hls_segments_total",
+                "HLS segments downloaded"))
+        , segment_errors_(Metrics::get_instance().counter("cactus_hls_segment_errors_total",
+                "HLS segment downloads that failed"))
+    {
+        queue_ = xQueueCreate(MAX_QUEUED_SEGMENTS, sizeof(SegmentData*));
+
+        xTaskCreatePinnedToCore(
+            HLSStream::prefetch_task,
+            "HLS_Prefetch",
+            8192,
+            this,
+            4,
+            &prefetch_task_handle_,
+            0
+            );
+    }
+
+    ~HLSStream() override
+    {
+        stop_ = true;
+
+        // Wait while the prefetch task finishes its current request
+        while (!prefetch_finished_)
+        {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        SegmentData* segment = nullptr;
+
+        while (pdTRUE == xQueueReceive(queue_, &segment, 0))
+        {
+            delete segment;
+        }
+
+        delete current_;
+        vQueueDelete(queue_);
+
+        ESP_LOGI(TAG, "HLS stream destroyed");
+    }
+
+    int64_t available_data() override
+    {
+        if (current_ != nullptr || uxQueueMessagesWaiting(queue_) > 0)
+        {
+            return 1;
+        }
+
+        return prefetch_finished_ ? 0 : 1;
+    }
+
+    void read_http_stream(
+            RingBuffer& buffer) override
+    {
+        if (current_ == nullptr)
+        {
+            // Block a bit so the prefetch task can run while no segment is ready
+            if (pdTRUE != xQueueReceive(queue_, &current_, pdMS_TO_TICKS(20)))
+            {
+                return;
+            }
+        }
+
+        std::span<const uint8_t> pending(current_->data.data() + current_->position,
+                current_->data.size() - current_->position);
+
+        if (current_->transport_stream)
+        {
+            current_->position += demuxer_.demux(pending, buffer);
+
+            // Trailing bytes not forming a whole packet are dropped
+            if (current_->data.size() - current_->position < TSDemuxer::PACKET_SIZE)
+            {
+                current_->position = current_->data.size();
+            }
+        }
+        else
+        {
+            current_->position += buffer.write(pending);
+        }
+
+        if (current_->position == current_->data.size())
+        {
+            buffered_ms_ -= current_->duration_ms;
+            buffered_.set(buffered_ms_);
+
+            delete current_;
+            current_ = nullptr;
+        }
+    }
+
+private:
+
+    static void prefetch_task(
+            void* arg)
+    {
+        HLSStream& stream = *static_cast<HLSStream*>(arg);
+
+        ESP_LOGI(TAG, "HLS prefetch task started on core %d", xPortGetCoreID());
+
+        esp_http_client_config_t config = {};
+        config.url = stream.playlist_url_.c_str();
+        config.method = HTTP_METHOD_GET;
+        config.crt_bundle_attach = esp_crt_bundle_attach;
+        config.keep_alive_enable = true;
+
+        stream.client_ = esp_http_client_init(&config);
+
+        if (stream.client_ != NULL)
+        {
+            stream.prefetch();
+
+            esp_http_client_close(stream.client_);
+            esp_http_client_cleanup(stream.client_);
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Failed to initialize HTTP client");
+        }
+
+        ESP_LOGI(TAG, "HLS prefetch complete");
+
+        stream.prefetch_finished_ = true;
+        vTaskDelete(NULL);
+    }
+
+    void prefetch()
+    {
+        if (!load_playlist(playlist_url_))
+        {
+            return;
+        }
+
+        uint32_t retries = 0;
+
+        while (!stop_)
+        {
+            const Segment* segment = next_segment();
+
+            if (segment == nullptr)
+            {
+                if (endlist_)
+                {
+                    return;
+                }
+
+                // Live stream, wait for new segments
+                vTaskDelay(pdMS_TO_TICKS(target_duration_ms_ / 2));
+
+                if (!load_playlist(media_playlist_url_))
+                {
+                    vTaskDelay(pdMS_TO_TICKS(target_duration_ms_));
+                }
+
+                continue;
+            }
+
+            uint32_t lookahead_ms = BandwidthEstimator::get_instance().lookahead_ms(lookahead_ms_, bitrate_bps_);
+
+            if (buffered_ms_ >= lookahead_ms || uxQueueMessagesWaiting(queue_) == MAX_QUEUED_SEGMENTS)
+            {
+                vTaskDelay(pdMS_TO_TICKS(100));
+                continue;
+            }
+
+            SegmentData* data = fetch_segment(*segment);
+
+            if (data == nullptr)
+            {
+                segment_errors_.add();
+
+                if (++retries < MAX_SEGMENT_RETRIES)
+                {
+                    // A server error or a refused connection usually lasts longer than a few milliseconds
+                    wait(target_duration_ms_ * retries / RETRY_BACKOFF_DIVISOR);
+                    continue;
+                }
+
+                ESP_LOGW(TAG, "Skipping segment %lu after %lu retries", segment->sequence, retries);
+            }
+
+            retries = 0;
+            next_sequence_ = segment->sequence + 1;
+
+            if (data != nullptr)
+            {
+                buffered_ms_ += data->duration_ms;
+                buffered_.set(buffered_ms_);
+                xQueueSend(queue_, &data, portMAX_DELAY);
+            }
+        }
+    }
+
+    /**
+     * @brief Sleeps up to ms, returning early once the stream is stopped
+     */
+    void wait(
+            uint32_t ms)
+    {
+        for (uint32_t waited = 0; waited < ms && !stop_; waited += STOP_POLL_MS)
+        {
+            vTaskDelay(pdMS_TO_TICKS(std::min(STOP_POLL_MS, ms - waited)));
+        }
+    }
+
+    const Segment* next_segment()
+    {
+        for (const Segment& segment : segments_)
+        {
+            if (segment.sequence >= next_sequence_)
+            {
+                return &segment;
+            }
+        }
+
+        return nullptr;
+    }
+
+    SegmentData* fetch_segment(
+            const Segment& segment)
+    {
+        SegmentData* data = new SegmentData();
+        data->position = 0;
+        data->duration_ms = segment.duration_ms;
+
+        int64_t start = esp_timer_get_time();
+        int64_t first_byte = 0;
+
+        if (!fetch(segment.url, data->data, first_byte))
+        {
+            delete data;
+
+            return nullptr;
+        }
+
+        int64_t elapsed = esp_timer_get_time() - start;
+
+        fetch_time_.set(elapsed / 1000.0f);
+        first_byte_time_.set((first_byte - start) / 1000.0f);
+        segments_total_.add();
+
+        if (segment.duration_ms > 0)
+        {
+            bitrate_bps_ = data->data.size() * 8 * 1000ULL / segment.duration_ms;
+        }
+
+        data->transport_stream = !data->data.empty() && data->data[0] == TSDemuxer::SYNC_BYTE;
+
+        if (!data->transport_stream)
+        {
+            // Packed audio segments start with an ID3 tag carrying the timestamp
+            data->position = id3_size(data->data);
+        }
+
+        ESP_LOGD(TAG, "Segment %lu: %zu bytes in %lld ms", segment.sequence, data->data.size(), elapsed / 1000);
+
+        return data;
+    }
+
+    static size_t id3_size(
+            const std::vector<uint8_t>& data)
+    {
+        if (data.size() < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3')
+        {
+            return 0;
+        }
+
+        size_t size = 10 + ((data[6] & 0x7F) << 21) + ((data[7] & 0x7F) << 14) + ((data[8] & 0x7F) << 7) +
+                (data[9] & 0x7F);
+
+        // Footer present
+        if (data[5] & 0x10)
+        {
+            size += 10;
+        }
+
+        return std::min(size, data.size());
+    }
+
+    bool fetch(
+            const std::string& url,
+            std::vector<uint8_t>& body,
+            int64_t& first_byte_time)
+    {
+        BandwidthEstimator& estimator = BandwidthEstimator::get_instance();
+
+        esp_http_client_set_url(client_, url.c_str());
+
+        // The connection is kept open between requests to the same host
+        esp_err_t err = esp_http_client_open(client_, 0);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open %s: %s", url.c_str(), esp_err_to_name(err));
+            esp_http_client_close(client_);
+
+            return false;
+        }
+
+        int64_t content_length = esp_http_client_fetch_headers(client_);
+        int status_code = esp_http_client_get_status_code(client_);
+        first_byte_time = esp_timer_get_time();
+
+        if (status_code != 200)
+        {
+            ESP_LOGE(TAG, "HTTP error %d fetching %s", status_code, url.c_str());
+            esp_http_client_close(client_);
+
+            return false;
+        }
+
+        body.clear();
+
+        if (content_length > 0)
+        {
+            body.reserve(std::min(static_cast<size_t>(content_length), MAX_SEGMENT_SIZE));
+        }
+
+        char chunk[1024];
+
+        while (!stop_)
+        {
+            int64_t read_start = esp_timer_get_time();
+            int chunk_read = esp_http_client_read(client_, chunk, sizeof(chunk));
+
+            if (chunk_read < 0)
+            {
+                ESP_LOGE(TAG, "Error reading %s", url.c_str());
+                esp_http_client_close(client_);
+
+                return false;
+            }
+
+            if (chunk_read == 0)
+            {
+                break;
+            }
+
+            estimator.on_read(chunk_read, esp_timer_get_time() - read_start);
+
+            if (body.size() + chunk_read > MAX_SEGMENT_SIZE)
+            {
+                ESP_LOGE(TAG, "Response too large: %s", url.c_str());
+                esp_http_client_close(client_);
+
+                return false;
+            }
+
+            body.insert(body.end(), chunk, chunk + chunk_read);
+        }
+
+        if (!esp_http_client_is_complete_data_received(client_))
+        {
+            // Connection cannot be reused if the response was not fully read
+            esp_http_client_close(client_);
+        }
+
+        return !stop_;
+    }
+
+    bool load_playlist(
+            const std::string& url)
+    {
+        std::vector<uint8_t> body;
+        int64_t first_byte = 0;
+
+        if (!fetch(url, body, first_byte))
+        {
+            return false;
+        }
+
+        std::string text(body.begin(), body.end());
+
+        if (text.find("#EXT-X-STREAM-INF") != std::string::npos)
+        {
+            std::string variant = select_variant(text, url);
+
+            if (variant.empty())
+            {
+                ESP_LOGE(TAG, "No usable variant in master playlist");
+
+                return false;
+            }
+
+            ESP_LOGI(TAG, "Selected variant %s", variant.c_str());
+
+            return load_playlist(variant);
+        }
+
+        media_playlist_url_ = url;
+        parse_media_playlist(text, url);
+
+        return true;
+    }
+
+    std::string select_variant(
+            const std::string& text,
+            const std::string& base_url)
+    {
+        BandwidthEstimator& estimator = BandwidthEstimator::get_instance();
+
+        // Keep some margin over the variant bandwidth
+        float usable_bps = estimator.has_estimate() ? estimator.window_min_bps() * 0.8f : 256000.0f;
+
+        std::string best;
+        uint32_t best_bandwidth = 0;
+        std::string lowest;
+        uint32_t lowest_bandwidth = UINT32_MAX;
+        uint32_t bandwidth = 0;
+        bool expect_uri = false;
+
+        for_each_line(text, [&](const std::string& line)
+                {
+                    if (line.rfind("#EXT-X-STREAM-INF:", 0) == 0)
+                    {
+                        size_t pos = line.find("BANDWIDTH=");
+                        bandwidth = (pos != std::string::npos) ? strtoul(line.c_str() + pos + 10, NULL, 10) : 0;
+                        expect_uri = true;
+                    }
+                    else if (expect_uri && !line.empty() && line[0] != '#')
+                    {
+                        expect_uri = false;
+                        std::string uri = resolve_url(base_url, line);
+
+                        if (bandwidth < lowest_bandwidth)
+                        {
+                            lowest = uri;
+                            lowest_bandwidth = bandwidth;
+                        }
+
+                        if (bandwidth <= usable_bps && bandwidth >= best_bandwidth)
+                        {
+                            best = uri;
+                            best_bandwidth = bandwidth;
+                        }
+                    }
+                });
+
+        if (!best.empty())
+        {
+            bitrate_bps_ = best_bandwidth;
+
+            return best;
+        }
+
+        bitrate_bps_ = lowest_bandwidth;
+
+        return lowest;
+    }
+
+    void parse_media_playlist(
+            const std::string& text,
+            const std::string& base_url)
+    {
+        std::vector<Segment> segments;
+        uint32_t sequence = 0;
+        uint32_t duration_ms = 0;
+        bool endlist = false;
+
+        for_each_line(text, [&](const std::string& line)
+                {
+                    if (line.rfind("#EXT-X-TARGETDURATION:", 0) == 0)
+                    {
+                        target_duration_ms_ = strtoul(line.c_str() + 22, NULL, 10) * 1000;
+                    }
+                    else if (line.rfind("#EXT-X-MEDIA-SEQUENCE:", 0) == 0)
+                    {
+                        sequence = strtoul(line.c_str() + 22, NULL, 10);
+                    }
+                    else if (line.rfind("#EXTINF:", 0) == 0)
+                    {
+                        duration_ms = strtof(line.c_str() + 8, NULL) * 1000;
+                    }
+                    else if (line.rfind("#EXT-X-ENDLIST", 0) == 0)
+                    {
+                        endlist = true;
+                    }
+                    else if (!line.empty() && line[0] != '#')
+                    {
+                        segments.push_back({resolve_url(base_url, line), sequence++, duration_ms});
+                        duration_ms = 0;
+                    }
+                });
+
+        if (target_duration_ms_ == 0)
+        {
+            target_duration_ms_ = 6000;
+        }
+
+        if (!playlist_loaded_ && !endlist && segments.size() > LIVE_START_SEGMENTS)
+        {
+            next_sequence_ = segments[segments.size() - LIVE_START_SEGMENTS].sequence;
+        }
+        else if (!segments.empty() && next_sequence_ < segments.front().sequence)
+        {
+            if (playlist_loaded_)
+            {
+                ESP_LOGW(TAG, "Fell behind the live playlist, jumping to segment %lu", segments.front().sequence);
+            }
+
+            next_sequence_ = segments.front().sequence;
+        }
+
+        ESP_LOGD(TAG, "Playlist with %zu segments, target duration %lu ms, %s", segments.size(),
+                target_duration_ms_, endlist ? "VOD" : "live");
+
+        segments_ = std::move(segments);
+        endlist_ = endlist;
+        playlist_loaded_ = true;
+    }
+
+    template<typename Function>
+    static void for_each_line(
+            const std::string& text,
+            Function function)
+    {
+        size_t start = 0;
+
+        while (start < text.size())
+        {
+            size_t end = text.find('\n', start);
+
+            if (end == std::string::npos)
+            {
+                end = text.size();
+            }
+
+            std::string line = text.substr(start, end - start);
+
+            // Trim CR and spaces
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+            {
+                line.pop_back();
+            }
+
+            function(line);
+            start = end + 1;
+        }
+    }
+
+    static std::string resolve_url(
+            const std::string& base,
+            const std::string& reference)
+    {
+        if (reference.find("://") != std::string::npos)
+        {
+            return reference;
+        }
+
+        if (!reference.empty() && reference[0] == '/')
+        {
+            // Root relative, keep scheme and host
+            size_t host_end = base.find('/', base.find("://") + 3);
+
+            return base.substr(0, host_end) + reference;
+        }
+
+        // Relative to the playlist directory, query string excluded
+        std::string directory = base.substr(0, base.find('?'));
+
+        return directory.substr(0, directory.rfind('/') + 1) + reference;
+    }
+
+    std::string playlist_url_;
+    std::string media_playlist_url_;
+    uint32_t lookahead_ms_;
+
+    // Owned by the prefetch task
+    esp_http_client_handle_t client_ = nullptr;
+    std::vector<Segment> segments_;
+    uint32_t next_sequence_ = 0;
+    uint32_t target_duration_ms_ = 0;
+    uint32_t bitrate_bps_ = 0;
+    bool endlist_ = false;
+    bool playlist_loaded_ = false;
+
+    // Owned by the decoder task
+    SegmentData* current_ = nullptr;
+    TSDemuxer demuxer_;
+
+    QueueHandle_t queue_;
+    TaskHandle_t prefetch_task_handle_;
+    std::atomic<uint32_t> buffered_ms_ = 0;
+    std::atomic<bool> stop_ = false;
+    std::atomic<bool> prefetch_finished_ = false;
+
+    Metric& fetch_time_;
+    Metric& first_byte_time_;
+    Metric& buffered_;
+    Metric& segments_total_;
+    Metric& segment_errors_;
+};
@@ -1,15 +1,26 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <strings.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 #include <esp_http_client.h>
 #include <esp_crt_bundle.h>
 
 #include <RingBuffer.hpp>
+#include <StreamSource.hpp>
+#include <BandwidthEstimator.hpp>
+#include <MirrorSet.hpp>
+#include <Event.hpp>
 
-class HTTPStream
+class HTTPStream : public StreamSource
 {
     static constexpr const char* TAG = "HTTPStream";
 
@@ -17,65 +28,73 @@ public:
 
     HTTPStream(
             const std::string& url)
+        : path_(url)
     {
-        esp_http_client_config_t config = {};
+        title_mutex_ = xSemaphoreCreateMutex();
 
-        config.url = url.c_str();
-        config.method = HTTP_METHOD_GET;
-        config.crt_bundle_attach = esp_crt_bundle_attach;
+        open(url, 0);
+    }
 
-        handle_ = esp_http_client_init(&config);
+    /**
+     * @brief Streams a song from the fastest healthy mirror, failing over to the others on errors or slowness
+     *
+     * @param mirrors Mirrors serving the song, must outlive the stream
+     * @param path Song path appended to the mirror prefix
+     */
+    HTTPStream(
+            MirrorSet& mirrors,
+            const std::string& path)
+        : mirrors_(&mirrors)
+        , path_(path)
+    {
+        title_mutex_ = xSemaphoreCreateMutex();
 
-        if (handle_ == NULL)
+        if (mirrors.needs_probe())
         {
-            ESP_LOGE(TAG, "Failed to initialize HTTP client");
-
-            return;
+            mirrors.probe(path);
         }
 
-        esp_err_t err = esp_http_client_open(handle_, 0);
-
-        if (err != ESP_OK)
+        for (size_t index : mirrors.ranking())
         {
-            ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-
-            return;
-        }
+            mirror_index_ = index;
 
-        content_length_ = esp_http_client_fetch_headers(handle_);
-
-        int status_code = esp_http_client_get_status_code(handle_);
-        ESP_LOGI(TAG, "HTTP status code: %d", status_code);
-
-        if (status_code != 200)
-        {
-            ESP_LOGE(TAG, "HTTP error: status code %d", status_code);
+            if (open(mirrors.prefix(index) + path, 0))
+            {
+                return;
+            }
 
-            return;
+            mirrors.report_failure(index);
         }
 
-        if (content_length_ < 0)
-        {
-            ESP_LOGW(TAG, "Content length not provided by server, streaming mode enabled");
-            // In streaming mode, we'll keep reading until the server closes the connection
-            unread_length_ = INT64_MAX; // Set to a large value to indicate streaming mode
-        }
-        else
-        {
-            unread_length_ = content_length_;
-            ESP_LOGI(TAG, "HTTP content length: %lld", content_length_);
-        }
+        ESP_LOGE(TAG, "No mirror could serve %s", path.c_str());
     }
 
-    ~HTTPStream()
+    ~HTTPStream() override
     {
         ESP_LOGI(TAG, "Cleaning up HTTP client");
-        esp_http_client_close(handle_);
-        esp_http_client_cleanup(handle_);
+        close();
         ESP_LOGI(TAG, "HTTP client cleaned up");
+        vSemaphoreDelete(title_mutex_);
+    }
+
+    /**
+     * @brief Gets the title announced by the ICY metadata, empty if the stream has none
+     */
+    std::string title() override
+    {
+        xSemaphoreTake(title_mutex_, portMAX_DELAY);
+        std::string title = title_;
+        xSemaphoreGive(title_mutex_);
+
+        return title;
+    }
+
+    std::string content_type() override
+    {
+        return content_type_;
     }
 
-    int64_t available_data()
+    int64_t available_data() override
     {
         // If we're in streaming mode (content_length < 0) or still have data to read
         if (unread_length_ > 0 && unread_length_ != INT64_MAX)
@@ -94,9 +113,11 @@ public:
     }
 
     void read_http_stream(
-            RingBuffer& buffer)
+            RingBuffer& buffer) override
     {
-        uint32_t chunk_read = 0;
+        BandwidthEstimator& estimator = BandwidthEstimator::get_instance();
+
+        int chunk_read = 0;
         uint32_t total_read = 0;
 
         do
@@ -109,18 +130,55 @@ public:
                 break;
             }
 
-            chunk_read = esp_http_client_read(handle_, (char*)write_slot.data(), write_slot.size());
+            size_t read_size = write_slot.size();
+
+            if (icy_metaint_ > 0)
+            {
+                // Audio is read straight into the ring, never past the next metadata block
+                read_size = std::min(read_size, icy_bytes_to_metadata_);
+            }
+
+            int64_t read_start = esp_timer_get_time();
+            chunk_read = esp_http_client_read(handle_, (char*)write_slot.data(), read_size);
+            int64_t read_time = esp_timer_get_time() - read_start;
 
             if (chunk_read > 0)
             {
+                estimator.on_read(chunk_read, read_time);
                 buffer.commit_write(chunk_read);
                 total_read += chunk_read;
+                offset_ += chunk_read;
+
+                if (mirrors_ != nullptr && is_mirror_too_slow(chunk_read, read_time))
+                {
+                    ESP_LOGW(TAG, "Mirror too slow to sustain playback");
+                    failover();
+                    break;
+                }
 
                 // Only decrement if we're not in streaming mode
                 if (unread_length_ != INT64_MAX)
                 {
                     unread_length_ -= chunk_read;
                 }
+
+                if (icy_metaint_ > 0)
+                {
+                    icy_bytes_to_metadata_ -= chunk_read;
+
+                    if (icy_bytes_to_metadata_ == 0 && !read_icy_metadata())
+                    {
+                        // Part of the block may be gone, the audio can't be told from the metadata anymore
+                        reconnect();
+                        break;
+                    }
+                }
+            }
+            else if (chunk_read == -ESP_ERR_HTTP_EAGAIN)
+            {
+                // Timed out without data, the connection may still recover
+                estimator.on_stall(read_time);
+                break;
             }
             else if (chunk_read == 0)
             {
@@ -131,13 +189,24 @@ public:
                     unread_length_ = 0;
                     ESP_LOGI(TAG, "End of HTTP stream reached");
                 }
+                else if (unread_length_ > 0 && mirrors_ != nullptr)
+                {
+                    ESP_LOGW(TAG, "Connection closed %lld bytes before the end", unread_length_);
+                    failover();
+                }
 
                 break;
             }
             else
             {
                 // Error occurred
-                ESP_LOGE(TAG, "Error reading from HTTP stream: %lu", chunk_read);
+                ESP_LOGE(TAG, "Error reading from HTTP stream: %d", chunk_read);
+
+                if (mirrors_ != nullptr)
+                {
+                    failover();
+                }
+
                 break;
             }
         } while (chunk_read > 0 && buffer.max_write_slot().size() > 0);
@@ -145,9 +214,404 @@ public:
         ESP_LOGD(TAG, "Total read: %lu bytes, remaining: %lld", total_read, unread_length_);
     }
 
+    void set_bitrate(
+            uint32_t bitrate_bps) override
+    {
+        if (bitrate_bps > 0)
+        {
+            bitrate_bps_ = bitrate_bps;
+        }
+    }
+
 private:
 
+    static constexpr int MAX_REDIRECTS = 5;
+
+    // Throughput below this margin over the nominal bitrate, measured over SLOW_WINDOW_US of reads, triggers a
+    // failover. Only the time spent in reads counts so a full buffer doesn't dilute the measurement.
+    static constexpr float SLOW_MARGIN = 1.1f;
+    static constexpr int64_t SLOW_WINDOW_US = 5 * 1000 * 1000;
+
+    /**
+     * @brief Opens a connection to url following redirects, resuming at offset with a range request
+     *
+     * @return Whether the server answered with the requested data
+     */
+    bool open(
+            const std::string& url,
+            int64_t offset)
+    {
+        close();
+
+        esp_http_client_config_t config = {};
+
+        config.url = url.c_str();
+        config.method = HTTP_METHOD_GET;
+        config.crt_bundle_attach = esp_crt_bundle_attach;
+        config.event_handler = HTTPStream::http_event_handler;
+        config.user_data = this;
+
+        handle_ = esp_http_client_init(&config);
+
+        if (handle_ == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to initialize HTTP client");
+
+            return false;
+        }
+
+        // Ask Shoutcast/Icecast servers for in-band metadata, other servers ignore it
+        esp_http_client_set_header(handle_, "Icy-MetaData", "1");
+
+        if (offset > 0)
+        {
+            std::string range = "bytes=" + std::to_string(offset) + "-";
+            esp_http_client_set_header(handle_, "Range", range.c_str());
+        }
+
+        int status_code = 0;
+        int64_t start = esp_timer_get_time();
+        int64_t connected = 0;
+
+        for (int redirects = 0; ; redirects++)
+        {
+            icy_metaint_ = 0;
+
+            esp_err_t err = esp_http_client_open(handle_, 0);
+            connected = esp_timer_get_time();
+
+            if (err != ESP_OK)
+            {
+                ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+
+                return false;
+            }
+
+            content_length_ = esp_http_client_fetch_headers(handle_);
+
+            status_code = esp_http_client_get_status_code(handle_);
+            ESP_LOGI(TAG, "HTTP status code: %d", status_code);
+
+            bool redirect = status_code == 301 || status_code == 302 || status_code == 303 || status_code == 307 ||
+                    status_code == 308;
+
+            if (!redirect || redirects == MAX_REDIRECTS)
+            {
+                break;
+            }
+
+            esp_http_client_flush_response(handle_, NULL);
+            esp_http_client_set_redirection(handle_);
+            esp_http_client_close(handle_);
+        }
+
+        if (status_code != 200 && !(status_code == 206 && offset > 0))
+        {
+            ESP_LOGE(TAG, "HTTP error: status code %d", status_code);
+
+            return false;
+        }
+
+        if (mirrors_ != nullptr)
+        {
+            mirrors_->report_success(mirror_index_, (connected - start) / 1000.0f,
+                    (esp_timer_get_time() - start) / 1000.0f);
+        }
+
+        if (content_length_ < 0)
+        {
+            ESP_LOGW(TAG, "Content length not provided by server, streaming mode enabled");
+            // In streaming mode, we'll keep reading until the server closes the connection
+            unread_length_ = INT64_MAX; // Set to a large value to indicate streaming mode
+        }
+        else
+        {
+            unread_length_ = content_length_;
+            ESP_LOGI(TAG, "HTTP content length: %lld", content_length_);
+        }
+
+        if (status_code == 200 && offset > 0 && !skip(offset))
+        {
+            ESP_LOGE(TAG, "Failed to skip to offset %lld", offset);
+
+            return false;
+        }
+
+        offset_ = offset;
+
+        if (icy_metaint_ > 0)
+        {
+            ESP_LOGI(TAG, "ICY stream \"%s\" with metadata every %lu bytes", icy_name_.c_str(), icy_metaint_);
+            icy_bytes_to_metadata_ = icy_metaint_;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if (handle_ != NULL)
+        {
+            esp_http_client_close(handle_);
+            esp_http_client_cleanup(handle_);
+            handle_ = NULL;
+        }
+    }
+
+    /**
+     * @brief Discards the beginning of a response from a server ignoring range requests
+     */
+    bool skip(
+            int64_t size)
+    {
+        char discard[256];
+
+        while (size > 0)
+        {
+            int chunk_read = esp_http_client_read(handle_, discard, std::min<int64_t>(size, sizeof(discard)));
+
+            if (chunk_read <= 0)
+            {
+                return false;
+            }
+
+            size -= chunk_read;
+
+            if (unread_length_ != INT64_MAX)
+            {
+                unread_length_ -= chunk_read;
+            }
+        }
+
+        return true;
+    }
+
+    bool is_mirror_too_slow(
+            int bytes,
+            int64_t read_time)
+    {
+        if (mirrors_->size() < 2)
+        {
+            return false;
+        }
+
+        slow_window_bytes_ += bytes;
+        slow_window_us_ += read_time;
+
+        if (slow_window_us_ < SLOW_WINDOW_US)
+        {
+            return false;
+        }
+
+        float bps = slow_window_bytes_ * 8 * 1e6f / slow_window_us_;
+
+        slow_window_bytes_ = 0;
+        slow_window_us_ = 0;
+
+        return bps < bitrate_bps_ * SLOW_MARGIN;
+    }
+
+    /**
+     * @brief Resumes the song on the next healthy mirror at the current offset
+     */
+    void failover()
+    {
+        mirrors_->report_failure(mirror_index_);
+
+        size_t failed = mirror_index_;
+
+        for (size_t index : mirrors_->ranking())
+        {
+            if (index == failed)
+            {
+                continue;
+            }
+
+            ESP_LOGW(TAG, "Failing over to %s at offset %lld", mirrors_->prefix(index).c_str(), offset_);
+
+            mirror_index_ = index;
+
+            if (open(mirrors_->prefix(index) + path_, offset_))
+            {
+                mirrors_->report_failover();
+                slow_window_bytes_ = 0;
+                slow_window_us_ = 0;
+
+                return;
+            }
+
+            mirrors_->report_failure(index);
+        }
+
+        ESP_LOGE(TAG, "All mirrors failed");
+        unread_length_ = 0;
+    }
+
+    /**
+     * @brief Replaces a connection whose position in the stream is lost, the next mirror takes over
+     */
+    void reconnect()
+    {
+        if (mirrors_ != nullptr)
+        {
+            failover();
+
+            return;
+        }
+
+        // ICY streams are live, they resume from the current position rather than an offset
+        ESP_LOGW(TAG, "Reconnecting to %s", path_.c_str());
+
+        if (!open(path_, 0))
+        {
+            ESP_LOGE(TAG, "Failed to reconnect");
+            unread_length_ = 0;
+        }
+    }
+
+    static esp_err_t http_event_handler(
+            esp_http_client_event_t* event)
+    {
+        HTTPStream& stream = *static_cast<HTTPStream*>(event->user_data);
+
+        if (event->event_id == HTTP_EVENT_ON_HEADER)
+        {
+            if (strcasecmp(event->header_key, "icy-metaint") == 0)
+            {
+                stream.icy_metaint_ = strtoul(event->header_value, NULL, 10);
+            }
+            else if (strcasecmp(event->header_key, "icy-name") == 0)
+            {
+                stream.icy_name_ = event->header_value;
+            }
+            else if (strcasecmp(event->header_key, "Content-Type") == 0)
+            {
+                stream.content_type_ = event->header_value;
+            }
+        }
+
+        return ESP_OK;
+    }
+
+    bool read_exact(
+            char* data,
+            size_t size)
+    {
+        size_t total = 0;
+
+        while (total < size)
+        {
+            int chunk_read = esp_http_client_read(handle_, data + total, size - total);
+
+            if (chunk_read <= 0)
+            {
+                return false;
+            }
+
+            total += chunk_read;
+        }
+
+        if (unread_length_ != INT64_MAX)
+        {
+            unread_length_ -= size;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Reads the metadata block due at this point, the next one is counted from its end
+     */
+    bool read_icy_metadata()
+    {
+        // A length byte in 16 bytes units precedes each metadata block, usually it is zero
+        uint8_t length = 0;
+
+        if (!read_exact(reinterpret_cast<char*>(&length), 1))
+        {
+            ESP_LOGE(TAG, "Failed to read ICY metadata length");
+
+            return false;
+        }
+
+        if (length == 0)
+        {
+            icy_bytes_to_metadata_ = icy_metaint_;
+
+            return true;
+        }
+
+        // Only the metadata is copied, blocks are rare as servers usually send them when the title changes
+        std::string metadata(length * 16, '\0');
+
+        if (!read_exact(metadata.data(), metadata.size()))
+        {
+            ESP_LOGE(TAG, "Failed to read ICY metadata block");
+
+            return false;
+        }
+
+        icy_bytes_to_metadata_ = icy_metaint_;
+        parse_icy_metadata(metadata.c_str());
+
+        return true;
+    }
+
+    void parse_icy_metadata(
+            const char* metadata)
+    {
+        // Format is StreamTitle='Artist - Title';StreamUrl='...';
+        static constexpr const char* TITLE_KEY = "StreamTitle='";
+
+        const char* start = strstr(metadata, TITLE_KEY);
+
+        if (start == NULL)
+        {
+            return;
+        }
+
+        start += strlen(TITLE_KEY);
+        const char* end = strstr(start, "';");
+
+        if (end == NULL)
+        {
+            end = start + strlen(start);
+        }
+
+        std::string title(start, end - start);
+
+        xSemaphoreTake(title_mutex_, portMAX_DELAY);
+        bool changed = title != title_;
+        title_ = title;
+        xSemaphoreGive(title_mutex_);
+
+        if (changed)
+        {
+            ESP_LOGI(TAG, "ICY title: %s", title.c_str());
+            EventQueue::get_instance().push(Event::STREAM_TITLE_CHANGED);
+        }
+    }
+
     esp_http_client_handle_t handle_ = {};
     int64_t content_length_ = 0;
     int64_t unread_length_ = 0;
+
+    MirrorSet* mirrors_ = nullptr;
+    // Song path appended to the mirror prefix, or the whole URL without mirrors
+    std::string path_;
+    size_t mirror_index_ = 0;
+    int64_t offset_ = 0;
+    uint64_t slow_window_bytes_ = 0;
+    int64_t slow_window_us_ = 0;
+
+    // Nominal bitrate of the song, assumed until the decoder reports it
+    std::atomic<uint32_t> bitrate_bps_ = BandwidthEstimator::DEFAULT_BITRATE_BPS;
+
+    uint32_t icy_metaint_ = 0;
+    size_t icy_bytes_to_metadata_ = 0;
+    std::string icy_name_;
+    std::string content_type_;
+
+    SemaphoreHandle_t title_mutex_;
+    std::string title_;
 };
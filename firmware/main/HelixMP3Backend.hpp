@@ -0,0 +1,94 @@
+#pragma once
+
+#include <esp_log.h>
+
+#include <mp3dec.h>
+
+#include <MP3Backend.hpp>
+
+/**
+ * @brief MP3 backend based on the Helix fixed point decoder, portable C that also builds on the host
+ *
+ * Helix only decodes layer III, which is all the playlists use.
+ */
+class HelixMP3Backend : public MP3Backend
+{
+    static constexpr const char* TAG = "HelixMP3Backend";
+
+public:
+
+    HelixMP3Backend()
+        : handle_(MP3InitDecoder())
+    {
+        if (handle_ == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to allocate Helix decoder");
+        }
+    }
+
+    ~HelixMP3Backend() override
+    {
+        if (handle_ != NULL)
+        {
+            MP3FreeDecoder(handle_);
+        }
+    }
+
+    bool decode(
+            std::span<const uint8_t> frame,
+            std::span<uint8_t> pcm,
+            size_t& decoded) override
+    {
+        decoded = 0;
+
+        if (handle_ == NULL)
+        {
+            return false;
+        }
+
+        unsigned char* input = const_cast<unsigned char*>(frame.data());
+        int left = frame.size();
+
+        int ret = MP3Decode(handle_, &input, &left, reinterpret_cast<short*>(pcm.data()), 0);
+
+        if (ret == ERR_MP3_MAINDATA_UNDERFLOW)
+        {
+            // The frame refers to bit reservoir data from frames before the stream start
+            return true;
+        }
+
+        if (ret != ERR_MP3_NONE)
+        {
+            ESP_LOGW(TAG, "Failed to decode frame with error %d", ret);
+
+            return false;
+        }
+
+        MP3FrameInfo info = {};
+        MP3GetLastFrameInfo(handle_, &info);
+
+        decoded = info.outputSamps * sizeof(int16_t);
+
+        return true;
+    }
+
+    void reset() override
+    {
+        // Helix has no reset, the bit reservoir is only cleared by a new instance
+        if (handle_ != NULL)
+        {
+            MP3FreeDecoder(handle_);
+        }
+
+        handle_ = MP3InitDecoder();
+    }
+
+    const char* name() const override
+    {
+        return "helix";
+    }
+
+private:
+
+    HMP3Decoder handle_;
+};
@@ -1,88 +1,221 @@
 #pragma once
 
-#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <string>
 
-#include "driver/i2s_std.h"
-
-#include <RingBuffer.hpp>
-#include <WAVParser.hpp>
-
-extern const uint8_t beep_start[] asm("_binary_beep_wav_start");
-extern const uint8_t beep_end[]   asm("_binary_beep_wav_end");
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
-extern const uint8_t start_beep_start[] asm("_binary_start_beep_wav_start");
-extern const uint8_t start_beep_end[]   asm("_binary_start_beep_wav_end");
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
 
-extern const uint8_t volume_beep_start[] asm("_binary_volume_beep_wav_start");
-extern const uint8_t volume_beep_end[]   asm("_binary_volume_beep_wav_end");
+#include "driver/i2s_std.h"
 
+#include <AudioAnalyzer.hpp>
+#include <Dynamics.hpp>
+#include <Equalizer.hpp>
+#include <GainRamp.hpp>
+#include <GainTable.hpp>
+#include <LoudnessNormalizer.hpp>
+#include <Metrics.hpp>
+#include <MixBus.hpp>
+#include <Mixer.hpp>
+#include <NotificationClips.hpp>
+#include <Resampler.hpp>
+#include <RingBuffer.hpp>
+#include <VoicePool.hpp>
+
+/**
+ * @brief Audio output, always running at 48 kHz stereo
+ *
+ * Every source is converted by the resampler, so the I2S channel is configured once and a track with another
+ * format doesn't glitch the output or flush the DMA buffers.
+ *
+ * The resampler writes to the 32-bit MixBus, where the music is mixed with the notification sounds, equalized and
+ * limited in place. A single pass then dithers and packs it into 16-bit slots, or with CONFIG_CACTUS_I2S_32BIT_SLOTS
+ * saturates it into 32-bit slots.
+ *
+ * With CONFIG_CACTUS_I2S_CALLBACK_OUTPUT the output is packed straight into the DMA buffers: the on_sent event
+ * queues each buffer the DMA is done with and write fills them in the order they will play again. Otherwise it is
+ * packed into an intermediate buffer that i2s_channel_write copies. Either way the output latency is the whole DMA
+ * ring, whose geometry is set by the latency profile.
+ *
+ * The time from a beep being triggered to its first sample leaving the DMA is measured for each profile.
+ */
 class I2SSink
 {
     static constexpr const char* TAG = "I2SSink";
 
+#if CONFIG_CACTUS_I2S_32BIT_SLOTS
+    using Slot = int32_t;
+    static constexpr i2s_data_bit_width_t SLOT_BITS = I2S_DATA_BIT_WIDTH_32BIT;
+#else
+    using Slot = int16_t;
+    static constexpr i2s_data_bit_width_t SLOT_BITS = I2S_DATA_BIT_WIDTH_16BIT;
+#endif // CONFIG_CACTUS_I2S_32BIT_SLOTS
+
+    // Largest DMA buffer the driver supports, 4092 bytes
+    static constexpr uint32_t MAX_DMA_FRAME_NUM = 4092 / (Resampler::OUTPUT_CHANNELS * sizeof(Slot));
+
+    // Frames the output is delayed by after the mix
+#if CONFIG_CACTUS_DYNAMICS
+    static constexpr uint32_t LOOKAHEAD_FRAMES = Dynamics::LOOKAHEAD_FRAMES;
+#else
+    static constexpr uint32_t LOOKAHEAD_FRAMES = 0;
+#endif // CONFIG_CACTUS_DYNAMICS
+
 public:
 
-    static constexpr int8_t MIN_VOLUME = -100;
+    /**
+     * @brief Trade-off between the reaction to controls and the protection against decoding hiccups
+     */
+    enum class LatencyProfile : uint8_t
+    {
+        LOW_LATENCY,
+        BALANCED,
+        ROBUST,
+        COUNT
+    };
+
+    struct DMAGeometry
+    {
+        const char* name;
+        uint32_t desc_num;
+        uint32_t frame_num;
+        const char* latency_metric;
+    };
+
+    // 20 ms, 60 ms and 170 ms of audio at 48 kHz, 32-bit slots take twice as many of the smaller buffers
+    static constexpr DMAGeometry PROFILES[] = {
+        {"low_latency", 4, 240, "cactus_sink_beep_latency_low_latency_ms"},
+        {"balanced", 6, 480, "cactus_sink_beep_latency_balanced_ms"},
+        {"robust", 8 * sizeof(Slot) / sizeof(int16_t), MAX_DMA_FRAME_NUM, "cactus_sink_beep_latency_robust_ms"}
+    };
+
+    static constexpr uint32_t SAMPLE_RATE = Resampler::OUTPUT_RATE;
+    static constexpr uint8_t CHANNELS = Resampler::OUTPUT_CHANNELS;
+
+    static constexpr int8_t MIN_VOLUME = GainTable::MIN_DB;
+
+    // Duration of the gain ramps of volume changes, mute and fades
+    static constexpr uint32_t RAMP_MS = 5;
 
     I2SSink()
-    : beep_(beep_start, beep_end)
-    , start_beep_(start_beep_start, start_beep_end)
-    , volume_beep_(volume_beep_start, volume_beep_end)
+        : dma_latency_(Metrics::get_instance().gauge("cactus_sink_dma_latency_ms",
+                "Audio held by the I2S DMA buffers of the current latency profile"))
+#if CONFIG_CACTUS_DYNAMICS
+        , dynamics_(SAMPLE_RATE, {CONFIG_CACTUS_COMPRESSOR_THRESHOLD_DB, CONFIG_CACTUS_COMPRESSOR_RATIO,
+                CONFIG_CACTUS_COMPRESSOR_ATTACK_MS, CONFIG_CACTUS_COMPRESSOR_RELEASE_MS,
+                CONFIG_CACTUS_COMPRESSOR_MAKEUP_DB, CONFIG_CACTUS_LIMITER_CEILING_DB})
+        , gain_reduction_(Metrics::get_instance().gauge("cactus_sink_gain_reduction_db",
+                "Deepest gain reduction of the compressor and limiter over the last chunk"))
+#endif // CONFIG_CACTUS_DYNAMICS
     {
-        i2s_chan_config_t chan_config = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_AUTO, I2S_ROLE_MASTER);
+#if CONFIG_CACTUS_LATENCY_PROFILE_LOW
+        profile_ = LatencyProfile::LOW_LATENCY;
+#elif CONFIG_CACTUS_LATENCY_PROFILE_BALANCED
+        profile_ = LatencyProfile::BALANCED;
+#else
+        profile_ = LatencyProfile::ROBUST;
+#endif // CONFIG_CACTUS_LATENCY_PROFILE_LOW
 
-        // Add some delay for better stability
-        chan_config.dma_desc_num = 8;
-        chan_config.dma_frame_num = 1023;
-        chan_config.auto_clear = true;
+        requested_profile_ = profile_;
 
-        dma_buffer_size_ = chan_config.dma_frame_num * 2 * 16 / 8;
+#if !CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        output_ = static_cast<Slot*>(heap_caps_aligned_alloc(16, MAX_DMA_FRAME_NUM * CHANNELS * sizeof(Slot),
+                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
 
-        ESP_ERROR_CHECK(i2s_new_channel(&chan_config, &handle_, NULL));
+        // Like the channel, the output can't run without it
+        ESP_ERROR_CHECK(output_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+#endif // !CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
 
-        ESP_LOGI("I2S", "I2S channel created, DMA buffer size: %d", dma_buffer_size_);
+        create_channel();
 
-        i2s_std_config_t config = {};
+        gain_.set_length(SAMPLE_RATE * CHANNELS * RAMP_MS / 1000);
+        equalizer_.load();
+    }
 
-        config.clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(sample_rate_);
-        config.slot_cfg = I2S_STD_PHILIP_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO);
+    ~I2SSink()
+    {
+        delete_channel();
 
-        // Set the clock to a multiple of the sample rate for stability
-        config.clk_cfg.mclk_multiple = I2S_MCLK_MULTIPLE_256;
+#if !CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        heap_caps_free(output_);
+#endif // !CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+    }
 
-        config.gpio_cfg = {
-            .mclk = I2S_GPIO_UNUSED,    // some codecs may require mclk signal, this example doesn't need it
-            .bclk = GPIO_NUM_12,
-            .ws   = GPIO_NUM_13,
-            .dout = GPIO_NUM_11,
-            .din  = I2S_GPIO_UNUSED,
-            .invert_flags = {
-                .mclk_inv = false,
-                .bclk_inv = false,
-                .ws_inv   = false,
-            },
-        };
+    /**
+     * @brief Selects the latency profile of the next track, can be called from any task
+     */
+    void set_latency_profile(
+            LatencyProfile profile)
+    {
+        requested_profile_ = profile;
+    }
 
-        ESP_ERROR_CHECK(i2s_channel_init_std_mode(handle_, &config));
+    LatencyProfile latency_profile() const
+    {
+        return requested_profile_;
+    }
 
-        ESP_ERROR_CHECK(i2s_channel_enable(handle_));
+    /**
+     * @brief Speaker tuning of the output, its settings can be changed from any task
+     */
+    Equalizer& equalizer()
+    {
+        return equalizer_;
+    }
 
-        // Consume all data from WAVParser
-        beep_.consume_all();
-        start_beep_.consume_all();
-        volume_beep_.consume_all();
+#if CONFIG_CACTUS_AUDIO_ANALYZER
+    /**
+     * @brief Levels and spectrum of the output, can be read from any task
+     */
+    const AudioAnalyzer& analyzer() const
+    {
+        return analyzer_;
     }
+#endif // CONFIG_CACTUS_AUDIO_ANALYZER
 
-    ~I2SSink()
+    /**
+     * @brief Recreates the channel if another profile was selected, shall be called between tracks when nothing
+     * writes to the sink
+     */
+    void apply_latency_profile()
     {
-        ESP_LOGI(TAG, "Deleting I2S channel");
-        ESP_ERROR_CHECK(i2s_channel_disable(handle_));
-        ESP_LOGI(TAG, "I2S channel disabled");
-        ESP_ERROR_CHECK(i2s_del_channel(handle_));
-        ESP_LOGI(TAG, "I2S channel deleted");
+        LatencyProfile profile = requested_profile_;
+
+        if (profile == profile_)
+        {
+            return;
+        }
+
+        ESP_LOGI(TAG, "Switching latency profile from %s to %s", PROFILES[static_cast<size_t>(profile_)].name,
+                PROFILES[static_cast<size_t>(profile)].name);
+
+        delete_channel();
+        profile_ = profile;
+        create_channel();
     }
 
+    /**
+     * @brief Prepares for the next track, shall be called between tracks when nothing writes to the sink
+     */
+    void begin_track(
+            const std::string& url)
+    {
+#if CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+        loudness_.start(url);
+        apply_loudness_correction();
+#endif // CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+    }
+
+    /**
+     * @brief Sets the format of the PCM given to write, only the resampler is reconfigured
+     */
     void change_sample_rate(
             uint32_t sample_rate,
             uint8_t channels)
@@ -92,20 +225,10 @@ public:
             return;
         }
 
-        ESP_LOGI(TAG, "Changing sample rate from %lu to %lu, channels from %d to %d",
+        ESP_LOGI(TAG, "Changing input sample rate from %lu to %lu, channels from %d to %d",
                 sample_rate_, sample_rate, channels_, channels);
 
-        // Disable channel before reconfiguring
-        ESP_ERROR_CHECK(i2s_channel_disable(handle_));
-
-        i2s_std_config_t config = {};
-        config.clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(sample_rate);
-        config.slot_cfg = I2S_STD_PHILIP_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT,
-                        channels == 1 ? I2S_SLOT_MODE_MONO : I2S_SLOT_MODE_STEREO);
-
-        ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(handle_, &config.clk_cfg));
-        ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(handle_, &config.slot_cfg));
-        ESP_ERROR_CHECK(i2s_channel_enable(handle_));
+        resampler_.configure(sample_rate, channels);
 
         sample_rate_ = sample_rate;
         channels_ = channels;
@@ -116,19 +239,9 @@ public:
     {
         volume_db_ = volume_db;
 
-        ESP_LOGI(TAG, "Setting volume to %d dB", volume_db_);
+        ESP_LOGI(TAG, "Setting volume to %d dB", volume_db);
 
-        if (volume_db <= MIN_VOLUME)
-        {
-            volume_scale_ = 0;
-        }
-        else
-        {
-            // Use float for calculation to avoid overflow
-            float scale_factor = std::pow(10, volume_db / 20.0);
-            // Use uint32_t to avoid overflow for high volumes
-            volume_scale_ = static_cast<uint32_t>(32768 * scale_factor);
-        }
+        request_gain_update();
     }
 
     int8_t get_volume()
@@ -160,40 +273,29 @@ public:
         set_volume(new_volume);
     }
 
-    enum class BeepType
-    {
-        START,
-        VOLUME,
-        BEEP
-    };
+    using BeepType = ClipId;
 
+    /**
+     * @brief Plays a notification clip over the music, can be called from any task
+     */
     void beep(
             BeepType type)
     {
-        switch (type)
-        {
-            case BeepType::START:
-                start_beep_.reset();
-                break;
-            case BeepType::VOLUME:
-                volume_beep_.reset();
-                break;
-            case BeepType::BEEP:
-                beep_.reset();
-                break;
-        }
+        voices_.trigger(type);
     }
 
     void mute()
     {
         ESP_LOGI(TAG, "Muting audio");
         muted_ = true;
+        request_gain_update();
     }
 
     void unmute()
     {
         ESP_LOGI(TAG, "Unmuting audio");
         muted_ = false;
+        request_gain_update();
     }
 
     void toggle_mute()
@@ -208,139 +310,467 @@ public:
         }
     }
 
+    /**
+     * @brief Ramps the music down to silence, e.g. before stopping a song so it doesn't end with a click
+     */
+    void fade_out()
+    {
+        faded_out_ = true;
+        request_gain_update();
+    }
+
+    /**
+     * @brief Ramps the music back up after fade_out
+     */
+    void fade_in()
+    {
+        faded_out_ = false;
+        request_gain_update();
+    }
+
+    /**
+     * @brief Whether the gain reached its target, i.e. the fade or mute is complete
+     */
+    bool gain_settled() const
+    {
+        return gain_applied_.load(std::memory_order_acquire) == gain_requests_.load(std::memory_order_acquire) &&
+                gain_.settled();
+    }
+
+    /**
+     * @brief Bytes of input that fill a DMA buffer, the output starves if write gets less until the track ends
+     */
+    size_t chunk_bytes() const
+    {
+        const DMAGeometry& geometry = PROFILES[static_cast<size_t>(profile_)];
+
+        // The resampler holds back the frames of its filter
+        return (static_cast<uint64_t>(geometry.frame_num) * sample_rate_ / SAMPLE_RATE + Resampler::TAPS) *
+                channels_ * sizeof(int16_t);
+    }
+
+    /**
+     * @brief DMA buffers that started playing before any audio was written to them since the last call
+     */
+    uint32_t take_starved_buffers()
+    {
+        return starved_buffers_.exchange(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Plays the data of the ring, blocking until there is room in the DMA buffers
+     *
+     * In callback mode the DMA buffer the data runs out in is completed with silence, so it should be given at least
+     * chunk_bytes until the track ends.
+     */
     void write(
             RingBuffer& data)
     {
-        auto read_slot = data.max_read_slot();
+        size_t frame_size = channels_ * sizeof(int16_t);
+        const DMAGeometry& geometry = PROFILES[static_cast<size_t>(profile_)];
 
-        // If not multiple of 4 -> error
-        if (read_slot.size() % 4 != 0)
+        while (true)
         {
-            ESP_LOGE(TAG, "Data size not multiple of 4");
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+            // Measured by the interrupt
+            uint32_t latency_us = probe_latency_us_.exchange(0, std::memory_order_relaxed);
 
-            return;
-        }
+            if (latency_us != 0)
+            {
+                observe_latency(latency_us);
+            }
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
 
-        while (read_slot.size() > 0)
-        {
-            size_t wrote = 0;
+            auto read_slot = data.max_read_slot();
 
-            read_slot = std::span<uint8_t>(read_slot.data(), std::min(read_slot.size(), dma_buffer_size_));
+            // The decoders write whole frames
+            if (read_slot.size() % frame_size != 0)
+            {
+                ESP_LOGE(TAG, "Data size not multiple of %zu", frame_size);
+                break;
+            }
 
-            // Apply volume on both channels
-            if (VOLUME_SCALE_0DB != volume_scale_)
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+            if (dma_buffer_ == nullptr)
             {
-                for (size_t i = 0; i + 3 < read_slot.size(); i += 4)
+                if (read_slot.empty())
                 {
-                    // Safer access with explicit alignment check
-                    if (reinterpret_cast<uintptr_t>(&read_slot[i]) % 2 != 0 ||
-                            reinterpret_cast<uintptr_t>(&read_slot[i + 2]) % 2 != 0)
-                    {
-                        ESP_LOGW(TAG, "Unaligned audio data detected");
-                        continue;
-                    }
-
-                    int16_t& left = *reinterpret_cast<int16_t*>(&read_slot[i]);
-                    int16_t& right = *reinterpret_cast<int16_t*>(&read_slot[i + 2]);
-
-                    // Fixed-point multiplication
-                    left = (static_cast<int32_t>(left) * volume_scale_) >> 15;
-                    right = (static_cast<int32_t>(right) * volume_scale_) >> 15;
+                    break;
                 }
-            }
 
-            // Handle muting
-            if (muted_)
-            {
-                memset(read_slot.data(), 0, read_slot.size());
+                xQueueReceive(free_buffers_, &dma_buffer_, portMAX_DELAY);
+                dma_filled_ = 0;
             }
 
-            // Mix with beep data
-            auto beep_data = beep_.consume_data(read_slot.size());
-            if (beep_data.size() > 0)
+            std::span<Slot> free_space(dma_buffer_ + dma_filled_ * CHANNELS,
+                    (geometry.frame_num - dma_filled_) * CHANNELS);
+#else
+            std::span<Slot> free_space(output_, geometry.frame_num * CHANNELS);
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+
+            size_t consumed = 0;
+            size_t frames = resampler_.process(
+                    std::span<const int16_t>(reinterpret_cast<const int16_t*>(read_slot.data()), read_slot.size() / 2),
+                    bus_.samples(free_space.size() / CHANNELS), consumed);
+
+            data.commit_read(consumed * sizeof(int16_t));
+
+            if (frames == 0)
             {
-                ESP_LOGD(TAG, "Mixing beep data");
-                for (size_t i = 0; i < beep_data.size(); i += 4)
+                if (consumed == 0)
                 {
-                    const int16_t& left = *reinterpret_cast<const int16_t*>(&beep_data[i]);
-                    const int16_t& right = *reinterpret_cast<const int16_t*>(&beep_data[i + 2]);
+                    break;
+                }
 
-                    int16_t& left_out = *reinterpret_cast<int16_t*>(&read_slot[i]);
-                    int16_t& right_out = *reinterpret_cast<int16_t*>(&read_slot[i + 2]);
+                continue;
+            }
 
-                    left_out += (static_cast<int32_t>(left));
-                    right_out += (static_cast<int32_t>(right));
+            std::span<int32_t> samples = bus_.samples(frames);
 
-                }
+#if CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+            // Measured on the music alone, before the volume
+            if (loudness_.process(samples))
+            {
+                apply_loudness_correction();
             }
+#endif // CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+
+            // The target only moves here, so that the control task and this one don't race to set it
+            uint32_t gain_request = gain_requests_.load(std::memory_order_acquire);
 
-            // Mix with start beep data
-            beep_data = start_beep_.consume_data(read_slot.size());
-            if (beep_data.size() > 0)
+            if (gain_request != gain_applied_.load(std::memory_order_relaxed))
             {
-                ESP_LOGD(TAG, "Mixing start beep data");
-                for (size_t i = 0; i < beep_data.size(); i += 4)
-                {
-                    const int16_t& left = *reinterpret_cast<const int16_t*>(&beep_data[i]);
-                    const int16_t& right = *reinterpret_cast<const int16_t*>(&beep_data[i + 2]);
+                update_gain();
+                gain_applied_.store(gain_request, std::memory_order_release);
+            }
 
-                    int16_t& left_out = *reinterpret_cast<int16_t*>(&read_slot[i]);
-                    int16_t& right_out = *reinterpret_cast<int16_t*>(&read_slot[i + 2]);
+            // Volume, mute and notification sounds in a single pass
+            std::array<std::span<const int16_t>, VoicePool::MAX_VOICES> voices;
+            size_t voice_count = voices_.next(samples.size(), voices);
 
-                    left_out += (static_cast<int32_t>(left));
-                    right_out += (static_cast<int32_t>(right));
+            Mixer::mix(samples, gain_, std::span<const std::span<const int16_t>>(voices.data(), voice_count));
 
-                }
-            }
+            // Speaker tuning, after the mix so that the notification sounds get it too
+            equalizer_.process(samples);
 
-            // Mix with volume beep data
-            beep_data = volume_beep_.consume_data(read_slot.size());
-            if (beep_data.size() > 0)
-            {
-                ESP_LOGD(TAG, "Mixing volume beep data");
-                for (size_t i = 0; i < beep_data.size(); i += 4)
-                {
-                    const int16_t& left = *reinterpret_cast<const int16_t*>(&beep_data[i]);
-                    const int16_t& right = *reinterpret_cast<const int16_t*>(&beep_data[i + 2]);
+#if CONFIG_CACTUS_DYNAMICS
+            // Last so that nothing can push the output over the ceiling, the output is LOOKAHEAD_FRAMES late
+            dynamics_.process(samples);
+            gain_reduction_.set(dynamics_.take_reduction_db());
+#endif // CONFIG_CACTUS_DYNAMICS
 
-                    int16_t& left_out = *reinterpret_cast<int16_t*>(&read_slot[i]);
-                    int16_t& right_out = *reinterpret_cast<int16_t*>(&read_slot[i + 2]);
+            // The only conversion to the output format
+            std::span<Slot> output = free_space.first(frames * CHANNELS);
+            bus_.pack(samples, output);
 
-                    left_out += (static_cast<int32_t>(left));
-                    right_out += (static_cast<int32_t>(right));
+#if CONFIG_CACTUS_AUDIO_ANALYZER
+            // Exactly what is played, dropped if the analyzer is behind
+            analyzer_.push(output);
+#endif // CONFIG_CACTUS_AUDIO_ANALYZER
 
-                }
+            // Clips start at the beginning of the chunk
+            int64_t trigger_us = voices_.last_trigger_us();
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+            if (trigger_us != 0 && probe_buffer_.load(std::memory_order_relaxed) == nullptr)
+            {
+                probe_trigger_us_ = trigger_us;
+                probe_offset_ = dma_filled_ + LOOKAHEAD_FRAMES;
+                probe_frame_num_ = geometry.frame_num;
+                probe_buffer_.store(dma_buffer_, std::memory_order_release);
             }
 
-            if (ESP_OK == i2s_channel_write(handle_, read_slot.data(), read_slot.size(), &wrote, portMAX_DELAY))
+            dma_filled_ += frames;
+
+            if (dma_filled_ == geometry.frame_num)
             {
-                ESP_LOGD(TAG, "Wrote %d bytes", wrote);
-                ESP_LOGD(TAG, "  - In seconds: %f", (wrote / 2.0) / (sample_rate_ * 1.0));
-                data.commit_read(wrote);
-                read_slot = data.max_read_slot();
+                dma_buffer_ = nullptr;
             }
-            else
+#else
+            size_t wrote = 0;
+
+            if (ESP_OK != i2s_channel_write(handle_, output.data(), output.size_bytes(), &wrote, portMAX_DELAY))
             {
                 ESP_LOGE(TAG, "Error writing to I2S");
                 break;
             }
+
+            ESP_LOGD(TAG, "Wrote %d bytes", wrote);
+            ESP_LOGD(TAG, "  - In seconds: %f", wrote / static_cast<float>(SAMPLE_RATE * CHANNELS * sizeof(Slot)));
+
+            // The chunk was queued behind a full DMA ring, its first frame plays once the frames before it did
+            if (trigger_us != 0)
+            {
+                uint32_t ahead = geometry.desc_num * geometry.frame_num - frames;
+                observe_latency(esp_timer_get_time() - trigger_us + static_cast<uint64_t>(ahead) * 1000000 / SAMPLE_RATE);
+            }
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
         }
 
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        // Never kept for the next call: once the DMA played it, the interrupt queues it as free again
+        if (dma_buffer_ != nullptr)
+        {
+            std::fill(dma_buffer_ + dma_filled_ * CHANNELS, dma_buffer_ + geometry.frame_num * CHANNELS, Slot(0));
+            dma_buffer_ = nullptr;
+        }
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
     }
 
 private:
-    WAVParser beep_;
-    WAVParser start_beep_;
-    WAVParser volume_beep_;
 
-    i2s_chan_handle_t handle_;
-    uint32_t sample_rate_ = 44100;
-    uint8_t channels_ = 2;
+    void create_channel()
+    {
+        const DMAGeometry& geometry = PROFILES[static_cast<size_t>(profile_)];
+
+        i2s_chan_config_t chan_config = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_AUTO, I2S_ROLE_MASTER);
+
+        chan_config.dma_desc_num = geometry.desc_num;
+        chan_config.dma_frame_num = geometry.frame_num;
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        // A buffer that isn't refilled in time plays silence instead of the audio it played last
+        chan_config.auto_clear_before_cb = true;
+#else
+        chan_config.auto_clear = true;
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+
+        ESP_ERROR_CHECK(i2s_new_channel(&chan_config, &handle_, NULL));
+
+        ESP_LOGI("I2S", "I2S channel created, latency profile %s, %lu DMA buffers of %zu bytes", geometry.name,
+                geometry.desc_num, geometry.frame_num * CHANNELS * sizeof(Slot));
+
+        i2s_std_config_t config = {};
+
+        config.clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE);
+        config.slot_cfg = I2S_STD_PHILIP_SLOT_DEFAULT_CONFIG(SLOT_BITS, I2S_SLOT_MODE_STEREO);
+
+        // Set the clock to a multiple of the sample rate for stability
+        config.clk_cfg.mclk_multiple = I2S_MCLK_MULTIPLE_256;
+
+        config.gpio_cfg = {
+            .mclk = I2S_GPIO_UNUSED,    // some codecs may require mclk signal, this example doesn't need it
+            .bclk = GPIO_NUM_12,
+            .ws   = GPIO_NUM_13,
+            .dout = GPIO_NUM_11,
+            .din  = I2S_GPIO_UNUSED,
+            .invert_flags = {
+                .mclk_inv = false,
+                .bclk_inv = false,
+                .ws_inv   = false,
+            },
+        };
+
+        ESP_ERROR_CHECK(i2s_channel_init_std_mode(handle_, &config));
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        // The buffer playing isn't free, the others are queued from the one that plays next
+        free_buffers_ = xQueueCreate(geometry.desc_num - 1, sizeof(Slot*));
+        dma_buffer_ = nullptr;
+        probe_buffer_ = nullptr;
+
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_sent = on_sent;
+#else
+        // The driver queue of sent buffers overflows when i2s_channel_write didn't take any of them in time
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_send_q_ovf = on_starved;
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
 
-    size_t dma_buffer_size_;
+        ESP_ERROR_CHECK(i2s_channel_register_event_callback(handle_, &callbacks, this));
+
+        ESP_ERROR_CHECK(i2s_channel_enable(handle_));
+
+        dma_latency_.set(geometry.desc_num * geometry.frame_num * 1000.0f / SAMPLE_RATE);
+    }
+
+    void delete_channel()
+    {
+        ESP_LOGI(TAG, "Deleting I2S channel");
+        ESP_ERROR_CHECK(i2s_channel_disable(handle_));
+        ESP_LOGI(TAG, "I2S channel disabled");
+        ESP_ERROR_CHECK(i2s_del_channel(handle_));
+        ESP_LOGI(TAG, "I2S channel deleted");
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+        vQueueDelete(free_buffers_);
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+    }
+
+    void observe_latency(
+            int64_t latency_us)
+    {
+        const DMAGeometry& geometry = PROFILES[static_cast<size_t>(profile_)];
+
+        static constexpr float BOUNDS[] = {5, 10, 20, 30, 50, 75, 100, 150, 200, 300};
+
+        Metrics::get_instance().histogram(geometry.latency_metric,
+                "Time from a beep being triggered to its first sample leaving the DMA", BOUNDS).observe(
+                latency_us / 1000.0f);
+
+        ESP_LOGI(TAG, "Beep audible after %lld ms with the %s profile", latency_us / 1000, geometry.name);
+    }
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+    /**
+     * @brief Called from the I2S interrupt once a DMA buffer was sent, it plays again after the other buffers
+     */
+    static bool on_sent(
+            i2s_chan_handle_t handle,
+            i2s_event_data_t* event,
+            void* context)
+    {
+        I2SSink& sink = *static_cast<I2SSink*>(context);
+        Slot* buffer = static_cast<Slot*>(event->dma_buf);
+        BaseType_t woken = pdFALSE;
+
+        // The oldest queued buffer is the one the DMA starts now, it is too late to fill it
+        if (xQueueIsQueueFullFromISR(sink.free_buffers_))
+        {
+            Slot* playing;
+            xQueueReceiveFromISR(sink.free_buffers_, &playing, &woken);
+            sink.starved_buffers_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        xQueueSendFromISR(sink.free_buffers_, &buffer, &woken);
+
+        // The buffer holding the start of a beep was sent, integer only as the FPU isn't available here
+        if (buffer == sink.probe_buffer_.load(std::memory_order_acquire))
+        {
+            // Negative when the beep starts in a later buffer, delayed by the limiter
+            int64_t remaining_us = (static_cast<int64_t>(sink.probe_frame_num_) - sink.probe_offset_) * 1000000 /
+                    SAMPLE_RATE;
+            int64_t latency_us = esp_timer_get_time() - remaining_us - sink.probe_trigger_us_;
+
+            sink.probe_latency_us_.store(std::max<int64_t>(latency_us, 1), std::memory_order_relaxed);
+            sink.probe_buffer_.store(nullptr, std::memory_order_relaxed);
+        }
+
+        return woken == pdTRUE;
+    }
+#else
+    /**
+     * @brief Called from the I2S interrupt when the DMA plays a buffer again because nothing was written to it
+     */
+    static bool on_starved(
+            i2s_chan_handle_t handle,
+            i2s_event_data_t* event,
+            void* context)
+    {
+        static_cast<I2SSink*>(context)->starved_buffers_.fetch_add(1, std::memory_order_relaxed);
+
+        return false;
+    }
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+
+#if CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+    /**
+     * @brief From the task writing to the sink, or between tracks
+     */
+    void apply_loudness_correction()
+    {
+#if CONFIG_CACTUS_DYNAMICS
+        // Boosts are applied after the compressor, under the limiter ceiling
+        dynamics_.set_trim_db(loudness_.correction_db());
+#endif // CONFIG_CACTUS_DYNAMICS
+
+        request_gain_update();
+    }
+#endif // CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+
+    /**
+     * @brief Has write pick up the volume, mute, fade or loudness correction before its next chunk
+     */
+    void request_gain_update()
+    {
+        gain_requests_.fetch_add(1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Only called by write, a lookup and a multiply, the loudness correction is rounded to 1 dB steps
+     */
+    void update_gain()
+    {
+        uint32_t gain = GainTable::q15(volume_db_);
+
+#if CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+        float correction_db = loudness_.correction_db();
+
+#if CONFIG_CACTUS_DYNAMICS
+        correction_db = std::min(correction_db, 0.0f);
+#endif // CONFIG_CACTUS_DYNAMICS
+
+        // Within MAX_CUT_DB..MAX_BOOST_DB, far from the ends of the table
+        int8_t correction = static_cast<int8_t>(std::lround(correction_db));
+
+        if (correction < 0)
+        {
+            gain = (gain * GainTable::q15(correction)) >> 15;
+        }
+        else if (correction > 0)
+        {
+            // Without the limiter boosts only use the headroom left by the volume
+            gain = std::min<uint32_t>((gain << 15) / GainTable::q15(-correction), Q15Gain::UNITY);
+        }
+#endif // CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+
+        gain_.set_target(muted_ || faded_out_ ? 0 : gain);
+    }
+
+    VoicePool voices_;
+
+    i2s_chan_handle_t handle_;
 
-    int8_t volume_db_ = 0;
-    bool muted_ = false;
-    static constexpr uint32_t VOLUME_SCALE_0DB = 32768;
-    uint32_t volume_scale_ = VOLUME_SCALE_0DB;
+    // Format of the input, the output runs at SAMPLE_RATE and CHANNELS
+    uint32_t sample_rate_ = SAMPLE_RATE;
+    uint8_t channels_ = CHANNELS;
+    Resampler resampler_;
+    MixBus bus_{MAX_DMA_FRAME_NUM};
+    Equalizer equalizer_{SAMPLE_RATE};
+
+    // Profile of the channel and the one the next track shall use
+    LatencyProfile profile_;
+    std::atomic<LatencyProfile> requested_profile_;
+    Metric& dma_latency_;
+
+    // Counted by the interrupt
+    std::atomic<uint32_t> starved_buffers_ = 0;
+
+#if CONFIG_CACTUS_DYNAMICS
+    Dynamics dynamics_;
+    Metric& gain_reduction_;
+#endif // CONFIG_CACTUS_DYNAMICS
+
+#if CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+    LoudnessNormalizer loudness_{CONFIG_CACTUS_LOUDNESS_TARGET_LUFS};
+#endif // CONFIG_CACTUS_LOUDNESS_NORMALIZATION
+
+#if CONFIG_CACTUS_AUDIO_ANALYZER
+    AudioAnalyzer analyzer_;
+#endif // CONFIG_CACTUS_AUDIO_ANALYZER
+
+#if CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+    // DMA buffers to fill, in the order they play, and the one being filled
+    QueueHandle_t free_buffers_;
+    Slot* dma_buffer_ = nullptr;
+    size_t dma_filled_ = 0;
+
+    // DMA buffer where the last beep starts, the interrupt measures its latency once it was sent
+    std::atomic<Slot*> probe_buffer_ = nullptr;
+    int64_t probe_trigger_us_ = 0;
+    uint32_t probe_offset_ = 0;
+    uint32_t probe_frame_num_ = 0;
+    std::atomic<uint32_t> probe_latency_us_ = 0;
+#else
+    // One DMA buffer of output, packed from the bus, allocated since the sink lives on the player task stack
+    Slot* output_ = nullptr;
+#endif // CONFIG_CACTUS_I2S_CALLBACK_OUTPUT
+
+    // Set by the control task, turned into the ramp target by write
+    std::atomic<int8_t> volume_db_ = 0;
+    std::atomic<bool> muted_ = false;
+    std::atomic<bool> faded_out_ = false;
+    std::atomic<uint32_t> gain_requests_ = 1;
+    std::atomic<uint32_t> gain_applied_ = 0;
+    GainRamp gain_;
 };
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+
+#include <MixBus.hpp>
+
+/**
+ * @brief Incremental integrated loudness of the 48 kHz stereo output, per ITU-R BS.1770 / EBU R128
+ *
+ * The samples are K-weighted by two biquads (the head shelf and the RLB high-pass, whose coefficients are
+ * specified at 48 kHz) and their mean square is summed every 100 ms. Blocks of 400 ms overlapping by 75% are
+ * gated at -70 LUFS, then 10 LU below the loudness of the blocks kept.
+ *
+ * Instead of keeping every block, their energies are summed in a histogram of BIN_LU wide loudness bins, so that
+ * the relative gate can be applied at any time in constant memory. Only the gate is rounded to a bin, the energy
+ * of the blocks is exact. The filters run in single precision, on the S3 FPU.
+ */
+class LoudnessMeter
+{
+    static constexpr uint32_t SAMPLE_RATE = 48000;
+    static constexpr uint8_t CHANNELS = 2;
+
+    // Blocks are made of 4 steps
+    static constexpr size_t STEP_FRAMES = SAMPLE_RATE / 10;
+    static constexpr size_t BLOCK_STEPS = 4;
+
+    static constexpr float ABSOLUTE_GATE = -70.0f;
+    static constexpr float RELATIVE_GATE = -10.0f;
+    static constexpr float MAX_LOUDNESS = 6.0f;
+    static constexpr float BIN_LU = 0.25f;
+    static constexpr size_t BINS = (MAX_LOUDNESS - ABSOLUTE_GATE) / BIN_LU;
+
+public:
+
+    static constexpr float STEP_SECONDS = static_cast<float>(STEP_FRAMES) / SAMPLE_RATE;
+
+    LoudnessMeter()
+    {
+        counts_ = static_cast<uint32_t*>(heap_caps_malloc(BINS * sizeof(uint32_t), MALLOC_CAP_8BIT));
+        energies_ = static_cast<float*>(heap_caps_malloc(BINS * sizeof(float), MALLOC_CAP_8BIT));
+
+        // Like the sink holding it, the output can't run without it
+        ESP_ERROR_CHECK(counts_ != nullptr && energies_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+
+        reset();
+    }
+
+    ~LoudnessMeter()
+    {
+        heap_caps_free(counts_);
+        heap_caps_free(energies_);
+    }
+
+    LoudnessMeter(const LoudnessMeter&) = delete;
+    LoudnessMeter& operator=(const LoudnessMeter&) = delete;
+
+    /**
+     * @brief Starts a new measurement
+     */
+    void reset()
+    {
+        std::fill(counts_, counts_ + BINS, 0);
+        std::fill(energies_, energies_ + BINS, 0.0f);
+        std::fill(std::begin(steps_), std::end(steps_), 0.0f);
+        std::fill(std::begin(state_), std::end(state_), 0.0f);
+        sum_ = 0.0f;
+        frames_ = 0;
+        step_count_ = 0;
+    }
+
+    /**
+     * @param samples Interleaved stereo MixBus samples at 48 kHz
+     * @return Whether a step was completed, i.e. integrated() may have changed
+     */
+    bool process(
+            std::span<const int32_t> samples)
+    {
+        bool stepped = false;
+        size_t frames = samples.size() / CHANNELS;
+        size_t position = 0;
+
+        while (position < frames)
+        {
+            size_t count = std::min(frames - position, STEP_FRAMES - frames_);
+
+            sum_ += weight(samples.data() + position * CHANNELS, count);
+            frames_ += count;
+            position += count;
+
+            if (frames_ == STEP_FRAMES)
+            {
+                next_step();
+                stepped = true;
+            }
+        }
+
+        return stepped;
+    }
+
+    /**
+     * @brief Gated loudness of everything measured since reset
+     *
+     * @return false until a block was louder than the absolute gate
+     */
+    bool integrated(
+            float& lufs) const
+    {
+        uint64_t count = 0;
+        double energy = 0.0;
+
+        for (size_t i = 0; i < BINS; i++)
+        {
+            count += counts_[i];
+            energy += energies_[i];
+        }
+
+        if (count == 0)
+        {
+            return false;
+        }
+
+        float gate = loudness(energy / count) + RELATIVE_GATE;
+        size_t first = gate <= ABSOLUTE_GATE ? 0 : std::min<size_t>((gate - ABSOLUTE_GATE) / BIN_LU, BINS - 1);
+
+        count = 0;
+        energy = 0.0;
+
+        for (size_t i = first; i < BINS; i++)
+        {
+            count += counts_[i];
+            energy += energies_[i];
+        }
+
+        lufs = loudness(energy / count);
+
+        return true;
+    }
+
+    /**
+     * @brief Duration measured since reset
+     */
+    float seconds() const
+    {
+        return step_count_ * STEP_SECONDS;
+    }
+
+private:
+
+    static float loudness(
+            double energy)
+    {
+        return -0.691f + 10.0f * std::log10(static_cast<float>(energy));
+    }
+
+    /**
+     * @brief Sum of the squares of the K-weighted samples of both channels
+     */
+    float weight(
+            const int32_t* samples,
+            size_t frames)
+    {
+        // BS.1770 stage 1 (high shelf) and stage 2 (high-pass), transposed direct form II
+        static constexpr float B0 = 1.53512485958697f;
+        static constexpr float B1 = -2.69169618940638f;
+        static constexpr float B2 = 1.19839281085285f;
+        static constexpr float A1 = -1.69065929318241f;
+        static constexpr float A2 = 0.73248077421585f;
+        static constexpr float C1 = -1.99004745483398f;
+        static constexpr float C2 = 0.99007225036621f;
+        static constexpr float SCALE = 1.0f / MixBus::FULL_SCALE;
+
+        float l1 = state_[0], l2 = state_[1], l3 = state_[2], l4 = state_[3];
+        float r1 = state_[4], r2 = state_[5], r3 = state_[6], r4 = state_[7];
+        float sum = 0.0f;
+
+        for (size_t i = 0; i < frames; i++)
+        {
+            float left = samples[i * 2] * SCALE;
+            float right = samples[i * 2 + 1] * SCALE;
+
+            float left_shelf = B0 * left + l1;
+            l1 = B1 * left - A1 * left_shelf + l2;
+            l2 = B2 * left - A2 * left_shelf;
+            float right_shelf = B0 * right + r1;
+            r1 = B1 * right - A1 * right_shelf + r2;
+            r2 = B2 * right - A2 * right_shelf;
+
+            // The high-pass numerator is 1, -2, 1
+            float left_weighted = left_shelf + l3;
+            l3 = -2.0f * left_shelf - C1 * left_weighted + l4;
+            l4 = left_shelf - C2 * left_weighted;
+            float right_weighted = right_shelf + r3;
+            r3 = -2.0f * right_shelf - C1 * right_weighted + r4;
+            r4 = right_shelf - C2 * right_weighted;
+
+            sum += left_weighted * left_weighted + right_weighted * right_weighted;
+        }
+
+        state_[0] = l1, state_[1] = l2, state_[2] = l3, state_[3] = l4;
+        state_[4] = r1, state_[5] = r2, state_[6] = r3, state_[7] = r4;
+
+        return sum;
+    }
+
+    void next_step()
+    {
+        steps_[step_count_ % BLOCK_STEPS] = sum_;
+        step_count_++;
+        sum_ = 0.0f;
+        frames_ = 0;
+
+        if (step_count_ < BLOCK_STEPS)
+        {
+            return;
+        }
+
+        float energy = (steps_[0] + steps_[1] + steps_[2] + steps_[3]) / (STEP_FRAMES * BLOCK_STEPS);
+        float lufs = loudness(energy);
+
+        if (!(lufs > ABSOLUTE_GATE))
+        {
+            return;
+        }
+
+        size_t bin = std::min<size_t>((lufs - ABSOLUTE_GATE) / BIN_LU, BINS - 1);
+        counts_[bin]++;
+        energies_[bin] += energy;
+    }
+
+    uint32_t* counts_;
+    float* energies_;
+
+    float steps_[BLOCK_STEPS];
+    float state_[8];
+    float sum_;
+    size_t frames_;
+    uint32_t step_count_;
+};
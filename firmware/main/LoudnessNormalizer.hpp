@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string>
+
+#include <esp_log.h>
+#include <nvs.h>
+
+#include <LoudnessMeter.hpp>
+#include <Metrics.hpp>
+
+/**
+ * @brief Brings every track to the same loudness with a slow gain correction
+ *
+ * The loudness of the music is measured as it plays. Once MIN_SECONDS were measured, the correction moves toward
+ * the target at SLEW_DB_PER_SECOND, slow enough to go unnoticed. At the end of the track its loudness is cached in
+ * NVS by URL, so the next time it plays the correction is right from the first sample and stays put.
+ */
+class LoudnessNormalizer
+{
+    static constexpr const char* TAG = "LoudnessNormalizer";
+
+    static constexpr const char* NVS_NAMESPACE = "loudness";
+
+    static constexpr float MIN_SECONDS = 3.0f;
+    static constexpr float MIN_SAVED_SECONDS = 10.0f;
+    static constexpr float SLEW_DB_PER_SECOND = 1.0f;
+
+public:
+
+    static constexpr float MAX_CUT_DB = -15.0f;
+    static constexpr float MAX_BOOST_DB = 9.0f;
+
+    explicit LoudnessNormalizer(
+            float target_lufs)
+        : target_lufs_(target_lufs)
+        , loudness_(Metrics::get_instance().gauge("cactus_sink_loudness_lufs",
+                "Integrated loudness of the current track measured so far"))
+        , correction_metric_(Metrics::get_instance().gauge("cactus_sink_loudness_correction_db",
+                "Gain correction bringing the current track to the target loudness"))
+    {
+    }
+
+    /**
+     * @brief Caches the loudness of the previous track and starts the next one, when nothing writes to the sink
+     */
+    void start(
+            const std::string& url)
+    {
+        save();
+
+        meter_.reset();
+        make_key(url, key_);
+
+        float cached_lufs;
+        cached_ = load(cached_lufs);
+
+        // Without a cached value the correction starts from the previous track's, the closest guess
+        if (cached_)
+        {
+            set_correction(target_lufs_ - cached_lufs);
+            ESP_LOGI(TAG, "Cached loudness %.1f LUFS, correcting by %.1f dB", cached_lufs, correction_db());
+        }
+    }
+
+    /**
+     * @param samples Music on the MixBus at 48 kHz stereo, before any gain
+     * @return Whether the correction changed
+     */
+    bool process(
+            std::span<const int32_t> samples)
+    {
+        float lufs;
+
+        if (!meter_.process(samples) || !meter_.integrated(lufs))
+        {
+            return false;
+        }
+
+        loudness_.set(lufs);
+
+        if (cached_ || meter_.seconds() < MIN_SECONDS)
+        {
+            return false;
+        }
+
+        float correction = correction_db();
+        float target = std::clamp(target_lufs_ - lufs, MAX_CUT_DB, MAX_BOOST_DB);
+        float step = SLEW_DB_PER_SECOND * LoudnessMeter::STEP_SECONDS;
+
+        if (std::fabs(target - correction) < step / 2)
+        {
+            return false;
+        }
+
+        set_correction(correction + std::clamp(target - correction, -step, step));
+
+        return true;
+    }
+
+    /**
+     * @brief Gain to apply to the music in dB, can be read from any task
+     */
+    float correction_db() const
+    {
+        return correction_.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    void set_correction(
+            float correction_db)
+    {
+        correction_db = std::clamp(correction_db, MAX_CUT_DB, MAX_BOOST_DB);
+        correction_.store(correction_db, std::memory_order_relaxed);
+        correction_metric_.set(correction_db);
+    }
+
+    /**
+     * @brief NVS keys are limited to 15 characters, the URL is hashed (FNV-1a)
+     */
+    static void make_key(
+            const std::string& url,
+            char (& key)[16])
+    {
+        uint32_t hash = 2166136261u;
+
+        for (char c : url)
+        {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+
+        snprintf(key, sizeof(key), "l%08lx", static_cast<unsigned long>(hash));
+    }
+
+    bool load(
+            float& lufs)
+    {
+        nvs_handle_t handle;
+        int16_t centi_lufs;
+
+        if (ESP_OK != nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle))
+        {
+            return false;
+        }
+
+        esp_err_t err = nvs_get_i16(handle, key_, &centi_lufs);
+        nvs_close(handle);
+
+        if (err != ESP_OK)
+        {
+            return false;
+        }
+
+        lufs = centi_lufs / 100.0f;
+
+        return true;
+    }
+
+    void save()
+    {
+        float lufs;
+
+        if (key_[0] == '\0' || meter_.seconds() < MIN_SAVED_SECONDS || !meter_.integrated(lufs))
+        {
+            return;
+        }
+
+        nvs_handle_t handle;
+
+        if (ESP_OK != nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle))
+        {
+            ESP_LOGE(TAG, "Failed to open NVS");
+            return;
+        }
+
+        int16_t centi_lufs = std::lround(lufs * 100);
+        esp_err_t err = nvs_set_i16(handle, key_, centi_lufs);
+
+        // Full, the cache starts over rather than evicting track by track
+        if (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE)
+        {
+            ESP_LOGW(TAG, "Cache full, clearing it");
+            nvs_erase_all(handle);
+            err = nvs_set_i16(handle, key_, centi_lufs);
+        }
+
+        if (err == ESP_OK)
+        {
+            err = nvs_commit(handle);
+        }
+
+        nvs_close(handle);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to cache loudness: %s", esp_err_to_name(err));
+            return;
+        }
+
+        ESP_LOGI(TAG, "Cached %.1f LUFS measured over %.0f s as %s", lufs, meter_.seconds(), key_);
+    }
+
+    float target_lufs_;
+    LoudnessMeter meter_;
+
+    char key_[16] = {};
+    bool cached_ = false;
+    std::atomic<float> correction_ = 0.0f;
+
+    Metric& loudness_;
+    Metric& correction_metric_;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+/**
+ * @brief MP3 frame decoding implementation used by MP3Decoder
+ *
+ * The demuxing is shared, backends only turn one whole frame into 16 bits interleaved PCM. The backend used for
+ * playback is chosen at build time with CONFIG_CACTUS_MP3_BACKEND, MP3Benchmark compares all of them.
+ */
+class MP3Backend
+{
+public:
+
+    virtual ~MP3Backend() = default;
+
+    /**
+     * @brief Decodes one frame
+     *
+     * @param frame Whole frame, header included
+     * @param pcm Output, large enough for 1152 stereo samples
+     * @param decoded Bytes written to the output, may be zero while the bit reservoir fills up
+     * @return False if the frame is corrupted, its samples are lost
+     */
+    virtual bool decode(
+            std::span<const uint8_t> frame,
+            std::span<uint8_t> pcm,
+            size_t& decoded) = 0;
+
+    /**
+     * @brief Drops the state of the previous stream, including the bit reservoir
+     */
+    virtual void reset() = 0;
+
+    virtual const char* name() const = 0;
+};
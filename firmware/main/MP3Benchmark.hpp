@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sdkconfig.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <esp_http_client.h>
+#include <esp_rom_crc.h>
+
+#include <EspMP3Backend.hpp>
+#include <HelixMP3Backend.hpp>
+#include <MP3Demuxer.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Decodes a fixed corpus with every MP3 backend and reports real-time factor, peak RAM and bit-exactness
+ *
+ * The corpus is downloaded from the test server (tools/stream_server.py) into PSRAM so that the network doesn't
+ * take part in the measure. The first backend is the reference the others are compared to, frame by frame, with
+ * the CRC of the decoded PCM. Results are logged and posted to the test server.
+ */
+class MP3Benchmark
+{
+    static constexpr const char* TAG = "MP3Benchmark";
+
+    static constexpr const char* CORPUS[] = {"song.mp3", "bench_vbr.mp3", "bench_mono.mp3", "bench_48k.mp3"};
+    static constexpr size_t MAX_FILE_SIZE = 4 * 1024 * 1024;
+    static constexpr uint32_t STACK_SIZE = 16 * 1024;
+    static constexpr uint32_t CYCLES_PER_US = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+
+    // 1152 samples per frame, stereo
+    static constexpr size_t MAX_PCM_SIZE = 1152 * 2 * sizeof(int16_t);
+
+    struct Backend
+    {
+        const char* name;
+        std::unique_ptr<MP3Backend> (* create)();
+    };
+
+    static constexpr Backend BACKENDS[] = {
+        {"esp_audio_codec", []() -> std::unique_ptr<MP3Backend> { return std::make_unique<EspMP3Backend>(); }},
+        {"helix", []() -> std::unique_ptr<MP3Backend> { return std::make_unique<HelixMP3Backend>(); }}
+    };
+
+    struct Run
+    {
+        // Inputs
+        const Backend* backend;
+        std::span<const uint8_t> file;
+        std::vector<uint32_t>* reference;   // Frame CRCs, filled by the reference run
+        bool is_reference;
+        TaskHandle_t caller;
+
+        // Results
+        uint32_t frames = 0;
+        uint32_t errors = 0;
+        uint32_t exact_frames = 0;
+        uint32_t crc = 0;
+        uint64_t decode_us = 0;
+        uint64_t audio_us = 0;
+        size_t peak_heap = 0;
+        size_t stack = 0;
+    };
+
+public:
+
+    /**
+     * @brief Runs the benchmark, blocking until all the files are decoded by all the backends
+     */
+    static void run()
+    {
+        ESP_LOGI(TAG, "Benchmarking %zu MP3 backends", std::size(BACKENDS));
+
+        for (const char* name : CORPUS)
+        {
+            // Allocations this large are served from PSRAM (CONFIG_SPIRAM_MALLOC_ALWAYSINTERNAL)
+            std::vector<uint8_t> file;
+
+            if (!download(name, file))
+            {
+                continue;
+            }
+
+            // Reserved up front so the reference run doesn't allocate while measuring, 96 bytes is the smallest
+            // MPEG 1 layer III frame
+            std::vector<uint32_t> reference;
+            reference.reserve(file.size() / 96);
+
+            for (const Backend& backend : BACKENDS)
+            {
+                Run run = {};
+                run.backend = &backend;
+                run.file = file;
+                run.reference = &reference;
+                run.is_reference = &backend == &BACKENDS[0];
+                run.caller = xTaskGetCurrentTaskHandle();
+
+                // Pinned to the core the player decodes on, so the measure matches playback
+                if (pdPASS != xTaskCreatePinnedToCore(benchmark_task, "MP3Benchmark", STACK_SIZE, &run, 6, NULL, 0))
+                {
+                    ESP_LOGE(TAG, "Failed to create benchmark task");
+
+                    return;
+                }
+
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+                post(name, run);
+            }
+        }
+    }
+
+private:
+
+    static bool download(
+            const char* name,
+            std::vector<uint8_t>& file)
+    {
+        std::string url = std::string(CONFIG_CACTUS_TEST_SERVER_URL "/fast_lan/") + name;
+
+        esp_http_client_config_t config = {};
+        config.url = url.c_str();
+
+        esp_http_client_handle_t handle = esp_http_client_init(&config);
+
+        if (handle == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to initialize HTTP client");
+
+            return false;
+        }
+
+        bool success = false;
+
+        if (ESP_OK == esp_http_client_open(handle, 0))
+        {
+            int64_t length = esp_http_client_fetch_headers(handle);
+            int status = esp_http_client_get_status_code(handle);
+
+            if (status != 200 || length <= 0 || length > static_cast<int64_t>(MAX_FILE_SIZE))
+            {
+                ESP_LOGW(TAG, "Skipping %s: status %d, %lld bytes", name, status, length);
+            }
+            else
+            {
+                file.resize(length);
+
+                int64_t total = 0;
+
+                while (total < length)
+                {
+                    int read = esp_http_client_read(handle, reinterpret_cast<char*>(file.data()) + total,
+                            length - total);
+
+                    if (read <= 0)
+                    {
+                        break;
+                    }
+
+                    total += read;
+                }
+
+                success = total == length;
+
+                if (!success)
+                {
+                    ESP_LOGE(TAG, "Failed to download %s", name);
+                }
+            }
+        }
+        else
+        {
+            ESP_LOGE(TAG, "Failed to connect to %s", url.c_str());
+        }
+
+        esp_http_client_close(handle);
+        esp_http_client_cleanup(handle);
+
+        return success;
+    }
+
+    static void benchmark_task(
+            void* arg)
+    {
+        Run& run = *static_cast<Run*>(arg);
+
+        RingBuffer input(run.file.size() + 1, "Benchmark", MALLOC_CAP_SPIRAM);
+        input.write(run.file);
+
+        MP3Demuxer demuxer;
+        std::vector<uint8_t> pcm(MAX_PCM_SIZE);
+
+        // The backend allocations are the heap taken after this point
+        size_t free_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        size_t min_free = free_before;
+
+        {
+            std::unique_ptr<MP3Backend> backend = run.backend->create();
+
+            while (true)
+            {
+                auto frame = demuxer.next_frame(input);
+
+                if (frame.empty())
+                {
+                    break;
+                }
+
+                const MP3Demuxer::FrameHeader& header = demuxer.last_header();
+                size_t decoded = 0;
+
+                uint32_t start = esp_cpu_get_cycle_count();
+                bool success = backend->decode(frame, pcm, decoded);
+                run.decode_us += (esp_cpu_get_cycle_count() - start) / CYCLES_PER_US;
+
+                min_free = std::min(min_free, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+
+                if (!success)
+                {
+                    run.errors++;
+                    decoded = 0;
+                }
+
+                uint32_t crc = esp_rom_crc32_le(0, pcm.data(), decoded);
+                run.crc = esp_rom_crc32_le(run.crc, pcm.data(), decoded);
+
+                if (run.is_reference)
+                {
+                    run.reference->push_back(crc);
+                }
+                else if (run.frames < run.reference->size() && (*run.reference)[run.frames] == crc)
+                {
+                    run.exact_frames++;
+                }
+
+                run.frames++;
+                run.audio_us += static_cast<uint64_t>(header.samples) * 1000 * 1000 / header.sample_rate;
+            }
+        }
+
+        if (run.is_reference)
+        {
+            run.exact_frames = run.frames;
+        }
+
+        run.peak_heap = free_before - min_free;
+        run.stack = STACK_SIZE - uxTaskGetStackHighWaterMark(NULL);
+
+        xTaskNotifyGive(run.caller);
+        vTaskDelete(NULL);
+    }
+
+    static void post(
+            const char* file,
+            const Run& run)
+    {
+        char body[384];
+
+        snprintf(body, sizeof(body),
+                "{\"benchmark\":\"mp3\",\"file\":\"%s\",\"backend\":\"%s\",\"reference\":%s,\"frames\":%lu,"
+                "\"errors\":%lu,\"realtime_factor\":%.4f,\"peak_heap_bytes\":%zu,\"stack_bytes\":%zu,"
+                "\"exact_frames\":%lu,\"crc\":\"%08lx\"}",
+                file, run.backend->name, run.is_reference ? "true" : "false", run.frames, run.errors,
+                run.audio_us > 0 ? static_cast<double>(run.decode_us) / run.audio_us : 0.0, run.peak_heap,
+                run.stack, run.exact_frames, run.crc);
+
+        ESP_LOGI(TAG, "Benchmark result: %s", body);
+
+        esp_http_client_config_t config = {};
+        config.url = CONFIG_CACTUS_TEST_SERVER_URL "/benchmark";
+        config.method = HTTP_METHOD_POST;
+
+        esp_http_client_handle_t handle = esp_http_client_init(&config);
+
+        if (handle == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to initialize HTTP client");
+
+            return;
+        }
+
+        esp_http_client_set_header(handle, "Content-Type", "application/json");
+        esp_http_client_set_post_field(handle, body, strlen(body));
+
+        esp_err_t err = esp_http_client_perform(handle);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to post result: %s", esp_err_to_name(err));
+        }
+
+        esp_http_client_cleanup(handle);
+    }
+};
@@ -1,119 +1,127 @@
 #pragma once
 
-#include <esp_log.h>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <sdkconfig.h>
 
-#include <decoder/impl/esp_mp3_dec.h>
-#include <simple_dec/esp_audio_simple_dec.h>
-#include <simple_dec/impl/esp_m4a_dec.h>
+#include <esp_log.h>
 
+#include <AudioDecoder.hpp>
+#include <DecodeStats.hpp>
+#include <EspMP3Backend.hpp>
+#include <HelixMP3Backend.hpp>
+#include <MP3Demuxer.hpp>
 #include <RingBuffer.hpp>
 
-class MP3Decoder
+/**
+ * @brief MP3 decoder fed with whole frames by MP3Demuxer
+ *
+ * Frames are decoded by a MP3Backend. The format is known from the first frame header, before anything is decoded.
+ */
+class MP3Decoder : public AudioDecoder
 {
     static constexpr const char* TAG = "MP3Decoder";
 
+    // 1152 samples per frame, stereo
+    static constexpr size_t MAX_PCM_SIZE = 1152 * 2 * sizeof(int16_t);
+
 public:
 
-    MP3Decoder()
+    /**
+     * @param backend Frame decoder, the one selected by CONFIG_CACTUS_MP3_BACKEND by default
+     */
+    MP3Decoder(
+            std::unique_ptr<MP3Backend> backend = create_backend())
+        : backend_(std::move(backend))
+        , pcm_(MAX_PCM_SIZE)
     {
-        esp_audio_err_t ret = ESP_AUDIO_ERR_OK;
-
-        static bool initialized_register = false;
-
-        if (!initialized_register)
-        {
-            ret = esp_mp3_dec_register();
-
-            if (ret != ESP_AUDIO_ERR_OK)
-            {
-                ESP_LOGE(TAG, "Failed to register decoder with error %d", ret);
-
-                return;
-            }
-
-            initialized_register = true;
-        }
-
-        esp_audio_simple_dec_cfg_t config_ = {};
-        config_.dec_type = ESP_AUDIO_SIMPLE_DEC_TYPE_MP3;
+        ESP_LOGI(TAG, "MP3 decoder initialized with the %s backend", backend_->name());
+    }
 
-        ret = esp_audio_simple_dec_open(&config_, &handle_);
+    static std::unique_ptr<MP3Backend> create_backend()
+    {
+#if CONFIG_CACTUS_MP3_BACKEND_HELIX
+        return std::make_unique<HelixMP3Backend>();
+#else
+        return std::make_unique<EspMP3Backend>();
+#endif // CONFIG_CACTUS_MP3_BACKEND_HELIX
+    }
 
-        if (ret != ESP_AUDIO_ERR_OK)
-        {
-            return;
-        }
+    const char* name() const override
+    {
+        return "MP3";
+    }
 
-        ESP_LOGI(TAG, "MP3 decoder initialized successfully");
+    AudioCodec codec() const override
+    {
+        return AudioCodec::MP3;
     }
 
-    ~MP3Decoder()
+    void reset() override
     {
-        ESP_LOGI(TAG, "Closing MP3 decoder");
-        esp_audio_simple_dec_close(handle_);
-        ESP_LOGI(TAG, "MP3 decoder closed");
+        backend_->reset();
+        demuxer_.reset();
+        bytes_decoded_ = 0;
+        samples_decoded_ = 0;
     }
 
     void process(
             RingBuffer& input,
-            RingBuffer& output)
+            RingBuffer& output) override
     {
-        ESP_LOGD(TAG, "Starting process with input: %zu bytes, output space: %zu bytes",
-                input.used_space(), output.free_space());
-
-        esp_audio_simple_dec_raw_t input_frame = {};
-        esp_audio_simple_dec_out_t output_frame = {};
-
-        auto read_slot = input.max_read_slot();
-        auto write_slot = output.max_write_slot();
-
-        ESP_LOGD(TAG, "Read slot size: %zu, Write slot size: %zu", read_slot.size(), write_slot.size());
-
-        if (read_slot.size() == 0)
+        while (output.free_space() >= MAX_PCM_SIZE)
         {
-            ESP_LOGW(TAG, "No data available to decode");
+            auto frame = demuxer_.next_frame(input);
 
-            return;
-        }
-
-        // Process until no more input data or output space
-        while (read_slot.size() > 0 && write_slot.size() > 0)
-        {
-            input_frame.buffer = read_slot.data();
-            input_frame.len = read_slot.size();
-            input_frame.eos = false;
-            input_frame.consumed = 0;
-
-            output_frame.buffer = write_slot.data();
-            output_frame.len = write_slot.size();
-            output_frame.needed_size = 0;
-            output_frame.decoded_size = 0;
+            if (frame.empty())
+            {
+                break;
+            }
 
-            esp_audio_err_t ret = esp_audio_simple_dec_process(handle_, &input_frame, &output_frame);
+            const MP3Demuxer::FrameHeader& header = demuxer_.last_header();
+            size_t decoded = 0;
 
-            input.commit_read(input_frame.consumed);
-            output.commit_write(output_frame.decoded_size);
+            uint32_t start = DecodeStats::start();
 
-            if (ret != ESP_AUDIO_ERR_OK)
+            if (!backend_->decode(frame, pcm_, decoded))
             {
-                ESP_LOGE(TAG, "Failed to decode MP3 frame with error %d", ret);
-                break;
+                // A corrupted frame only loses its own samples
+                DecodeStats::get_instance().decode_error();
+                continue;
             }
 
-            read_slot = input.max_read_slot();
-            write_slot = output.max_write_slot();
+            DecodeStats::get_instance().frame_decoded(start, decoded > 0 ? header.samples : 0, header.sample_rate);
+
+            output.write(std::span<const uint8_t>(pcm_.data(), decoded));
+
+            bytes_decoded_ += frame.size();
+            samples_decoded_ += header.samples;
         }
     }
 
-    esp_audio_simple_dec_info_t get_info()
+    esp_audio_simple_dec_info_t get_info() override
     {
+        const MP3Demuxer::FrameHeader& header = demuxer_.first_header();
+
         esp_audio_simple_dec_info_t info = {};
-        esp_audio_simple_dec_get_info(handle_, &info);
+        info.sample_rate = header.sample_rate;
+        info.channel = header.channels;
+        info.bits_per_sample = 16;
+
+        // Average over the decoded frames for VBR streams
+        info.bitrate = samples_decoded_ > 0 ? bytes_decoded_ * 8 * header.sample_rate / samples_decoded_ :
+                header.bitrate;
 
         return info;
     }
 
 private:
 
-    esp_audio_simple_dec_handle_t handle_ = {};
+    std::unique_ptr<MP3Backend> backend_;
+    MP3Demuxer demuxer_;
+    std::vector<uint8_t> pcm_;
+    uint64_t bytes_decoded_ = 0;
+    uint64_t samples_decoded_ = 0;
 };
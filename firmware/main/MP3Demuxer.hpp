@@ -0,0 +1,333 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <esp_log.h>
+
+#include <DecodeStats.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Streaming MPEG audio demuxer splitting the input into whole frames
+ *
+ * ID3v2, ID3v1 and APE tags are dropped as they arrive, without buffering them, as ID3v2 tags may embed
+ * hundreds of KB of cover art. Frame sync is only acquired when the next frame header confirms it, so that
+ * random 0xFFE bits in garbage are not mistaken for a frame.
+ */
+class MP3Demuxer
+{
+    static constexpr const char* TAG = "MP3Demuxer";
+
+    static constexpr size_t HEADER_SIZE = 4;
+    static constexpr size_t ID3V2_HEADER_SIZE = 10;
+    static constexpr size_t ID3V1_SIZE = 128;
+    static constexpr size_t APE_HEADER_SIZE = 32;
+
+    // MPEG 2 layer II at 160 kbps and 8 kHz with padding
+    static constexpr size_t MAX_FRAME_SIZE = 2881;
+
+public:
+
+    struct FrameHeader
+    {
+        uint32_t sample_rate;
+        uint32_t bitrate;
+        uint8_t channels;
+        uint8_t version;
+        uint8_t layer;
+        uint16_t samples;
+        size_t size;
+    };
+
+    MP3Demuxer()
+        : frame_(MAX_FRAME_SIZE)
+    {
+    }
+
+    /**
+     * @brief Forgets the previous stream, keeping the frame buffer
+     */
+    void reset()
+    {
+        first_ = {};
+        last_ = {};
+        synced_ = false;
+        skip_remaining_ = 0;
+        skipped_ = 0;
+    }
+
+    /**
+     * @brief Gets the next whole frame from the input
+     *
+     * @return The frame, valid until the next call, empty if more input is needed
+     */
+    std::span<const uint8_t> next_frame(
+            RingBuffer& input)
+    {
+        while (true)
+        {
+            if (skip_remaining_ > 0)
+            {
+                skip_remaining_ -= input.discard(skip_remaining_);
+
+                if (skip_remaining_ > 0)
+                {
+                    return {};
+                }
+            }
+
+            uint8_t head[ID3V2_HEADER_SIZE];
+            size_t available = input.peek(head);
+
+            if (available < HEADER_SIZE)
+            {
+                return {};
+            }
+
+            size_t tag_size = 0;
+
+            if (memcmp(head, "ID3", 3) == 0 || memcmp(head, "TAG", 3) == 0 || memcmp(head, "APET", 4) == 0)
+            {
+                if (!parse_tag(input, head, available, tag_size))
+                {
+                    return {};
+                }
+            }
+
+            if (tag_size > 0)
+            {
+                skip_remaining_ = tag_size;
+                continue;
+            }
+
+            FrameHeader header = {};
+
+            if (!parse_header(head, header) || (synced_ && !same_stream(header, first_)))
+            {
+                lose_sync(input);
+                continue;
+            }
+
+            if (!synced_)
+            {
+                // The frame is only trusted if another one follows it
+                uint8_t next[HEADER_SIZE];
+
+                if (input.peek(next, header.size) < HEADER_SIZE)
+                {
+                    return {};
+                }
+
+                FrameHeader next_header = {};
+
+                if (!parse_header(next, next_header) || !same_stream(header, next_header))
+                {
+                    lose_sync(input);
+                    continue;
+                }
+
+                synced_ = true;
+
+                if (first_.sample_rate != 0)
+                {
+                    DecodeStats::get_instance().resync();
+                }
+                else
+                {
+                    first_ = header;
+                    ESP_LOGI(TAG, "MPEG %s layer %u, %lu Hz, %u channels, %lu kbps",
+                            header.version == 1 ? "1" : header.version == 2 ? "2" : "2.5", header.layer,
+                            header.sample_rate, header.channels, header.bitrate / 1000);
+                }
+
+                if (skipped_ > 0)
+                {
+                    ESP_LOGW(TAG, "Skipped %zu bytes before frame sync", skipped_);
+                    skipped_ = 0;
+                }
+            }
+
+            if (input.used_space() < header.size)
+            {
+                return {};
+            }
+
+            input.read(std::span<uint8_t>(frame_.data(), header.size));
+            last_ = header;
+
+            return std::span<const uint8_t>(frame_.data(), header.size);
+        }
+    }
+
+    /**
+     * @brief Gets the header of the first frame, sample rate is zero until synced
+     */
+    const FrameHeader& first_header() const
+    {
+        return first_;
+    }
+
+    /**
+     * @brief Gets the header of the frame last returned by next_frame
+     */
+    const FrameHeader& last_header() const
+    {
+        return last_;
+    }
+
+    static bool parse_header(
+            const uint8_t* data,
+            FrameHeader& header)
+    {
+        static constexpr uint16_t BITRATES[5][15] = {
+            // MPEG 1 layer I, II and III
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+            // MPEG 2 and 2.5 layer I, then II and III
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+        };
+
+        static constexpr uint32_t SAMPLE_RATES[3] = {44100, 48000, 32000};
+
+        if (data[0] != 0xFF || (data[1] & 0xE0) != 0xE0)
+        {
+            return false;
+        }
+
+        uint8_t version_bits = (data[1] >> 3) & 0x03;
+        uint8_t layer_bits = (data[1] >> 1) & 0x03;
+        uint8_t bitrate_index = data[2] >> 4;
+        uint8_t sample_rate_index = (data[2] >> 2) & 0x03;
+        uint8_t padding = (data[2] >> 1) & 0x01;
+
+        // Reserved values, free format isn't supported as the frame size can't be computed
+        if (version_bits == 0x01 || layer_bits == 0x00 || bitrate_index == 0 || bitrate_index == 0x0F ||
+                sample_rate_index == 0x03)
+        {
+            return false;
+        }
+
+        header.version = version_bits == 0x03 ? 1 : version_bits == 0x02 ? 2 : 3;
+        header.layer = 4 - layer_bits;
+        header.channels = (data[3] >> 6) == 0x03 ? 1 : 2;
+        header.sample_rate = SAMPLE_RATES[sample_rate_index] >> (header.version - 1);
+
+        size_t table = header.version == 1 ? header.layer - 1 : (header.layer == 1 ? 3 : 4);
+        header.bitrate = BITRATES[table][bitrate_index] * 1000;
+
+        if (header.layer == 1)
+        {
+            header.samples = 384;
+            header.size = (12 * header.bitrate / header.sample_rate + padding) * 4;
+        }
+        else
+        {
+            bool half = header.layer == 3 && header.version != 1;
+            header.samples = half ? 576 : 1152;
+            header.size = (half ? 72 : 144) * header.bitrate / header.sample_rate + padding;
+        }
+
+        return true;
+    }
+
+private:
+
+    static bool same_stream(
+            const FrameHeader& a,
+            const FrameHeader& b)
+    {
+        return a.version == b.version && a.layer == b.layer && a.sample_rate == b.sample_rate;
+    }
+
+    /**
+     * @brief Computes the size of the tag starting the input
+     *
+     * @return False if more input is needed to know the size
+     */
+    bool parse_tag(
+            RingBuffer& input,
+            const uint8_t* head,
+            size_t available,
+            size_t& size)
+    {
+        if (memcmp(head, "ID3", 3) == 0)
+        {
+            if (available < ID3V2_HEADER_SIZE)
+            {
+                return false;
+            }
+
+            // Sizes are syncsafe integers, 7 bits per byte
+            size = ID3V2_HEADER_SIZE + ((head[6] & 0x7F) << 21 | (head[7] & 0x7F) << 14 | (head[8] & 0x7F) << 7 |
+                    (head[9] & 0x7F));
+
+            // Footer present
+            if (head[5] & 0x10)
+            {
+                size += ID3V2_HEADER_SIZE;
+            }
+
+            ESP_LOGI(TAG, "Skipping ID3v2 tag of %zu bytes", size);
+        }
+        else if (memcmp(head, "TAG", 3) == 0)
+        {
+            size = ID3V1_SIZE;
+        }
+        else
+        {
+            uint8_t ape[APE_HEADER_SIZE];
+
+            if (input.peek(ape) < APE_HEADER_SIZE)
+            {
+                return false;
+            }
+
+            if (memcmp(ape, "APETAGEX", 8) != 0)
+            {
+                return true;
+            }
+
+            uint32_t tag_size = ape[12] | (ape[13] << 8) | (ape[14] << 16) | (static_cast<uint32_t>(ape[15]) << 24);
+            bool is_header = ape[23] & 0x20;
+
+            // The size covers the items and the footer, a header is followed by both
+            size = is_header ? APE_HEADER_SIZE + tag_size : APE_HEADER_SIZE;
+
+            ESP_LOGI(TAG, "Skipping APE tag of %zu bytes", size);
+        }
+
+        return true;
+    }
+
+    void lose_sync(
+            RingBuffer& input)
+    {
+        if (synced_)
+        {
+            ESP_LOGW(TAG, "Lost frame sync");
+            DecodeStats::get_instance().sync_error();
+            synced_ = false;
+        }
+
+        // Drop up to the next candidate sync byte
+        auto read_slot = input.max_read_slot();
+        const void* next = memchr(read_slot.data() + 1, 0xFF, read_slot.size() - 1);
+        size_t size = next != NULL ? static_cast<const uint8_t*>(next) - read_slot.data() : read_slot.size();
+
+        input.commit_read(size);
+        skipped_ += size;
+        DecodeStats::get_instance().skipped(size);
+    }
+
+    std::vector<uint8_t> frame_;
+    FrameHeader first_ = {};
+    FrameHeader last_ = {};
+    bool synced_ = false;
+    size_t skip_remaining_ = 0;
+    size_t skipped_ = 0;
+};
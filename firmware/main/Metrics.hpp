@@ -0,0 +1,344 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+
+/**
+ * @brief Single named value exported through the metrics endpoint
+ *
+ * Gauges hold the last value set, counters only grow. Updates are lock-free so they can be done from
+ * the audio tasks without delaying them.
+ */
+class Metric
+{
+public:
+
+    enum class Type
+    {
+        GAUGE,
+        COUNTER
+    };
+
+    void set(
+            double value)
+    {
+        value_.store(value, std::memory_order_relaxed);
+    }
+
+    void add(
+            double delta = 1.0)
+    {
+        double current = value_.load(std::memory_order_relaxed);
+
+        while (!value_.compare_exchange_weak(current, current + delta, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    double get() const
+    {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+    const char* name() const
+    {
+        return name_;
+    }
+
+    const char* help() const
+    {
+        return help_;
+    }
+
+    Type type() const
+    {
+        return type_;
+    }
+
+private:
+
+    friend class Metrics;
+
+    const char* name_ = nullptr;
+    const char* help_ = nullptr;
+    Type type_ = Type::GAUGE;
+
+    // A float would stop counting at 2^24, e.g. the bytes of a stream after 16 MiB
+    std::atomic<double> value_ = 0.0;
+};
+
+/**
+ * @brief Distribution of a value over fixed buckets, exported as a Prometheus histogram
+ *
+ * Observations only increment atomics, so like Metric it can be updated from the audio tasks.
+ */
+class Histogram
+{
+public:
+
+    static constexpr size_t MAX_BUCKETS = 12;
+
+    void observe(
+            float value)
+    {
+        size_t bucket = 0;
+
+        while (bucket < bounds_.size() && value > bounds_[bucket])
+        {
+            bucket++;
+        }
+
+        counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        double current = sum_.load(std::memory_order_relaxed);
+
+        while (!sum_.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    const char* name() const
+    {
+        return name_;
+    }
+
+    const char* help() const
+    {
+        return help_;
+    }
+
+private:
+
+    friend class Metrics;
+
+    const char* name_ = nullptr;
+    const char* help_ = nullptr;
+    std::span<const float> bounds_;
+
+    // One count per bound plus the +Inf bucket, not cumulative
+    std::array<std::atomic<uint32_t>, MAX_BUCKETS + 1> counts_ = {};
+    std::atomic<double> sum_ = 0.0;
+};
+
+/**
+ * @brief Registry of all the metrics exported by the firmware
+ *
+ * Metrics are registered once by name and the returned reference is kept by the owner, so the hot paths
+ * never look them up. The registry renders them in Prometheus text format.
+ */
+class Metrics
+{
+    static constexpr const char* TAG = "Metrics";
+
+    static constexpr size_t MAX_METRICS = 96;
+    static constexpr size_t MAX_HISTOGRAMS = 8;
+
+public:
+
+    static Metrics& get_instance()
+    {
+        static Metrics metrics;
+
+        return metrics;
+    }
+
+    /**
+     * @brief Gets or creates a gauge
+     *
+     * @param name Metric name, must be a string literal
+     * @param help Metric description, must be a string literal
+     * @return Reference to the metric, valid for the whole firmware lifetime
+     */
+    Metric& gauge(
+            const char* name,
+            const char* help)
+    {
+        return get_or_create(name, help, Metric::Type::GAUGE);
+    }
+
+    /**
+     * @brief Gets or creates a counter
+     *
+     * @param name Metric name, must be a string literal
+     * @param help Metric description, must be a string literal
+     * @return Reference to the metric, valid for the whole firmware lifetime
+     */
+    Metric& counter(
+            const char* name,
+            const char* help)
+    {
+        return get_or_create(name, help, Metric::Type::COUNTER);
+    }
+
+    /**
+     * @brief Gets or creates a histogram
+     *
+     * @param name Metric name, must be a string literal
+     * @param help Metric description, must be a string literal
+     * @param bounds Ascending upper bounds of the buckets, must outlive the registry
+     * @return Reference to the histogram, valid for the whole firmware lifetime
+     */
+    Histogram& histogram(
+            const char* name,
+            const char* help,
+            std::span<const float> bounds)
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+
+        for (size_t i = 0; i < histogram_count_; i++)
+        {
+            if (std::strcmp(histograms_[i].name_, name) == 0)
+            {
+                xSemaphoreGive(mutex_);
+
+                return histograms_[i];
+            }
+        }
+
+        if (histogram_count_ == MAX_HISTOGRAMS || bounds.size() > Histogram::MAX_BUCKETS)
+        {
+            ESP_LOGE(TAG, "Can't create histogram %s, it will not be exported", name);
+            xSemaphoreGive(mutex_);
+
+            return discarded_histogram_;
+        }
+
+        Histogram& histogram = histograms_[histogram_count_];
+        histogram.name_ = name;
+        histogram.help_ = help;
+        histogram.bounds_ = bounds;
+        histogram_count_++;
+
+        xSemaphoreGive(mutex_);
+
+        return histogram;
+    }
+
+    /**
+     * @brief Renders all the metrics in Prometheus text exposition format
+     */
+    std::string render()
+    {
+        std::string output;
+        char line[256];
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        size_t count = count_;
+        xSemaphoreGive(mutex_);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const Metric& metric = metrics_[i];
+
+            int length = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.3f\n",
+                    metric.name(), metric.help(),
+                    metric.name(), metric.type() == Metric::Type::GAUGE ? "gauge" : "counter",
+                    metric.name(), metric.get());
+
+            // A truncated line would corrupt the whole scrape
+            if (length < 0 || static_cast<size_t>(length) >= sizeof(line))
+            {
+                ESP_LOGE(TAG, "Metric %s doesn't fit in a line, it is not exported", metric.name());
+                continue;
+            }
+
+            output += line;
+        }
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        count = histogram_count_;
+        xSemaphoreGive(mutex_);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const Histogram& histogram = histograms_[i];
+
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", histogram.name(), histogram.help(),
+                    histogram.name());
+            output += line;
+
+            // Prometheus buckets are cumulative
+            uint32_t cumulative = 0;
+
+            for (size_t bucket = 0; bucket < histogram.bounds_.size(); bucket++)
+            {
+                cumulative += histogram.counts_[bucket].load(std::memory_order_relaxed);
+                snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %lu\n", histogram.name(),
+                        histogram.bounds_[bucket], cumulative);
+                output += line;
+            }
+
+            cumulative += histogram.counts_[histogram.bounds_.size()].load(std::memory_order_relaxed);
+
+            snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.3f\n%s_count %lu\n",
+                    histogram.name(), cumulative,
+                    histogram.name(), histogram.sum_.load(std::memory_order_relaxed),
+                    histogram.name(), cumulative);
+            output += line;
+        }
+
+        return output;
+    }
+
+private:
+
+    Metrics()
+    {
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    Metric& get_or_create(
+            const char* name,
+            const char* help,
+            Metric::Type type)
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+
+        for (size_t i = 0; i < count_; i++)
+        {
+            if (std::strcmp(metrics_[i].name_, name) == 0)
+            {
+                xSemaphoreGive(mutex_);
+
+                return metrics_[i];
+            }
+        }
+
+        if (count_ == MAX_METRICS)
+        {
+            ESP_LOGE(TAG, "Too many metrics, %s will not be exported", name);
+            xSemaphoreGive(mutex_);
+
+            return discarded_;
+        }
+
+        Metric& metric = metrics_[count_];
+        metric.name_ = name;
+        metric.help_ = help;
+        metric.type_ = type;
+        count_++;
+
+        xSemaphoreGive(mutex_);
+
+        return metric;
+    }
+
+    SemaphoreHandle_t mutex_;
+    std::array<Metric, MAX_METRICS> metrics_;
+    size_t count_ = 0;
+    Metric discarded_;
+
+    std::array<Histogram, MAX_HISTOGRAMS> histograms_;
+    size_t histogram_count_ = 0;
+    Histogram discarded_histogram_;
+};
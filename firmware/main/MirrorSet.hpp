@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_http_client.h>
+#include <esp_crt_bundle.h>
+
+#include <Metrics.hpp>
+
+/**
+ * @brief Set of mirror prefixes serving the same songs, ranked by measured latency and health
+ *
+ * Each mirror keeps an EWMA of its connect and first byte latencies, measured by HEAD probes before the first song
+ * and then by every connection HTTPStream opens, so the ranking carries over from song to song without probing
+ * again. Mirrors that failed recently are ranked last until FAILURE_COOLDOWN_US expires.
+ */
+class MirrorSet
+{
+    static constexpr const char* TAG = "MirrorSet";
+
+    static constexpr int64_t FAILURE_COOLDOWN_US = 60LL * 1000 * 1000;
+    static constexpr int PROBE_TIMEOUT_MS = 1500;
+    static constexpr float EWMA_ALPHA = 0.3f;
+
+    struct Mirror
+    {
+        std::string prefix;
+        float connect_ms = 0.0f;
+        float first_byte_ms = 0.0f;
+        bool measured = false;
+        int64_t last_failure = 0;
+        uint32_t failures = 0;
+    };
+
+public:
+
+    MirrorSet(
+            std::span<const char* const> prefixes)
+        : failovers_(Metrics::get_instance().counter("cactus_mirror_failovers_total",
+                "Times a song switched to another mirror"))
+        , first_byte_(Metrics::get_instance().gauge("cactus_mirror_first_byte_ms",
+                "First byte latency of the last mirror connection"))
+    {
+        mutex_ = xSemaphoreCreateMutex();
+
+        for (const char* prefix : prefixes)
+        {
+            mirrors_.push_back({prefix});
+        }
+    }
+
+    ~MirrorSet()
+    {
+        vSemaphoreDelete(mutex_);
+    }
+
+    size_t size() const
+    {
+        return mirrors_.size();
+    }
+
+    const std::string& prefix(
+            size_t index) const
+    {
+        return mirrors_[index].prefix;
+    }
+
+    /**
+     * @brief Gets the mirror indexes ordered by preference: healthy first, then by first byte latency
+     */
+    std::vector<size_t> ranking()
+    {
+        int64_t now = esp_timer_get_time();
+        std::vector<size_t> order(mirrors_.size());
+
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+        }
+
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+
+        auto score = [&](size_t index)
+                {
+                    const Mirror& mirror = mirrors_[index];
+                    bool healthy = mirror.last_failure == 0 || now - mirror.last_failure > FAILURE_COOLDOWN_US;
+
+                    // Unmeasured mirrors keep their declaration order after the measured healthy ones
+                    float latency = mirror.measured ? mirror.first_byte_ms : 1e6f + index;
+
+                    return healthy ? latency : 1e9f + latency;
+                };
+
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                {
+                    return score(a) < score(b);
+                });
+
+        xSemaphoreGive(mutex_);
+
+        return order;
+    }
+
+    /**
+     * @brief Whether the latencies shall be measured before choosing a mirror, only until they were once
+     */
+    bool needs_probe()
+    {
+        return mirrors_.size() > 1 && !probed_;
+    }
+
+    /**
+     * @brief Measures connect and first byte latency of every mirror with a HEAD request
+     *
+     * @param path Song path appended to each prefix
+     */
+    void probe(
+            const std::string& path)
+    {
+        probed_ = true;
+
+        for (size_t i = 0; i < mirrors_.size(); i++)
+        {
+            std::string url = mirrors_[i].prefix + path;
+
+            esp_http_client_config_t config = {};
+            config.url = url.c_str();
+            config.method = HTTP_METHOD_HEAD;
+            config.timeout_ms = PROBE_TIMEOUT_MS;
+            config.crt_bundle_attach = esp_crt_bundle_attach;
+
+            esp_http_client_handle_t handle = esp_http_client_init(&config);
+
+            if (handle == NULL)
+            {
+                continue;
+            }
+
+            int64_t start = esp_timer_get_time();
+            esp_err_t err = esp_http_client_open(handle, 0);
+            int64_t connected = esp_timer_get_time();
+
+            if (err == ESP_OK && esp_http_client_fetch_headers(handle) >= 0 &&
+                    esp_http_client_get_status_code(handle) >= 200 && esp_http_client_get_status_code(handle) < 400)
+            {
+                int64_t first_byte = esp_timer_get_time();
+                report_success(i, (connected - start) / 1000.0f, (first_byte - start) / 1000.0f);
+            }
+            else
+            {
+                report_failure(i);
+            }
+
+            esp_http_client_close(handle);
+            esp_http_client_cleanup(handle);
+        }
+    }
+
+    void report_success(
+            size_t index,
+            float connect_ms,
+            float first_byte_ms)
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+
+        Mirror& mirror = mirrors_[index];
+
+        if (mirror.measured)
+        {
+            mirror.connect_ms += EWMA_ALPHA * (connect_ms - mirror.connect_ms);
+            mirror.first_byte_ms += EWMA_ALPHA * (first_byte_ms - mirror.first_byte_ms);
+        }
+        else
+        {
+            mirror.connect_ms = connect_ms;
+            mirror.first_byte_ms = first_byte_ms;
+            mirror.measured = true;
+        }
+
+        mirror.last_failure = 0;
+
+        xSemaphoreGive(mutex_);
+
+        first_byte_.set(first_byte_ms);
+
+        ESP_LOGI(TAG, "Mirror %s: connect %.0f ms, first byte %.0f ms", mirror.prefix.c_str(), connect_ms,
+                first_byte_ms);
+    }
+
+    /**
+     * @brief Marks a mirror as failing, either by an error or by throughput too low to sustain playback
+     */
+    void report_failure(
+            size_t index)
+    {
+        xSemaphoreTake(mutex_, portMAX_DELAY);
+        mirrors_[index].last_failure = esp_timer_get_time();
+        mirrors_[index].failures++;
+        xSemaphoreGive(mutex_);
+
+        ESP_LOGW(TAG, "Mirror %s marked as unhealthy", mirrors_[index].prefix.c_str());
+    }
+
+    void report_failover()
+    {
+        failovers_.add();
+    }
+
+private:
+
+    std::vector<Mirror> mirrors_;
+    SemaphoreHandle_t mutex_;
+    bool probed_ = false;
+
+    Metric& failovers_;
+    Metric& first_byte_;
+};
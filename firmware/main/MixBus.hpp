@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+
+/**
+ * @brief 32-bit samples the output is processed in, from the resampler to the DMA buffers
+ *
+ * The 16-bit samples are scaled up by EXTRA_BITS: full scale is 2^27, the 4 bits above leave 24 dB of headroom so
+ * that the stages in between never wrap and only saturate at HEADROOM, and the 12 bits below keep the rounding
+ * errors of the gains and filters away from the output. The resampler widens the samples as it writes them and
+ * pack() narrows them into the DMA buffer, so no pass is spent on the conversions.
+ *
+ * Packing to 16 bits adds high-passed TPDF dither: the difference of two consecutive uniform values per channel,
+ * so a single random number per frame. Samples that have no fraction, e.g. music that went through unchanged,
+ * aren't dithered so that they stay bit-exact and silence stays silent.
+ */
+class MixBus
+{
+    // Fraction of the 16-bit output, as a 12-bit uniform value
+    static constexpr int32_t FRACTION_MASK = (1 << 12) - 1;
+
+public:
+
+    static constexpr int EXTRA_BITS = 12;
+    static constexpr int32_t FULL_SCALE = 1 << (15 + EXTRA_BITS);
+    static constexpr int32_t HEADROOM = 1 << 30;
+    static constexpr uint8_t CHANNELS = 2;
+
+    /**
+     * @param frames Largest chunk processed at a time
+     */
+    explicit MixBus(
+            size_t frames)
+        : frames_(frames)
+    {
+        // Touched by every stage, in internal RAM
+        samples_ = static_cast<int32_t*>(heap_caps_aligned_alloc(16, frames * CHANNELS * sizeof(int32_t),
+                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        // Like the sink holding it, the output can't run without it
+        ESP_ERROR_CHECK(samples_ != nullptr ? ESP_OK : ESP_ERR_NO_MEM);
+    }
+
+    ~MixBus()
+    {
+        heap_caps_free(samples_);
+    }
+
+    MixBus(const MixBus&) = delete;
+    MixBus& operator=(const MixBus&) = delete;
+
+    static int32_t widen(
+            int16_t sample)
+    {
+        return static_cast<int32_t>(sample) << EXTRA_BITS;
+    }
+
+    /**
+     * @brief Samples of up to frames frames
+     */
+    std::span<int32_t> samples(
+            size_t frames)
+    {
+        return std::span<int32_t>(samples_, std::min(frames, frames_) * CHANNELS);
+    }
+
+    /**
+     * @brief Rounds to 16 bits with dither and saturates, in a single pass
+     *
+     * @param output As many samples as the input, interleaved stereo
+     */
+    void pack(
+            std::span<const int32_t> samples,
+            std::span<int16_t> output)
+    {
+        uint32_t seed = seed_;
+        int32_t left_previous = previous_[0];
+        int32_t right_previous = previous_[1];
+
+        for (size_t i = 0; i + 1 < samples.size(); i += 2)
+        {
+            seed = seed * 1664525 + 1013904223;
+
+            // Two 12-bit values from the upper bits, the lower ones of the generator have short periods
+            int32_t left_random = seed >> 20;
+            int32_t right_random = (seed >> 8) & FRACTION_MASK;
+
+            int32_t left = samples[i];
+            int32_t right = samples[i + 1];
+
+            left += (left_random - left_previous) & -static_cast<int32_t>((left & FRACTION_MASK) != 0);
+            right += (right_random - right_previous) & -static_cast<int32_t>((right & FRACTION_MASK) != 0);
+            left_previous = left_random;
+            right_previous = right_random;
+
+            output[i] = std::clamp<int32_t>((left + (1 << (EXTRA_BITS - 1))) >> EXTRA_BITS, INT16_MIN, INT16_MAX);
+            output[i + 1] = std::clamp<int32_t>((right + (1 << (EXTRA_BITS - 1))) >> EXTRA_BITS, INT16_MIN,
+                    INT16_MAX);
+        }
+
+        seed_ = seed;
+        previous_[0] = left_previous;
+        previous_[1] = right_previous;
+    }
+
+    /**
+     * @brief Saturates to full scale and left aligns in 32-bit slots, the amplifier gets the 28 bits of the bus
+     */
+    void pack(
+            std::span<const int32_t> samples,
+            std::span<int32_t> output)
+    {
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            output[i] = std::clamp<int32_t>(samples[i], -FULL_SCALE, FULL_SCALE - 1) << (31 - 15 - EXTRA_BITS);
+        }
+    }
+
+private:
+
+    int32_t* samples_;
+    size_t frames_;
+
+    uint32_t seed_ = 1;
+    int32_t previous_[CHANNELS] = {};
+};
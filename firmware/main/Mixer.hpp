@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <GainRamp.hpp>
+#include <MixBus.hpp>
+#include <Q15Gain.hpp>
+
+/**
+ * @brief Mixes the music with the notification voices in a single pass over the output
+ *
+ * Each output sample is the music on the MixBus scaled by the gain plus every voice widened to the bus, saturated
+ * once at its headroom, so loud beeps over loud music are left to the limiter instead of clipping here. The gain
+ * follows a GainRamp so volume changes and muting don't click, the voices aren't affected by it. Without voices and
+ * once the ramp settled the plain gain loop is used, the scalar 32 bits one of Q15Gain.
+ */
+class Mixer
+{
+public:
+
+    static constexpr size_t MAX_VOICES = 8;
+
+    /**
+     * @param samples Music on the MixBus, mixed in place
+     * @param gain Music gain, advanced by the number of samples
+     * @param voices Voices to add, interleaved like the music, they may end before the music does
+     */
+    static void mix(
+            std::span<int32_t> samples,
+            GainRamp& gain,
+            std::span<const std::span<const int16_t>> voices)
+    {
+        gain.prepare();
+
+        std::array<const int16_t*, MAX_VOICES> active;
+        std::array<size_t, MAX_VOICES> ends;
+        size_t count = 0;
+
+        for (const auto& voice : voices)
+        {
+            if (!voice.empty() && count < MAX_VOICES)
+            {
+                active[count] = voice.data();
+                ends[count] = std::min(voice.size(), samples.size());
+                count++;
+            }
+        }
+
+        // The output is split where voices and the ramp end, each segment is mixed with a fixed set of voices
+        size_t position = 0;
+
+        while (position < samples.size())
+        {
+            if (count == 0 && gain.remaining() == 0)
+            {
+                Q15Gain::apply(samples.subspan(position), gain.gain());
+                break;
+            }
+
+            size_t end = samples.size();
+
+            if (gain.remaining() > 0)
+            {
+                end = std::min<size_t>(end, position + gain.remaining());
+            }
+
+            for (size_t v = 0; v < count; v++)
+            {
+                end = std::min(end, ends[v]);
+            }
+
+            mix_segment(samples.data(), position, end, gain, std::span<const int16_t* const>(active.data(), count));
+            position = end;
+
+            // Drop the voices that ended
+            size_t kept = 0;
+
+            for (size_t v = 0; v < count; v++)
+            {
+                if (ends[v] > position)
+                {
+                    active[kept] = active[v];
+                    ends[kept] = ends[v];
+                    kept++;
+                }
+            }
+
+            count = kept;
+        }
+    }
+
+private:
+
+    static void mix_segment(
+            int32_t* samples,
+            size_t begin,
+            size_t end,
+            GainRamp& gain,
+            std::span<const int16_t* const> voices)
+    {
+        int32_t value = gain.value_;
+        int32_t step = gain.step_;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            // The ramp is in Q30
+            int32_t sum = (static_cast<int64_t>(samples[i]) * value) >> (15 + GainRamp::EXTRA_BITS);
+            value += step;
+
+            for (const int16_t* voice : voices)
+            {
+                sum += MixBus::widen(voice[i]);
+            }
+
+            samples[i] = std::clamp<int32_t>(sum, -MixBus::HEADROOM, MixBus::HEADROOM);
+        }
+
+        gain.advance(end - begin);
+    }
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#include <MixBus.hpp>
+#include <Resampler.hpp>
+#include <WAVParser.hpp>
+
+extern const uint8_t beep_start[] asm("_binary_beep_wav_start");
+extern const uint8_t beep_end[]   asm("_binary_beep_wav_end");
+
+extern const uint8_t start_beep_start[] asm("_binary_start_beep_wav_start");
+extern const uint8_t start_beep_end[]   asm("_binary_start_beep_wav_end");
+
+extern const uint8_t volume_beep_start[] asm("_binary_volume_beep_wav_start");
+extern const uint8_t volume_beep_end[]   asm("_binary_volume_beep_wav_end");
+
+/**
+ * @brief Notification sounds, embedded in the firmware
+ *
+ * A sound is added with its ID, an entry in the table below and the WAV file in EMBED_FILES. The WAV files are
+ * parsed once, when the voices are created at boot, and rendered into PSRAM in the output format: resampled if
+ * needed, copied otherwise. Clips are mixed after the resampler, so they play at the right pitch whatever the rate
+ * of the track, and playing one only points a voice at its samples.
+ */
+enum class ClipId : uint8_t
+{
+    START,
+    VOLUME,
+    BEEP,
+    COUNT
+};
+
+struct Clip
+{
+    std::span<const int16_t> samples;
+
+    // A voice of a higher priority can steal the voice of a lower or equal one when all are busy
+    uint8_t priority;
+
+    // Triggering the clip again restarts the voice already playing it instead of overlapping another one
+    bool restart;
+};
+
+class NotificationClips
+{
+    static constexpr const char* TAG = "NotificationClips";
+
+    // Frames converted at a time
+    static constexpr size_t CHUNK_FRAMES = 256;
+
+public:
+
+    static const Clip& get(
+            ClipId id)
+    {
+        static const std::array<Clip, static_cast<size_t>(ClipId::COUNT)> clips = {
+            load(start_beep_start, start_beep_end, 2, true),
+            load(volume_beep_start, volume_beep_end, 0, true),
+            load(beep_start, beep_end, 1, false)
+        };
+
+        return clips[static_cast<size_t>(id)];
+    }
+
+private:
+
+    static Clip load(
+            const uint8_t* start,
+            const uint8_t* end,
+            uint8_t priority,
+            bool restart)
+    {
+        WAVParser parser(start, end);
+        auto data = parser.get_data();
+
+        if (parser.get_bits_per_sample() != 16)
+        {
+            ESP_LOGE(TAG, "Only 16 bits clips are supported");
+
+            return {{}, priority, restart};
+        }
+
+        std::span<const int16_t> samples(reinterpret_cast<const int16_t*>(data.data()), data.size() / 2);
+
+        return {render(samples, parser.get_sample_rate(), parser.get_num_channels()), priority, restart};
+    }
+
+    /**
+     * @brief Renders a clip in the output format into PSRAM, the copy lives as long as the firmware
+     */
+    static std::span<const int16_t> render(
+            std::span<const int16_t> samples,
+            uint32_t sample_rate,
+            uint8_t channels)
+    {
+        if (channels == 0 || sample_rate == 0)
+        {
+            ESP_LOGE(TAG, "Invalid clip format");
+
+            return {};
+        }
+
+        bool convert = sample_rate != Resampler::OUTPUT_RATE || channels != Resampler::OUTPUT_CHANNELS;
+
+        // The filter delays the clip, silence flushes its end
+        size_t frames = samples.size() / channels;
+        size_t capacity = convert
+                ? (static_cast<uint64_t>(frames) + Resampler::TAPS) * Resampler::OUTPUT_RATE / sample_rate + 1
+                : frames;
+        size_t size = capacity * Resampler::OUTPUT_CHANNELS * sizeof(int16_t);
+        int16_t* output = static_cast<int16_t*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM));
+
+        if (output == nullptr)
+        {
+            ESP_LOGE(TAG, "Failed to allocate %zu bytes for a clip", size);
+
+            // Played from the firmware image rather than not at all
+            return convert ? std::span<const int16_t>() : samples;
+        }
+
+        if (!convert)
+        {
+            std::memcpy(output, samples.data(), size);
+            ESP_LOGI(TAG, "Loaded clip, %zu frames", frames);
+
+            return std::span<const int16_t>(output, frames * Resampler::OUTPUT_CHANNELS);
+        }
+
+        Resampler resampler;
+
+        if (!resampler.configure(sample_rate, channels))
+        {
+            heap_caps_free(output);
+
+            return {};
+        }
+
+        std::vector<int16_t> silence(Resampler::TAPS * channels);
+        MixBus bus(CHUNK_FRAMES);
+        size_t produced = 0;
+
+        // Resampled a chunk at a time on the bus, and packed to 16 bits like the output
+        for (std::span<const int16_t> input : {samples, std::span<const int16_t>(silence)})
+        {
+            while (produced < capacity)
+            {
+                size_t consumed = 0;
+                std::span<int32_t> chunk = bus.samples(std::min(CHUNK_FRAMES, capacity - produced));
+                size_t count = resampler.process(input, chunk, consumed);
+
+                input = input.subspan(consumed);
+
+                if (count == 0 && consumed == 0)
+                {
+                    break;
+                }
+
+                bus.pack(chunk.first(count * Resampler::OUTPUT_CHANNELS),
+                        std::span<int16_t>(output + produced * Resampler::OUTPUT_CHANNELS,
+                        count * Resampler::OUTPUT_CHANNELS));
+                produced += count;
+            }
+        }
+
+        ESP_LOGI(TAG, "Converted clip from %lu Hz %u channels, %zu frames", sample_rate, channels, produced);
+
+        return std::span<const int16_t>(output, produced * Resampler::OUTPUT_CHANNELS);
+    }
+};
@@ -0,0 +1,456 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <esp_log.h>
+
+#include <decoder/esp_audio_dec.h>
+#include <decoder/impl/esp_opus_dec.h>
+
+#include <AudioDecoder.hpp>
+#include <DecodeStats.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Ogg demuxer feeding the Opus packets of an Ogg Opus stream (RFC 7845) to the Opus decoder
+ *
+ * Pages are parsed as they arrive, only the packet being assembled is buffered. The comment header is skipped
+ * without buffering it as it may embed cover art. Output is always 48 kHz.
+ *
+ * A page that doesn't start with the capture pattern, e.g. after a corrupted or truncated page, is skipped up to
+ * the next "OggS" and parsing resumes there, only losing the packets of the skipped bytes.
+ */
+class OggOpusDecoder : public AudioDecoder
+{
+    static constexpr const char* TAG = "OggOpusDecoder";
+
+    static constexpr size_t PAGE_HEADER_SIZE = 27;
+    static constexpr const char* CAPTURE_PATTERN = "OggS";
+    static constexpr size_t CAPTURE_PATTERN_SIZE = 4;
+    // Header type flag of a page whose first packet continues from the previous page
+    static constexpr uint8_t CONTINUED_PACKET = 0x01;
+    static constexpr size_t MAX_SEGMENTS = 255;
+    static constexpr size_t MAX_PACKET_SIZE = 8 * 1024;
+    static constexpr uint32_t SAMPLE_RATE = 48000;
+
+    // 120 ms, the longest Opus packet, at 48 kHz stereo
+    static constexpr size_t MAX_FRAME_BYTES = SAMPLE_RATE * 120 / 1000 * 2 * sizeof(int16_t);
+
+    enum class State
+    {
+        PAGE_HEADER,
+        SEGMENT_TABLE,
+        PAYLOAD,
+        // Looking for the next page after losing sync
+        RESYNC,
+        // Terminal, the stream can't be decoded
+        DISCARD
+    };
+
+public:
+
+    OggOpusDecoder()
+        : pcm_(MAX_FRAME_BYTES)
+    {
+        packet_.reserve(MAX_PACKET_SIZE);
+    }
+
+    ~OggOpusDecoder() override
+    {
+        if (handle_ != NULL)
+        {
+            esp_audio_dec_close(handle_);
+        }
+    }
+
+    const char* name() const override
+    {
+        return "Opus";
+    }
+
+    AudioCodec codec() const override
+    {
+        return AudioCodec::OPUS;
+    }
+
+    void reset() override
+    {
+        state_ = State::PAGE_HEADER;
+        filled_ = 0;
+        segments_ = 0;
+        segment_index_ = 0;
+        segment_remaining_ = 0;
+        packet_.clear();
+        packet_ready_ = false;
+        packet_dropped_ = false;
+        resynced_ = false;
+        packets_ = 0;
+        pre_skip_ = 0;
+        bytes_decoded_ = 0;
+        samples_decoded_ = 0;
+        info_ = {};
+    }
+
+    esp_audio_simple_dec_info_t get_info() override
+    {
+        return info_;
+    }
+
+    void process(
+            RingBuffer& input,
+            RingBuffer& output) override
+    {
+        if (packet_ready_ && !decode_packet(output))
+        {
+            return;
+        }
+
+        // Empty segments terminating a packet are handled even if no input is left
+        while (input.used_space() > 0 || (state_ == State::PAYLOAD && segment_remaining_ == 0))
+        {
+            switch (state_)
+            {
+                case State::PAGE_HEADER:
+                    if (!fill(input, PAGE_HEADER_SIZE))
+                    {
+                        return;
+                    }
+
+                    if (memcmp(header_, CAPTURE_PATTERN, CAPTURE_PATTERN_SIZE) != 0)
+                    {
+                        ESP_LOGW(TAG, "Lost Ogg page sync, looking for the next page");
+                        DecodeStats::get_instance().sync_error();
+
+                        // The packet being assembled lost its end, the header bytes are searched too
+                        packet_.clear();
+                        filled_ = PAGE_HEADER_SIZE;
+                        resynced_ = true;
+                        state_ = State::RESYNC;
+                        break;
+                    }
+
+                    if (resynced_)
+                    {
+                        // The end of a packet whose beginning was skipped is dropped
+                        packet_dropped_ = (header_[5] & CONTINUED_PACKET) != 0;
+                        resynced_ = false;
+                    }
+
+                    segments_ = header_[26];
+                    state_ = State::SEGMENT_TABLE;
+                    break;
+
+                case State::SEGMENT_TABLE:
+                    if (!fill(input, segments_))
+                    {
+                        return;
+                    }
+
+                    memcpy(lacing_, header_, segments_);
+                    segment_index_ = 0;
+                    segment_remaining_ = segments_ > 0 ? lacing_[0] : 0;
+                    state_ = segments_ > 0 ? State::PAYLOAD : State::PAGE_HEADER;
+                    break;
+
+                case State::PAYLOAD:
+                    if (!read_segment(input))
+                    {
+                        return;
+                    }
+
+                    if (packet_ready_ && !decode_packet(output))
+                    {
+                        return;
+                    }
+
+                    break;
+
+                case State::RESYNC:
+                    if (!resync(input))
+                    {
+                        return;
+                    }
+
+                    // The rest of the header is read from the capture pattern found
+                    state_ = State::PAGE_HEADER;
+                    break;
+
+                case State::DISCARD:
+                {
+                    size_t size = input.max_read_slot().size();
+                    input.commit_read(size);
+                    DecodeStats::get_instance().skipped(size);
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+
+    bool fill(
+            RingBuffer& input,
+            size_t size)
+    {
+        filled_ += input.read(std::span<uint8_t>(header_ + filled_, size - filled_));
+
+        if (filled_ < size)
+        {
+            return false;
+        }
+
+        filled_ = 0;
+
+        return true;
+    }
+
+    /**
+     * @brief Drops the bytes of header_ and of the input up to the next capture pattern
+     *
+     * @return Whether header_ starts with the capture pattern, filled_ bytes of it are read
+     */
+    bool resync(
+            RingBuffer& input)
+    {
+        while (true)
+        {
+            // First position where the pattern, or its beginning at the end of the bytes read, matches
+            size_t start = 0;
+
+            while (start < filled_ && memcmp(header_ + start, CAPTURE_PATTERN,
+                    std::min(CAPTURE_PATTERN_SIZE, filled_ - start)) != 0)
+            {
+                start++;
+            }
+
+            if (start > 0)
+            {
+                memmove(header_, header_ + start, filled_ - start);
+                filled_ -= start;
+                DecodeStats::get_instance().skipped(start);
+            }
+
+            if (filled_ >= CAPTURE_PATTERN_SIZE)
+            {
+                return true;
+            }
+
+            size_t size = input.read(std::span<uint8_t>(header_ + filled_, PAGE_HEADER_SIZE - filled_));
+
+            if (size == 0)
+            {
+                return false;
+            }
+
+            filled_ += size;
+        }
+    }
+
+    /**
+     * @brief Appends the current segment to the packet and moves to the next segment
+     *
+     * @return Whether the segment is complete
+     */
+    bool read_segment(
+            RingBuffer& input)
+    {
+        while (segment_remaining_ > 0)
+        {
+            auto read_slot = input.max_read_slot();
+            size_t size = std::min(read_slot.size(), segment_remaining_);
+
+            if (size == 0)
+            {
+                return false;
+            }
+
+            // The comment header and oversized packets are dropped instead of buffered
+            if (packets_ != 1 && packet_.size() + size <= MAX_PACKET_SIZE)
+            {
+                packet_.insert(packet_.end(), read_slot.begin(), read_slot.begin() + size);
+            }
+            else
+            {
+                packet_dropped_ = true;
+            }
+
+            input.commit_read(size);
+            segment_remaining_ -= size;
+        }
+
+        // A lacing value below 255 terminates the packet, otherwise it continues in the next segment or page
+        packet_ready_ = lacing_[segment_index_] < 255;
+        segment_index_++;
+
+        if (segment_index_ < segments_)
+        {
+            segment_remaining_ = lacing_[segment_index_];
+        }
+        else
+        {
+            state_ = State::PAGE_HEADER;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Handles the assembled packet
+     *
+     * @return False if the output has no room for the decoded packet yet
+     */
+    bool decode_packet(
+            RingBuffer& output)
+    {
+        if (packets_ == 0)
+        {
+            parse_identification_header();
+        }
+        else if (packets_ > 1 && !packet_dropped_ && handle_ != NULL)
+        {
+            if (output.free_space() < MAX_FRAME_BYTES)
+            {
+                return false;
+            }
+
+            decode_audio(output);
+        }
+
+        packets_++;
+        packet_.clear();
+        packet_ready_ = false;
+        packet_dropped_ = false;
+
+        return true;
+    }
+
+    void parse_identification_header()
+    {
+        if (packet_.size() < 19 || memcmp(packet_.data(), "OpusHead", 8) != 0)
+        {
+            ESP_LOGE(TAG, "Missing Opus identification header");
+            state_ = State::DISCARD;
+
+            return;
+        }
+
+        uint8_t channels = packet_[9];
+        pre_skip_ = packet_[10] | (packet_[11] << 8);
+
+        if (channels == 0 || channels > 2)
+        {
+            ESP_LOGE(TAG, "Unsupported channel count %u", channels);
+            state_ = State::DISCARD;
+
+            return;
+        }
+
+        info_.sample_rate = SAMPLE_RATE;
+        info_.channel = channels;
+        info_.bits_per_sample = 16;
+
+        ESP_LOGI(TAG, "Opus stream: %u channels, pre-skip %lu samples", channels, pre_skip_);
+
+        // A decoder reused from a previous track only needs a reset if the channels match
+        if (handle_ != NULL && channels == channels_)
+        {
+            esp_audio_dec_reset(handle_);
+
+            return;
+        }
+
+        if (handle_ != NULL)
+        {
+            esp_audio_dec_close(handle_);
+            handle_ = NULL;
+        }
+
+        esp_opus_dec_cfg_t opus_config = {};
+        opus_config.sample_rate = SAMPLE_RATE;
+        opus_config.channel = channels;
+        opus_config.frame_duration = ESP_OPUS_DEC_FRAME_DURATION_INVALID;
+
+        esp_audio_dec_cfg_t config = {};
+        config.type = ESP_AUDIO_TYPE_OPUS;
+        config.cfg = &opus_config;
+        config.cfg_sz = sizeof(opus_config);
+
+        esp_audio_err_t ret = esp_audio_dec_open(&config, &handle_);
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open Opus decoder with error %d", ret);
+            handle_ = NULL;
+            state_ = State::DISCARD;
+
+            return;
+        }
+
+        channels_ = channels;
+    }
+
+    void decode_audio(
+            RingBuffer& output)
+    {
+        esp_audio_dec_in_raw_t raw = {};
+        raw.buffer = packet_.data();
+        raw.len = packet_.size();
+
+        esp_audio_dec_out_frame_t frame = {};
+        frame.buffer = pcm_.data();
+        frame.len = pcm_.size();
+
+        uint32_t start = DecodeStats::start();
+        esp_audio_err_t ret = esp_audio_dec_process(handle_, &raw, &frame);
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGE(TAG, "Failed to decode Opus packet with error %d", ret);
+            DecodeStats::get_instance().decode_error();
+
+            return;
+        }
+
+        DecodeStats::get_instance().frame_decoded(start, frame.decoded_size / (info_.channel * sizeof(int16_t)),
+                SAMPLE_RATE);
+
+        bytes_decoded_ += raw.len;
+        samples_decoded_ += frame.decoded_size / (info_.channel * sizeof(int16_t));
+        info_.bitrate = samples_decoded_ > 0 ? bytes_decoded_ * 8 * SAMPLE_RATE / samples_decoded_ : 0;
+
+        // The encoder delay at the start of the stream shall not be played
+        size_t skip_bytes = std::min<size_t>(frame.decoded_size, pre_skip_ * info_.channel * sizeof(int16_t));
+        pre_skip_ -= skip_bytes / (info_.channel * sizeof(int16_t));
+
+        output.write(std::span<const uint8_t>(pcm_.data() + skip_bytes, frame.decoded_size - skip_bytes));
+    }
+
+    State state_ = State::PAGE_HEADER;
+    uint8_t header_[MAX_SEGMENTS] = {};
+    size_t filled_ = 0;
+
+    uint8_t lacing_[MAX_SEGMENTS] = {};
+    size_t segments_ = 0;
+    size_t segment_index_ = 0;
+    size_t segment_remaining_ = 0;
+
+    std::vector<uint8_t> packet_;
+    bool packet_ready_ = false;
+    bool packet_dropped_ = false;
+    // The next page follows skipped bytes
+    bool resynced_ = false;
+    uint32_t packets_ = 0;
+
+    std::vector<uint8_t> pcm_;
+    uint32_t pre_skip_ = 0;
+    uint64_t bytes_decoded_ = 0;
+    uint64_t samples_decoded_ = 0;
+
+    esp_audio_dec_handle_t handle_ = NULL;
+    uint8_t channels_ = 0;
+    esp_audio_simple_dec_info_t info_ = {};
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include <esp_log.h>
+
+#include <AudioDecoder.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Streaming WAV parser passing 16 bits PCM straight to the output, no decoding involved
+ *
+ * Chunks are parsed as they arrive so the header doesn't need to be buffered whole, unknown chunks are skipped.
+ */
+class PCMDecoder : public AudioDecoder
+{
+    static constexpr const char* TAG = "PCMDecoder";
+
+    static constexpr size_t RIFF_HEADER_SIZE = 12;
+    static constexpr size_t CHUNK_HEADER_SIZE = 8;
+    static constexpr size_t FMT_SIZE = 16;
+
+    static constexpr uint16_t FORMAT_PCM = 1;
+    static constexpr uint16_t FORMAT_EXTENSIBLE = 0xFFFE;
+
+    enum class State
+    {
+        RIFF_HEADER,
+        CHUNK_HEADER,
+        FMT,
+        SKIP,
+        DATA,
+        DISCARD
+    };
+
+public:
+
+    const char* name() const override
+    {
+        return "WAV";
+    }
+
+    AudioCodec codec() const override
+    {
+        return AudioCodec::WAV;
+    }
+
+    void reset() override
+    {
+        state_ = State::RIFF_HEADER;
+        filled_ = 0;
+        chunk_remaining_ = 0;
+        info_ = {};
+    }
+
+    esp_audio_simple_dec_info_t get_info() override
+    {
+        return info_;
+    }
+
+    void process(
+            RingBuffer& input,
+            RingBuffer& output) override
+    {
+        while (input.used_space() > 0)
+        {
+            switch (state_)
+            {
+                case State::RIFF_HEADER:
+                    if (!fill(input, RIFF_HEADER_SIZE))
+                    {
+                        return;
+                    }
+
+                    if (memcmp(header_, "RIFF", 4) != 0 || memcmp(header_ + 8, "WAVE", 4) != 0)
+                    {
+                        ESP_LOGE(TAG, "Invalid WAV file");
+                        state_ = State::DISCARD;
+                        break;
+                    }
+
+                    state_ = State::CHUNK_HEADER;
+                    break;
+
+                case State::CHUNK_HEADER:
+                    if (!fill(input, CHUNK_HEADER_SIZE))
+                    {
+                        return;
+                    }
+
+                    chunk_remaining_ = read_le32(header_ + 4);
+
+                    if (memcmp(header_, "fmt ", 4) == 0 && chunk_remaining_ >= FMT_SIZE)
+                    {
+                        state_ = State::FMT;
+                    }
+                    else if (memcmp(header_, "data", 4) == 0)
+                    {
+                        start_data();
+                    }
+                    else
+                    {
+                        // Chunks are word aligned
+                        chunk_remaining_ += chunk_remaining_ & 1;
+                        state_ = State::SKIP;
+                    }
+
+                    break;
+
+                case State::FMT:
+                    if (!fill(input, FMT_SIZE))
+                    {
+                        return;
+                    }
+
+                    parse_fmt();
+                    chunk_remaining_ -= FMT_SIZE;
+                    chunk_remaining_ += chunk_remaining_ & 1;
+
+                    if (state_ != State::DISCARD)
+                    {
+                        state_ = State::SKIP;
+                    }
+
+                    break;
+
+                case State::SKIP:
+                    chunk_remaining_ -= skip(input, chunk_remaining_);
+
+                    if (chunk_remaining_ > 0)
+                    {
+                        return;
+                    }
+
+                    state_ = State::CHUNK_HEADER;
+                    break;
+
+                case State::DATA:
+                    copy(input, output);
+
+                    return;
+
+                case State::DISCARD:
+                    skip(input, input.used_space());
+
+                    return;
+            }
+        }
+    }
+
+private:
+
+    static uint32_t read_le32(
+            const uint8_t* data)
+    {
+        return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+    }
+
+    static uint16_t read_le16(
+            const uint8_t* data)
+    {
+        return data[0] | (data[1] << 8);
+    }
+
+    /**
+     * @brief Accumulates size bytes of header, across calls if the input is short
+     *
+     * @return Whether the header is complete
+     */
+    bool fill(
+            RingBuffer& input,
+            size_t size)
+    {
+        filled_ += input.read(std::span<uint8_t>(header_ + filled_, size - filled_));
+
+        if (filled_ < size)
+        {
+            return false;
+        }
+
+        filled_ = 0;
+
+        return true;
+    }
+
+    static size_t skip(
+            RingBuffer& input,
+            size_t size)
+    {
+        size_t skipped = 0;
+
+        while (skipped < size)
+        {
+            size_t chunk = std::min(input.max_read_slot().size(), size - skipped);
+
+            if (chunk == 0)
+            {
+                break;
+            }
+
+            input.commit_read(chunk);
+            skipped += chunk;
+        }
+
+        return skipped;
+    }
+
+    void parse_fmt()
+    {
+        uint16_t format = read_le16(header_);
+        uint16_t channels = read_le16(header_ + 2);
+        uint32_t sample_rate = read_le32(header_ + 4);
+        uint16_t bits_per_sample = read_le16(header_ + 14);
+
+        if ((format != FORMAT_PCM && format != FORMAT_EXTENSIBLE) || bits_per_sample != 16 || channels == 0 ||
+                channels > 2)
+        {
+            ESP_LOGE(TAG, "Unsupported WAV format %u: %u channels, %u bits", format, channels, bits_per_sample);
+            state_ = State::DISCARD;
+
+            return;
+        }
+
+        info_.sample_rate = sample_rate;
+        info_.channel = channels;
+        info_.bits_per_sample = bits_per_sample;
+        info_.bitrate = sample_rate * channels * bits_per_sample;
+
+        ESP_LOGI(TAG, "WAV stream: %lu Hz, %u channels", sample_rate, channels);
+    }
+
+    void start_data()
+    {
+        if (info_.sample_rate == 0)
+        {
+            ESP_LOGE(TAG, "Data chunk before format chunk");
+            state_ = State::DISCARD;
+
+            return;
+        }
+
+        // Live encoders don't know the size in advance and write 0 or the maximum value
+        if (chunk_remaining_ == 0 || chunk_remaining_ == UINT32_MAX)
+        {
+            chunk_remaining_ = SIZE_MAX;
+        }
+
+        state_ = State::DATA;
+    }
+
+    void copy(
+            RingBuffer& input,
+            RingBuffer& output)
+    {
+        while (chunk_remaining_ > 0)
+        {
+            auto read_slot = input.max_read_slot();
+            auto write_slot = output.max_write_slot();
+
+            // The output only receives whole stereo samples, the sink consumes 4 bytes at a time
+            size_t size = std::min({read_slot.size(), write_slot.size(), chunk_remaining_}) & ~size_t(3);
+
+            if (size > 0)
+            {
+                memcpy(write_slot.data(), read_slot.data(), size);
+                input.commit_read(size);
+                output.commit_write(size);
+            }
+            else if (input.used_space() >= 4 && output.free_space() >= 4 && chunk_remaining_ >= 4)
+            {
+                // A sample split by the end of either buffer
+                uint8_t sample[4];
+                input.read(sample);
+                output.write(sample);
+                size = sizeof(sample);
+            }
+            else
+            {
+                return;
+            }
+
+            if (chunk_remaining_ != SIZE_MAX)
+            {
+                chunk_remaining_ -= size;
+            }
+        }
+
+        // Trailing chunks after the audio are ignored
+        state_ = State::DISCARD;
+    }
+
+    State state_ = State::RIFF_HEADER;
+    uint8_t header_[FMT_SIZE] = {};
+    size_t filled_ = 0;
+    size_t chunk_remaining_ = 0;
+
+    esp_audio_simple_dec_info_t info_ = {};
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <Metrics.hpp>
+
+/**
+ * @brief Raises the priority of a pipeline task while the buffer it fills runs low
+ *
+ * The task gets BOOST_PRIORITY when the fill drops below the low watermark and its base priority back once
+ * the fill is above the high watermark, the gap avoids switching at every frame. BOOST_PRIORITY stays below
+ * the lwIP and Wi-Fi tasks so the network keeps running while the buffer refills.
+ *
+ * The affinity of the task is kept: the ESP-IDF FreeRTOS kernel can't move a task to another core once created.
+ */
+class PriorityBoost
+{
+    static constexpr const char* TAG = "PriorityBoost";
+
+    static constexpr UBaseType_t BOOST_PRIORITY = 12;
+
+public:
+
+    /**
+     * @param base_priority Priority the task was created with
+     * @param low_watermark Fill below which the task is boosted
+     * @param high_watermark Fill above which the task gets its base priority back
+     */
+    PriorityBoost(
+            UBaseType_t base_priority,
+            size_t low_watermark,
+            size_t high_watermark)
+        : base_priority_(base_priority)
+        , low_watermark_(low_watermark)
+        , high_watermark_(high_watermark)
+        , boosts_metric_(Metrics::get_instance().counter("cactus_decoder_boosts_total",
+                "Times the decoder priority was raised because the audio buffer ran low"))
+        , boosted_metric_(Metrics::get_instance().gauge("cactus_decoder_boosted",
+                "Whether the decoder runs at the boosted priority"))
+    {
+    }
+
+    /**
+     * @brief Updates the priority of the calling task, shall be called from the task itself
+     *
+     * @param fill Bytes in the buffer the task fills
+     * @param can_refill Whether running more would refill the buffer, e.g. input is available
+     */
+    void update(
+            size_t fill,
+            bool can_refill)
+    {
+#if CONFIG_CACTUS_DECODER_BOOST
+        if (!boosted_ && fill < low_watermark_ && can_refill)
+        {
+            vTaskPrioritySet(NULL, BOOST_PRIORITY);
+            boosted_ = true;
+            boost_start_ = esp_timer_get_time();
+            boosts_++;
+            boosts_metric_.add();
+            boosted_metric_.set(1);
+
+            ESP_LOGI(TAG, "Boosted to priority %u, %zu bytes buffered", BOOST_PRIORITY, fill);
+        }
+        else if (boosted_ && (fill >= high_watermark_ || !can_refill))
+        {
+            restore();
+            ESP_LOGI(TAG, "Back to priority %u after %lld ms, %zu bytes buffered", base_priority_,
+                    (esp_timer_get_time() - boost_start_) / 1000, fill);
+        }
+#endif // CONFIG_CACTUS_DECODER_BOOST
+    }
+
+    /**
+     * @brief Gets the base priority back, shall be called from the task itself
+     */
+    void restore()
+    {
+        if (!boosted_)
+        {
+            return;
+        }
+
+        vTaskPrioritySet(NULL, base_priority_);
+        boosted_ = false;
+        boosted_us_ += esp_timer_get_time() - boost_start_;
+        boosted_metric_.set(0);
+    }
+
+    uint32_t boosts() const
+    {
+        return boosts_;
+    }
+
+    int64_t boosted_ms() const
+    {
+        return boosted_us_ / 1000;
+    }
+
+private:
+
+    UBaseType_t base_priority_;
+    size_t low_watermark_;
+    size_t high_watermark_;
+
+    bool boosted_ = false;
+    int64_t boost_start_ = 0;
+    uint32_t boosts_ = 0;
+    int64_t boosted_us_ = 0;
+
+    Metric& boosts_metric_;
+    Metric& boosted_metric_;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+/**
+ * @brief Q15 gain applied in place to the 32 bits samples of the MixBus
+ *
+ * The volume scaling of the player is scalar: PIE only multiplies 8 and 16 bits lanes, and a MixBus sample needs
+ * the full 32 bits by 16 bits product. The loop costs two multiplies and a shift per sample, around 6 cycles, i.e.
+ * about 0.25% of a core at 48 kHz stereo. The 16 bits PIE kernel it replaced is kept in DSPBenchmark for
+ * comparison.
+ */
+class Q15Gain
+{
+public:
+
+    // Gain of 1.0, can't be represented in Q15: the samples are left as they are
+    static constexpr uint32_t UNITY = 32768;
+
+    /**
+     * @brief Scalar only, the gain Mixer applies to the MixBus once the volume ramp settled
+     *
+     * @param samples Samples to scale
+     * @param gain Gain in Q15, UNITY or above leaves the samples untouched
+     */
+    static void apply(
+            std::span<int32_t> samples,
+            uint32_t gain)
+    {
+        if (gain >= UNITY)
+        {
+            return;
+        }
+
+        int32_t scale = gain;
+
+        for (int32_t& sample : samples)
+        {
+            sample = (static_cast<int64_t>(sample) * scale) >> 15;
+        }
+    }
+};
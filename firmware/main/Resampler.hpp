@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <span>
+
+#include <sdkconfig.h>
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <MixBus.hpp>
+
+/**
+ * @brief Streaming polyphase resampler from any PCM format to the 48 kHz stereo output
+ *
+ * The ratio is reduced to PHASES / STEP: each output frame is the dot product of TAPS input frames with one of
+ * PHASES rows of Q15 coefficients, cut from a Kaiser windowed sinc. The rows are normalized to a gain of exactly 1
+ * so silence and DC stay exact. Input is deinterleaved into planar history buffers, mono is upmixed by
+ * duplicating the filtered left channel. The output is written to the MixBus, keeping the fraction of the dot
+ * products and the overshoots of the filter.
+ *
+ * On the ESP32-S3 the dot products use the PIE vector MACs, 8 taps per instruction, other targets use the scalar
+ * loop. Both sum in 32 bits and round the same way, so they give the same output.
+ */
+class Resampler
+{
+    static constexpr const char* TAG = "Resampler";
+
+    // The ratios of the usual rates (8 kHz to 192 kHz) reduce to at most 640 phases (11025 Hz)
+    static constexpr uint32_t MAX_PHASES = 640;
+
+    // Input frames appended to the history at a time
+    static constexpr size_t BLOCK_FRAMES = 256;
+
+    // The vector loads read up to 16 bytes past the last tap
+    static constexpr size_t PADDING = 8;
+
+    // -6 dB point of the filter relative to the lower of the input and output rates, and its Kaiser window
+    static constexpr float CUTOFF = 0.45f;
+    static constexpr float BETA = 7.0f;
+
+public:
+
+    static constexpr uint32_t OUTPUT_RATE = 48000;
+    static constexpr uint8_t OUTPUT_CHANNELS = 2;
+
+    // Input frames each output frame is filtered from, a multiple of 8 for the vector MACs
+    static constexpr size_t TAPS = 32;
+
+    Resampler()
+    {
+        // Off the stack of the owner, both channels in one block of internal RAM
+        left_ = static_cast<int16_t*>(heap_caps_aligned_alloc(16, HISTORY_SIZE * 2 * sizeof(int16_t),
+                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        if (left_ == nullptr)
+        {
+            // Every format is then unsupported and its input dropped
+            ESP_LOGE(TAG, "Failed to allocate %zu bytes of history", HISTORY_SIZE * 2 * sizeof(int16_t));
+            channels_ = 0;
+        }
+        else
+        {
+            right_ = left_ + HISTORY_SIZE;
+        }
+
+        reset();
+    }
+
+    ~Resampler()
+    {
+        heap_caps_free(table_);
+        heap_caps_free(left_);
+    }
+
+    Resampler(const Resampler&) = delete;
+    Resampler& operator=(const Resampler&) = delete;
+
+    /**
+     * @brief Sets the format of the input, the filter is only rebuilt when the ratio changes
+     *
+     * Rates whose ratio to the output doesn't reduce to MAX_PHASES phases are approximated, the pitch error is
+     * below 0.1%.
+     *
+     * @return false if the format isn't supported, the input is then dropped
+     */
+    bool configure(
+            uint32_t sample_rate,
+            uint8_t channels)
+    {
+        if (left_ == nullptr)
+        {
+            return false;
+        }
+
+        if (sample_rate == 0 || channels == 0)
+        {
+            ESP_LOGE(TAG, "Invalid format: %lu Hz, %u channels", sample_rate, channels);
+            channels_ = 0;
+
+            return false;
+        }
+
+        uint32_t divisor = std::gcd(sample_rate, OUTPUT_RATE);
+        uint32_t phases = OUTPUT_RATE / divisor;
+        uint32_t step = sample_rate / divisor;
+
+        if (phases > MAX_PHASES)
+        {
+            phases = MAX_PHASES;
+            step = (static_cast<uint64_t>(sample_rate) * MAX_PHASES + OUTPUT_RATE / 2) / OUTPUT_RATE;
+
+            ESP_LOGW(TAG, "Approximating %lu Hz with %lu Hz", sample_rate,
+                    static_cast<uint32_t>(static_cast<uint64_t>(step) * OUTPUT_RATE / MAX_PHASES));
+        }
+
+        channels_ = channels;
+
+        if (phases != phases_ || step != step_)
+        {
+            phases_ = phases;
+            step_ = step;
+            step_whole_ = step / phases;
+            step_fraction_ = step % phases;
+
+            if (!build_table())
+            {
+                channels_ = 0;
+
+                return false;
+            }
+        }
+
+        ESP_LOGI(TAG, "Converting %lu Hz %u channels to %lu Hz stereo, %lu phases, step %lu", sample_rate,
+                channels, OUTPUT_RATE, phases_, step_);
+
+        reset();
+
+        return true;
+    }
+
+    /**
+     * @brief Clears the history, e.g. at a discontinuity of the input
+     */
+    void reset()
+    {
+        if (left_ != nullptr)
+        {
+            memset(left_, 0, HISTORY_SIZE * 2 * sizeof(int16_t));
+        }
+
+        // The first window ends on the first input frame
+        filled_ = TAPS - 1;
+        index_ = 0;
+        phase_ = 0;
+    }
+
+    uint8_t channels() const
+    {
+        return channels_;
+    }
+
+    /**
+     * @param input Interleaved samples of the configured format, in whole frames
+     * @param output Receives interleaved stereo MixBus samples at OUTPUT_RATE
+     * @param consumed Receives the number of input samples used, the rest shall be given again
+     * @return Number of output frames written
+     */
+    size_t process(
+            std::span<const int16_t> input,
+            std::span<int32_t> output,
+            size_t& consumed)
+    {
+        return process_with<false>(input, output, consumed);
+    }
+
+    size_t process_scalar(
+            std::span<const int16_t> input,
+            std::span<int32_t> output,
+            size_t& consumed)
+    {
+        return process_with<true>(input, output, consumed);
+    }
+
+private:
+
+    template<bool Scalar>
+    size_t process_with(
+            std::span<const int16_t> input,
+            std::span<int32_t> output,
+            size_t& consumed)
+    {
+        size_t capacity = output.size() / OUTPUT_CHANNELS;
+        size_t available = channels_ > 0 ? input.size() / channels_ : 0;
+        size_t used = 0;
+        size_t produced = 0;
+
+        if (channels_ == 0)
+        {
+            // Unsupported format, dropped
+            consumed = input.size();
+
+            return 0;
+        }
+
+        if (phases_ == step_)
+        {
+            // Same rate, only the layout is converted
+            produced = std::min(capacity, available);
+            convert(input.data(), output.data(), produced);
+            consumed = produced * channels_;
+
+            return produced;
+        }
+
+        while (true)
+        {
+            // Every output frame whose window is buffered
+            while (produced < capacity && index_ + TAPS <= filled_)
+            {
+                const int16_t* coefficients = table_ + phase_ * TAPS;
+                int32_t left = filter<Scalar>(left_ + index_, coefficients);
+
+                output[produced * 2] = left;
+                output[produced * 2 + 1] = channels_ == 1 ? left : filter<Scalar>(right_ + index_, coefficients);
+                produced++;
+
+                phase_ += step_fraction_;
+                index_ += step_whole_;
+
+                if (phase_ >= phases_)
+                {
+                    phase_ -= phases_;
+                    index_++;
+                }
+            }
+
+            if (produced == capacity || !refill(input.data(), available, used))
+            {
+                break;
+            }
+        }
+
+        consumed = used * channels_;
+
+        return produced;
+    }
+
+    /**
+     * @brief Keeps the history the next windows need and appends the input after it
+     *
+     * @return false if no input was left
+     */
+    bool refill(
+            const int16_t* input,
+            size_t available,
+            size_t& used)
+    {
+        size_t start = std::min(index_, filled_);
+        size_t kept = filled_ - start;
+
+        memmove(left_, left_ + start, kept * sizeof(int16_t));
+        memmove(right_, right_ + start, kept * sizeof(int16_t));
+        filled_ = kept;
+        index_ -= start;
+
+        // When decimating the next window may start after the history, the frames in between are skipped
+        size_t skipped = std::min(index_, available - used);
+        used += skipped;
+        index_ -= skipped;
+
+        size_t count = std::min(TAPS + BLOCK_FRAMES - filled_, available - used);
+        const int16_t* frame = input + used * channels_;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            left_[filled_ + i] = frame[0];
+            right_[filled_ + i] = frame[channels_ == 1 ? 0 : 1];
+            frame += channels_;
+        }
+
+        filled_ += count;
+        used += count;
+
+        return skipped > 0 || count > 0;
+    }
+
+    void convert(
+            const int16_t* input,
+            int32_t* output,
+            size_t frames)
+    {
+        if (channels_ == 2)
+        {
+            for (size_t i = 0; i < frames * 2; i++)
+            {
+                output[i] = MixBus::widen(input[i]);
+            }
+
+            return;
+        }
+
+        for (size_t i = 0; i < frames; i++)
+        {
+            output[i * 2] = MixBus::widen(input[i * channels_]);
+            output[i * 2 + 1] = MixBus::widen(input[i * channels_ + (channels_ == 1 ? 0 : 1)]);
+        }
+    }
+
+    template<bool Scalar>
+    static int32_t filter(
+            const int16_t* samples,
+            const int16_t* coefficients)
+    {
+        int32_t sum;
+
+#if CONFIG_IDF_TARGET_ESP32S3
+        if (!Scalar)
+        {
+            sum = dot_pie(samples, coefficients);
+        }
+        else
+#endif // CONFIG_IDF_TARGET_ESP32S3
+        {
+            sum = dot_scalar(samples, coefficients);
+        }
+
+        // Q15 products, rounded to the MixBus
+        return (sum + (1 << (14 - MixBus::EXTRA_BITS))) >> (15 - MixBus::EXTRA_BITS);
+    }
+
+    static int32_t dot_scalar(
+            const int16_t* samples,
+            const int16_t* coefficients)
+    {
+        int32_t sum = 0;
+
+        for (size_t k = 0; k < TAPS; k++)
+        {
+            sum += samples[k] * coefficients[k];
+        }
+
+        return sum;
+    }
+
+#if CONFIG_IDF_TARGET_ESP32S3
+    /**
+     * @brief Sums the 32 products with EE.VMULAS.S16.ACCX
+     *
+     * The samples may be at any 2 bytes boundary: the aligned blocks around them are loaded with EE.LD.128.USAR.IP,
+     * which keeps the misalignment in SAR_BYTE, and EE.SRC.Q shifts each pair of blocks into place.
+     *
+     * @param samples Followed by PADDING readable samples
+     * @param coefficients 16 bytes aligned
+     */
+    static int32_t dot_pie(
+            const int16_t* samples,
+            const int16_t* coefficients)
+    {
+        static_assert(TAPS == 32, "The vector loop is unrolled for 32 taps");
+
+        int32_t sum;
+
+        // q0-q7, ACCX and SAR_BYTE aren't declared: GCC doesn't allocate them, so they can't be named as clobbers
+        // and no compiled code keeps a value in them across the statement. The PIE context is saved per task by
+        // the RTOS on the first use, a preemption doesn't corrupt them either.
+        asm volatile (
+            "ee.zero.accx\n"
+            "ee.vld.128.ip q4, %[coefficients], 16\n"
+            "ee.vld.128.ip q5, %[coefficients], 16\n"
+            "ee.vld.128.ip q6, %[coefficients], 16\n"
+            "ee.vld.128.ip q7, %[coefficients], 0\n"
+            "ee.ld.128.usar.ip q0, %[samples], 16\n"
+            "ee.ld.128.usar.ip q1, %[samples], 16\n"
+            "ee.src.q q0, q0, q1\n"
+            "ee.vmulas.s16.accx q0, q4\n"
+            "ee.ld.128.usar.ip q2, %[samples], 16\n"
+            "ee.src.q q1, q1, q2\n"
+            "ee.vmulas.s16.accx q1, q5\n"
+            "ee.ld.128.usar.ip q0, %[samples], 16\n"
+            "ee.src.q q2, q2, q0\n"
+            "ee.vmulas.s16.accx q2, q6\n"
+            "ee.ld.128.usar.ip q1, %[samples], 0\n"
+            "ee.src.q q0, q0, q1\n"
+            "ee.vmulas.s16.accx q0, q7\n"
+            "rur.accx_0 %[sum]\n"
+            : [samples] "+r" (samples), [coefficients] "+r" (coefficients), [sum] "=r" (sum)
+            :
+            : "memory");
+
+        return sum;
+    }
+#endif // CONFIG_IDF_TARGET_ESP32S3
+
+    bool build_table()
+    {
+        heap_caps_free(table_);
+
+        // Internal RAM for speed, only the largest tables may not fit
+        size_t size = phases_ * TAPS * sizeof(int16_t);
+        table_ = static_cast<int16_t*>(heap_caps_aligned_alloc(16, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        if (table_ == nullptr)
+        {
+            table_ = static_cast<int16_t*>(heap_caps_aligned_alloc(16, size, MALLOC_CAP_SPIRAM));
+        }
+
+        if (table_ == nullptr)
+        {
+            ESP_LOGE(TAG, "Failed to allocate %zu bytes of coefficients", size);
+            phases_ = 0;
+            step_ = 0;
+
+            return false;
+        }
+
+        // Prototype filter at the upsampled rate, cycles per sample
+        float cutoff = CUTOFF / std::max(phases_, step_);
+        float center = (phases_ * TAPS - 1) / 2.0f;
+        float half_length = phases_ * TAPS / 2.0f;
+        float window_scale = 1.0f / bessel_i0(BETA);
+
+        for (uint32_t phase = 0; phase < phases_; phase++)
+        {
+            float row[TAPS];
+            float sum = 0;
+
+            // The last tap multiplies the newest sample
+            for (size_t k = 0; k < TAPS; k++)
+            {
+                float t = phase + (TAPS - 1 - k) * phases_ - center;
+                float x = t / half_length;
+                float window = bessel_i0(BETA * std::sqrt(std::max(0.0f, 1.0f - x * x))) * window_scale;
+                float sinc = std::sin(2 * static_cast<float>(M_PI) * cutoff * t) / (static_cast<float>(M_PI) * t);
+
+                row[k] = sinc * window;
+                sum += row[k];
+            }
+
+            // Rounded to Q15, the rounding error goes to the largest tap so the row sums to exactly 1
+            int16_t* coefficients = table_ + phase * TAPS;
+            int32_t total = 0;
+            size_t largest = 0;
+
+            for (size_t k = 0; k < TAPS; k++)
+            {
+                coefficients[k] = std::clamp<int32_t>(std::lround(row[k] / sum * 32768), INT16_MIN, INT16_MAX);
+                total += coefficients[k];
+
+                if (std::abs(row[k]) > std::abs(row[largest]))
+                {
+                    largest = k;
+                }
+            }
+
+            coefficients[largest] = std::clamp<int32_t>(coefficients[largest] + 32768 - total, INT16_MIN, INT16_MAX);
+        }
+
+        return true;
+    }
+
+    static float bessel_i0(
+            float x)
+    {
+        float term = 1;
+        float sum = 1;
+
+        for (int k = 1; k < 20; k++)
+        {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            sum += term;
+        }
+
+        return sum;
+    }
+
+    int16_t* table_ = nullptr;
+    uint32_t phases_ = 1;
+    uint32_t step_ = 1;
+    uint32_t step_whole_ = 1;
+    uint32_t step_fraction_ = 0;
+    uint8_t channels_ = 2;
+
+    static constexpr size_t HISTORY_SIZE = TAPS + BLOCK_FRAMES + PADDING;
+
+    // Planar history, frames [index_, filled_) are still needed
+    int16_t* left_ = nullptr;
+    int16_t* right_ = nullptr;
+    size_t filled_;
+    size_t index_;
+    uint32_t phase_;
+};
@@ -1,30 +1,48 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <span>
 #include <esp_log.h>
+#include <esp_heap_caps.h>
 #include <algorithm>
 #include <cstring>
 
+/**
+ * @brief Byte ring buffer, safe without locking for one producer task and one consumer task
+ *
+ * The producer only moves the write position and the consumer only moves the read position, both are published
+ * with release semantics after the data is copied.
+ */
 class RingBuffer
 {
 public:
 
+    /**
+     * @param size Buffer size in bytes
+     * @param name Name used in logs
+     * @param caps Heap capabilities, e.g. MALLOC_CAP_SPIRAM for large buffers
+     */
     RingBuffer(
             size_t size,
-            std::string name = "")
-        : buffer_(new uint8_t[size])
+            std::string name = "",
+            uint32_t caps = MALLOC_CAP_DEFAULT)
+        : buffer_(static_cast<uint8_t*>(heap_caps_malloc(size, caps)))
         , size_(size)
         , read_pos_(0)
         , write_pos_(0)
-        , available_(0)
         , name_("RingBuffer " + name)
     {
+        if (buffer_ == nullptr)
+        {
+            ESP_LOGE(name_.c_str(), "Failed to allocate %zu bytes", size);
+            size_ = 1;
+        }
     }
 
     ~RingBuffer()
     {
-        delete[] buffer_;
+        heap_caps_free(buffer_);
     }
 
     std::span<uint8_t> max_write_slot()
@@ -54,9 +72,32 @@ public:
             return;
         }
 
-        // Update the write pointer and available data count.
-        write_pos_ = (write_pos_ + size) % size_;
-        available_ += size;
+        // Publish the data to the consumer
+        write_pos_.store((write_pos_.load(std::memory_order_relaxed) + size) % size_, std::memory_order_release);
+    }
+
+    // Copy data into the buffer, wrapping if needed. Returns the number of bytes written.
+    size_t write(
+            std::span<const uint8_t> data)
+    {
+        size_t written = 0;
+
+        while (written < data.size())
+        {
+            auto write_slot = max_write_slot();
+            size_t chunk = std::min(write_slot.size(), data.size() - written);
+
+            if (chunk == 0)
+            {
+                break;
+            }
+
+            std::memcpy(write_slot.data(), data.data() + written, chunk);
+            commit_write(chunk);
+            written += chunk;
+        }
+
+        return written;
     }
 
     std::span<uint8_t> max_read_slot()
@@ -66,10 +107,79 @@ public:
         return std::span<uint8_t>(read_position(), size);
     }
 
+    // Copy data out of the buffer, wrapping if needed. Returns the number of bytes read.
+    size_t read(
+            std::span<uint8_t> data)
+    {
+        size_t read = 0;
+
+        while (read < data.size())
+        {
+            auto read_slot = max_read_slot();
+            size_t chunk = std::min(read_slot.size(), data.size() - read);
+
+            if (chunk == 0)
+            {
+                break;
+            }
+
+            std::memcpy(data.data() + read, read_slot.data(), chunk);
+            commit_read(chunk);
+            read += chunk;
+        }
+
+        return read;
+    }
+
+    // Copy data without consuming it, starting offset bytes after the read position. Returns the number of bytes
+    // copied.
+    size_t peek(
+            std::span<uint8_t> data,
+            size_t offset = 0) const
+    {
+        size_t available = used_space();
+
+        if (offset >= available)
+        {
+            return 0;
+        }
+
+        size_t size = std::min(data.size(), available - offset);
+        size_t start = (read_pos_.load(std::memory_order_relaxed) + offset) % size_;
+        size_t first = std::min(size, size_ - start);
+
+        std::memcpy(data.data(), buffer_ + start, first);
+        std::memcpy(data.data() + first, buffer_, size - first);
+
+        return size;
+    }
+
+    // Drop data, wrapping if needed. Returns the number of bytes dropped.
+    size_t discard(
+            size_t size)
+    {
+        size_t discarded = 0;
+
+        while (discarded < size)
+        {
+            size_t chunk = std::min(max_contiguous_size_to_read(), size - discarded);
+
+            if (chunk == 0)
+            {
+                break;
+            }
+
+            commit_read(chunk);
+            discarded += chunk;
+        }
+
+        return discarded;
+    }
+
     void commit_read(
             size_t size)
     {
-        if (size > available_)
+        if (size > used_space())
         {
             ESP_LOGE(name_.c_str(), "Trying to commit more data than available");
 
@@ -83,14 +193,8 @@ public:
             return;
         }
 
-        read_pos_ = (read_pos_ + size) % size_;
-        available_ -= size;
-
-        // If we have read all data, reset pointers
-        if (available_ == 0)
-        {
-            read_pos_ = write_pos_ = 0;
-        }
+        // Hand the space back to the producer
+        read_pos_.store((read_pos_.load(std::memory_order_relaxed) + size) % size_, std::memory_order_release);
     }
 
     size_t size() const
@@ -100,12 +204,15 @@ public:
 
     size_t free_space() const
     {
-        return (size_ - 1) - available_;
+        return (size_ - 1) - used_space();
     }
 
     size_t used_space() const
     {
-        return available_;
+        size_t write_pos = write_pos_.load(std::memory_order_acquire);
+        size_t read_pos = read_pos_.load(std::memory_order_acquire);
+
+        return (write_pos + size_ - read_pos) % size_;
     }
 
 private:
@@ -113,68 +220,56 @@ private:
     // Return the maximum contiguous space available to write.
     size_t max_contiguous_size_to_write() const
     {
-        if (available_ >= size_ - 1)
-        {
-            return 0;
-        }
+        size_t write_pos = write_pos_.load(std::memory_order_relaxed);
+        size_t read_pos = read_pos_.load(std::memory_order_acquire);
 
-        if (write_pos_ >= read_pos_)
+        if (write_pos >= read_pos)
         {
-            // The free space from write_pos_ to the end of the buffer.
-            // If we reach the end, consider the beginning of the buffer.
-            if (write_pos_ == size_ - 1)
-            {
-                return (read_pos_ == 0) ? 0 : read_pos_ - 1;
-            }
-            else
-            {
-                return std::min(size_ - write_pos_ - 1, (size_ - 1) - available_);
-            }
+            // The free space from write_pos to the end of the buffer, one byte always stays free so a full
+            // buffer can be told from an empty one.
+            return std::min(size_ - write_pos, (size_ - 1) - (write_pos - read_pos));
         }
         else
         {
             // When write pointer is behind read pointer,
             // the free space is the gap between them.
-            return read_pos_ - write_pos_ - 1;
+            return read_pos - write_pos - 1;
         }
     }
 
     uint8_t* write_position() const
     {
-        return buffer_ + write_pos_;
+        return buffer_ + write_pos_.load(std::memory_order_relaxed);
     }
 
     // Return the maximum contiguous data available to read.
     size_t max_contiguous_size_to_read() const
     {
-        if (available_ == 0)
-        {
-            return 0;
-        }
+        size_t write_pos = write_pos_.load(std::memory_order_acquire);
+        size_t read_pos = read_pos_.load(std::memory_order_relaxed);
 
-        if (write_pos_ >= read_pos_)
+        if (write_pos >= read_pos)
         {
-            return write_pos_ - read_pos_;
+            return write_pos - read_pos;
         }
         else
         {
             // Data is split at the end of the buffer.
-            return size_ - read_pos_;
+            return size_ - read_pos;
         }
     }
 
     uint8_t* read_position() const
     {
-        return buffer_ + read_pos_;
+        return buffer_ + read_pos_.load(std::memory_order_relaxed);
     }
 
 private:
 
     uint8_t* buffer_;           // The actual buffer
     size_t size_;               // Total size of the buffer
-    size_t read_pos_;           // Position where to read next
-    size_t write_pos_;          // Position where to write next
-    size_t available_;          // Number of bytes available to read
+    std::atomic<size_t> read_pos_;  // Position where to read next, only moved by the consumer
+    std::atomic<size_t> write_pos_; // Position where to write next, only moved by the producer
 
     std::string name_;
 };
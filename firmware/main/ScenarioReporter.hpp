@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <sdkconfig.h>
+
+#include <esp_log.h>
+#include <esp_http_client.h>
+
+#include <SongPlayer.hpp>
+
+/**
+ * @brief Posts the playback report of each scenario to the local test server (tools/stream_server.py)
+ */
+class ScenarioReporter
+{
+    static constexpr const char* TAG = "ScenarioReporter";
+
+public:
+
+    static void post(
+            const SongPlayer::PlaybackReport& report)
+    {
+        char body[640];
+
+        snprintf(body, sizeof(body),
+                "{\"url\":\"%s\",\"codec\":\"%s\",\"underruns\":%lu,\"ttfa_ms\":%lld,\"decoder_setup_us\":%lld,"
+                "\"decoder_boosts\":%lu,\"decoder_boosted_ms\":%lld,\"cpu_stress_pct\":%d,"
+                "\"stream_cpu_pct\":%.2f,\"decoder_cpu_pct\":%.2f,\"output_cpu_pct\":%.2f,\"duration_ms\":%lld,"
+                "\"compressed_kb\":%d,\"pcm_kb\":%d}",
+                report.url.c_str(), report.codec, report.underruns, report.ttfa_ms, report.decoder_setup_us,
+                report.decoder_boosts, report.decoder_boosted_ms, CONFIG_CACTUS_CPU_STRESS_PCT,
+                report.stream_cpu_pct, report.decoder_cpu_pct, report.output_cpu_pct, report.duration_ms,
+                CONFIG_CACTUS_COMPRESSED_BUFFER_KB, CONFIG_CACTUS_PCM_BUFFER_KB);
+
+        ESP_LOGI(TAG, "Scenario report: %s", body);
+
+        esp_http_client_config_t config = {};
+        config.url = CONFIG_CACTUS_TEST_SERVER_URL "/report";
+        config.method = HTTP_METHOD_POST;
+
+        esp_http_client_handle_t handle = esp_http_client_init(&config);
+
+        if (handle == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to initialize HTTP client");
+
+            return;
+        }
+
+        esp_http_client_set_header(handle, "Content-Type", "application/json");
+        esp_http_client_set_post_field(handle, body, strlen(body));
+
+        esp_err_t err = esp_http_client_perform(handle);
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to post report: %s", esp_err_to_name(err));
+        }
+
+        esp_http_client_cleanup(handle);
+    }
+};
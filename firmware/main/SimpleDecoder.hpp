@@ -0,0 +1,195 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include <esp_log.h>
+
+#include <simple_dec/esp_audio_simple_dec.h>
+
+#include <AudioDecoder.hpp>
+#include <DecodeStats.hpp>
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Decoder for the formats handled by the esp_audio_codec simple decoder (AAC, M4A, FLAC)
+ *
+ * The simple decoder parses the container and finds the frames itself, any amount of input can be processed.
+ * Frames are decoded into a scratch buffer and then copied to the output, a frame doesn't fit in the contiguous
+ * space left before the end of the ring.
+ */
+class SimpleDecoder : public AudioDecoder
+{
+    static constexpr const char* TAG = "SimpleDecoder";
+
+    // A stereo FLAC block of 4608 samples, grown when a frame needs more
+    static constexpr size_t INITIAL_PCM_SIZE = 4608 * 2 * sizeof(int16_t);
+
+public:
+
+    SimpleDecoder(
+            esp_audio_simple_dec_type_t type,
+            AudioCodec codec,
+            const char* name)
+        : type_(type)
+        , codec_(codec)
+        , name_(name)
+        , pcm_(INITIAL_PCM_SIZE)
+    {
+        open();
+    }
+
+    ~SimpleDecoder() override
+    {
+        ESP_LOGI(TAG, "Closing %s decoder", name_);
+        esp_audio_simple_dec_close(handle_);
+        ESP_LOGI(TAG, "%s decoder closed", name_);
+    }
+
+    AudioCodec codec() const override
+    {
+        return codec_;
+    }
+
+    void reset() override
+    {
+        // The simple decoder has no reset, its container parser can only start over from a new instance
+        esp_audio_simple_dec_close(handle_);
+        handle_ = {};
+        info_ = {};
+        open();
+    }
+
+    const char* name() const override
+    {
+        return name_;
+    }
+
+    void process(
+            RingBuffer& input,
+            RingBuffer& output) override
+    {
+        ESP_LOGD(TAG, "Starting process with input: %zu bytes, output space: %zu bytes",
+                input.used_space(), output.free_space());
+
+        esp_audio_simple_dec_raw_t input_frame = {};
+        esp_audio_simple_dec_out_t output_frame = {};
+
+        auto read_slot = input.max_read_slot();
+
+        if (read_slot.size() == 0)
+        {
+            ESP_LOGW(TAG, "No data available to decode");
+
+            return;
+        }
+
+        // Process until no more input data or room for a frame
+        while (read_slot.size() > 0 && output.free_space() >= pcm_.size())
+        {
+            input_frame.buffer = read_slot.data();
+            input_frame.len = read_slot.size();
+            input_frame.eos = false;
+            input_frame.consumed = 0;
+
+            output_frame.buffer = pcm_.data();
+            output_frame.len = pcm_.size();
+            output_frame.needed_size = 0;
+            output_frame.decoded_size = 0;
+
+            uint32_t start = DecodeStats::start();
+            esp_audio_err_t ret = esp_audio_simple_dec_process(handle_, &input_frame, &output_frame);
+
+            input.commit_read(input_frame.consumed);
+            output.write(std::span<const uint8_t>(pcm_.data(), output_frame.decoded_size));
+
+            if (ret == ESP_AUDIO_ERR_BUFF_NOT_ENOUGH)
+            {
+                if (output_frame.needed_size <= pcm_.size())
+                {
+                    break;
+                }
+
+                if (output_frame.needed_size > output.size())
+                {
+                    ESP_LOGE(TAG, "A %s frame of %lu bytes doesn't fit in the output", name_, output_frame.needed_size);
+                    DecodeStats::get_instance().decode_error();
+                    break;
+                }
+
+                // Decoded again once the output has room for the larger frame
+                ESP_LOGI(TAG, "Growing the %s frame buffer from %zu to %lu bytes", name_, pcm_.size(),
+                        output_frame.needed_size);
+                pcm_.resize(output_frame.needed_size);
+
+                continue;
+            }
+
+            if (ret == ESP_AUDIO_ERR_DATA_LACK)
+            {
+                // Not an error, the frame is decoded once there is more input
+                break;
+            }
+
+            if (ret != ESP_AUDIO_ERR_OK)
+            {
+                ESP_LOGW(TAG, "Failed to decode %s frame with error %d", name_, ret);
+                DecodeStats::get_instance().decode_error();
+
+                // The decoder skips the bad frame if it consumed it, otherwise wait for more input
+                if (input_frame.consumed == 0)
+                {
+                    break;
+                }
+            }
+            else if (output_frame.decoded_size > 0)
+            {
+                if (info_.sample_rate == 0)
+                {
+                    esp_audio_simple_dec_get_info(handle_, &info_);
+                }
+
+                uint32_t frame_size = info_.channel * info_.bits_per_sample / 8;
+
+                DecodeStats::get_instance().frame_decoded(start,
+                        frame_size > 0 ? output_frame.decoded_size / frame_size : 0, info_.sample_rate);
+            }
+
+            read_slot = input.max_read_slot();
+        }
+    }
+
+    esp_audio_simple_dec_info_t get_info() override
+    {
+        esp_audio_simple_dec_info_t info = {};
+        esp_audio_simple_dec_get_info(handle_, &info);
+
+        return info;
+    }
+
+private:
+
+    void open()
+    {
+        esp_audio_simple_dec_cfg_t config_ = {};
+        config_.dec_type = type_;
+
+        esp_audio_err_t ret = esp_audio_simple_dec_open(&config_, &handle_);
+
+        if (ret != ESP_AUDIO_ERR_OK)
+        {
+            ESP_LOGE(TAG, "Failed to open %s decoder with error %d", name_, ret);
+
+            return;
+        }
+
+        ESP_LOGI(TAG, "%s decoder initialized successfully", name_);
+    }
+
+    esp_audio_simple_dec_type_t type_;
+    AudioCodec codec_;
+    const char* name_;
+    esp_audio_simple_dec_handle_t handle_ = {};
+    esp_audio_simple_dec_info_t info_ = {};
+    std::vector<uint8_t> pcm_;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#include <MirrorSet.hpp>
+
+/**
+ * @brief Song to play, either a full URL or a path served by a set of mirrors
+ */
+struct Song
+{
+    std::string path;
+    MirrorSet* mirrors = nullptr;
+
+    /**
+     * @brief Gets the URL on the preferred mirror, for logging and reports
+     */
+    std::string url() const
+    {
+        return mirrors != nullptr ? mirrors->prefix(mirrors->ranking().front()) + path : path;
+    }
+};
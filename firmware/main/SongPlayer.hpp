@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include <freertos/FreeRTOS.h>
@@ -7,41 +8,93 @@
 #include <freertos/semphr.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 
+#include <StreamSource.hpp>
 #include <HTTPStream.hpp>
-#include <MP3Decoder.hpp>
+#include <HLSStream.hpp>
+#include <Song.hpp>
+#include <AudioDecoder.hpp>
+#include <DecoderFactory.hpp>
+#include <DecoderPool.hpp>
 #include <I2SSink.hpp>
 #include <RingBuffer.hpp>
 #include <Event.hpp>
+#include <Metrics.hpp>
+#include <BandwidthEstimator.hpp>
+#include <PriorityBoost.hpp>
 
 class SongPlayer
 {
     static constexpr const char* TAG = "SongPlayer";
 
+    static constexpr uint32_t STREAM_FULL_DELAY_MS = 100;
+    static constexpr UBaseType_t DECODER_PRIORITY = 6;
+    static constexpr int64_t FADE_OUT_TIMEOUT_US = 100 * 1000;
+
+    // Notification bits of the output task, set by the decoder
+    static constexpr uint32_t PCM_WRITTEN = 1 << 0;
+    static constexpr uint32_t DECODING_COMPLETE = 1 << 1;
+
+    // The tasks wake each other, the timeouts only bound a missed wake up. Polling each tick can't serve the 20 ms
+    // of DMA of the low latency profile, a tick is 10 ms at the default 100 Hz.
+    static constexpr uint32_t OUTPUT_WAIT_MS = 10;
+    static constexpr uint32_t DECODER_WAIT_MS = 10;
+
 public:
 
+    struct PlaybackReport
+    {
+        std::string url;
+        const char* codec;
+        uint32_t underruns;
+        int64_t ttfa_ms;
+        int64_t decoder_setup_us;
+        uint32_t decoder_boosts;
+        int64_t decoder_boosted_ms;
+        float stream_cpu_pct;
+        float decoder_cpu_pct;
+        float output_cpu_pct;
+        int64_t duration_ms;
+    };
+
     SongPlayer(
-            const std::string& url,
+            const Song& song,
             I2SSink& sink)
-        : stream(url)
+        : url_(song.url())
+        , stream(create_stream(song))
         , sink(sink)
-        , http_to_decoder_ring_(1024 * 16, "HTTP_BUFFER")
-        , decoder_to_audio_ring_(1024 * 512, "AUDIO_BUFFER")
+        , http_to_decoder_ring_(CONFIG_CACTUS_COMPRESSED_BUFFER_KB * 1024, "HTTP_BUFFER", MALLOC_CAP_SPIRAM)
+        , decoder_to_audio_ring_(CONFIG_CACTUS_PCM_BUFFER_KB * 1024, "AUDIO_BUFFER",
+                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+        , underruns_(Metrics::get_instance().counter("cactus_player_underruns_total",
+                "Times the audio buffer ran empty during playback"))
+        , time_to_first_audio_(Metrics::get_instance().gauge("cactus_player_time_to_first_audio_ms",
+                "Time from song start to the end of the prebuffering of the last song"))
+        , prebuffer_target_(Metrics::get_instance().gauge("cactus_player_prebuffer_ms",
+                "Prebuffer duration selected from the bandwidth estimation"))
+        , buffered_(Metrics::get_instance().gauge("cactus_player_buffered_ms",
+                "Audio buffered ahead of the output, compressed and decoded"))
+        , decoder_boost_(DECODER_PRIORITY, decoder_to_audio_ring_.size() / 4, decoder_to_audio_ring_.size() / 2)
     {
         mutex_ = xSemaphoreCreateMutex();
+        decoder_wake_ = xSemaphoreCreateBinary();
 
-        // Create task for HTTP decoding
+        // Only read once, the stream task may update it on reconnections
+        content_type_ = stream->content_type();
+
+        // Create task for HTTP streaming
         xTaskCreatePinnedToCore(
-            SongPlayer::http_decoder_task,
-            "HTTP_Decoder",
+            SongPlayer::http_stream_task,
+            "HTTP_Stream",
             8192,
             this,
             5,
-            &http_decoder_task_handle_,
+            &http_stream_task_handle_,
             0
             );
 
-        // Create task for audio output
+        // Create task for audio output, before the decoder which notifies it
         xTaskCreatePinnedToCore(
             SongPlayer::audio_output_task,
             "Audio_Output",
@@ -51,22 +104,53 @@ public:
             &audio_output_task_handle_,
             1
             );
+
+        // Create task for decoding, above the stream so it keeps the small PCM buffer filled just in time
+        xTaskCreatePinnedToCore(
+            SongPlayer::decoder_task,
+            "Decoder",
+            8192,
+            this,
+            DECODER_PRIORITY,
+            &decoder_task_handle_,
+            0
+            );
     }
 
     ~SongPlayer()
     {
+        // Fade out instead of cutting the song, the output task applies the ramp to its next chunk
+        if (!is_finished_)
+        {
+            xSemaphoreTake(mutex_, portMAX_DELAY);
+            sink.fade_out();
+            xSemaphoreGive(mutex_);
+
+            int64_t deadline = esp_timer_get_time() + FADE_OUT_TIMEOUT_US;
+
+            while (!sink.gain_settled() && esp_timer_get_time() < deadline)
+            {
+                vTaskDelay(1);
+            }
+        }
+
         // Stop stream
         force_stop_ = true;
 
-        vTaskResume(http_decoder_task_handle_);
+        vTaskResume(http_stream_task_handle_);
+        vTaskResume(decoder_task_handle_);
         vTaskResume(audio_output_task_handle_);
 
         // Wait while task exit
-        while (!is_finished_)
+        while (!is_finished_ || !stream_finished_)
         {
             vTaskDelay(pdMS_TO_TICKS(10));
         }
 
+        // Kept for the next track of the same codec
+        DecoderPool::get_instance().release(std::move(decoder));
+
+        vSemaphoreDelete(decoder_wake_);
         vSemaphoreDelete(mutex_);
         ESP_LOGI(TAG, "SongPlayer destroyed");
     }
@@ -76,36 +160,176 @@ public:
         return is_finished_;
     }
 
+    std::string title()
+    {
+        return stream->title();
+    }
+
+    /**
+     * @brief Gets the playback statistics, CPU usage is only available once finished
+     */
+    PlaybackReport report() const
+    {
+        PlaybackReport report = {};
+        report.url = url_;
+        report.codec = decoder ? decoder->name() : "none";
+        report.underruns = song_underruns_;
+        report.ttfa_ms = ttfa_ms_;
+        report.decoder_setup_us = decoder_setup_us_;
+        report.decoder_boosts = decoder_boost_.boosts();
+        report.decoder_boosted_ms = decoder_boost_.boosted_ms();
+        report.duration_ms = ((is_finished_ ? end_time_ : esp_timer_get_time()) - start_time_) / 1000;
+
+        // Run time counters tick in microseconds
+        if (is_finished_ && report.duration_ms > 0)
+        {
+            report.stream_cpu_pct = stream_runtime_us_ / (report.duration_ms * 10.0f);
+            report.decoder_cpu_pct = decoder_runtime_us_ / (report.duration_ms * 10.0f);
+            report.output_cpu_pct = output_runtime_us_ / (report.duration_ms * 10.0f);
+        }
+
+        return report;
+    }
+
 private:
 
-    static void http_decoder_task(
+    static std::unique_ptr<StreamSource> create_stream(
+            const Song& song)
+    {
+        if (song.mirrors != nullptr)
+        {
+            return std::make_unique<HTTPStream>(*song.mirrors, song.path);
+        }
+
+        std::string path = song.path.substr(0, song.path.find('?'));
+
+        if (path.size() >= 5 && path.compare(path.size() - 5, 5, ".m3u8") == 0)
+        {
+            return std::make_unique<HLSStream>(song.path);
+        }
+
+        return std::make_unique<HTTPStream>(song.path);
+    }
+
+    static void http_stream_task(
             void* arg)
     {
 
         SongPlayer& player = *static_cast<SongPlayer*>(arg);
 
-        ESP_LOGI(player.TAG, "HTTP Decoder Task Started on Core %d", xPortGetCoreID());
+        ESP_LOGI(player.TAG, "HTTP Stream Task Started on Core %d", xPortGetCoreID());
 
-        while ((player.stream.available_data() > 0) && (player.force_stop_ == false))
+        while ((player.stream->available_data() > 0) && (player.force_stop_ == false))
         {
+            if (player.http_to_decoder_ring_.free_space() == 0)
+            {
+                // The buffer holds tens of seconds, no need to poll often
+                vTaskDelay(pdMS_TO_TICKS(STREAM_FULL_DELAY_MS));
+                continue;
+            }
+
             // Fetch HTTP data
-            player.stream.read_http_stream(player.http_to_decoder_ring_);
+            size_t input_before = player.http_to_decoder_ring_.used_space();
+            player.stream->read_http_stream(player.http_to_decoder_ring_);
 
-            // Decode MP3 data - protect access to decoder_to_audio_ring
-            xSemaphoreTake(player.mutex_, portMAX_DELAY);
-            player.decoder.process(player.http_to_decoder_ring_, player.decoder_to_audio_ring_);
-            player.audio_format_ = player.decoder.get_info();
-            player.sink.change_sample_rate(player.audio_format_.sample_rate, player.audio_format_.channel);
-            xSemaphoreGive(player.mutex_);
+            if (player.http_to_decoder_ring_.used_space() != input_before)
+            {
+                xSemaphoreGive(player.decoder_wake_);
+            }
 
             // Give other tasks a chance to run
             taskYIELD();
         }
 
+        player.stream_runtime_us_ = ulTaskGetRunTimeCounter(NULL);
+        player.stream_finished_ = true;
+
+        ESP_LOGI(TAG, "Streaming complete");
+        vTaskDelete(NULL);
+    }
+
+    static void decoder_task(
+            void* arg)
+    {
+
+        SongPlayer& player = *static_cast<SongPlayer*>(arg);
+
+        ESP_LOGI(player.TAG, "Decoder Task Started on Core %d", xPortGetCoreID());
+
+        // Format given to the sink, the mutex is only taken when it changes since write holds it while it blocks
+        uint32_t sink_sample_rate = 0;
+        uint8_t sink_channels = 0;
+        uint32_t stream_bitrate = 0;
+
+        while (player.force_stop_ == false)
+        {
+            // Read before decoding so the data written before the end is decoded
+            bool stream_finished = player.stream_finished_;
+
+            size_t input_before = player.http_to_decoder_ring_.used_space();
+            size_t output_before = player.decoder_to_audio_ring_.used_space();
+
+            if (player.decoder || player.create_decoder(stream_finished))
+            {
+                player.decoder->process(player.http_to_decoder_ring_, player.decoder_to_audio_ring_);
+                player.audio_format_ = player.decoder->get_info();
+
+                // The format is unknown until the decoder parsed the stream header
+                if (player.audio_format_.sample_rate != 0 && (player.audio_format_.sample_rate != sink_sample_rate ||
+                        player.audio_format_.channel != sink_channels))
+                {
+                    sink_sample_rate = player.audio_format_.sample_rate;
+                    sink_channels = player.audio_format_.channel;
+
+                    xSemaphoreTake(player.mutex_, portMAX_DELAY);
+                    player.sink.change_sample_rate(sink_sample_rate, sink_channels);
+                    xSemaphoreGive(player.mutex_);
+                }
+
+                // Mirrors too slow for the actual bitrate of the song are failed over
+                if (player.audio_format_.bitrate != stream_bitrate)
+                {
+                    stream_bitrate = player.audio_format_.bitrate;
+                    player.stream->set_bitrate(stream_bitrate);
+                }
+
+                player.update_prebuffering();
+
+                // A Wi-Fi dip or another task may starve the decoder while the output drains the small PCM buffer
+                player.decoder_boost_.update(player.decoder_to_audio_ring_.used_space(),
+                        player.prebuffered_ && player.http_to_decoder_ring_.used_space() > 0);
+            }
+
+            bool output_progress = player.decoder_to_audio_ring_.used_space() != output_before;
+            bool progress = player.http_to_decoder_ring_.used_space() != input_before || output_progress;
+
+            if (output_progress)
+            {
+                xTaskNotify(player.audio_output_task_handle_, PCM_WRITTEN, eSetBits);
+            }
+
+            if (!progress)
+            {
+                if (stream_finished)
+                {
+                    break;
+                }
+
+                // Either the PCM buffer is full or a whole frame isn't available yet, wait for the output or the stream
+                xSemaphoreTake(player.decoder_wake_, pdMS_TO_TICKS(DECODER_WAIT_MS));
+            }
+        }
+
+        player.decoder_boost_.restore();
+
+        // Whatever is buffered shall be played
+        player.prebuffered_ = true;
+        player.decoder_runtime_us_ = ulTaskGetRunTimeCounter(NULL);
+
         // Direct to task notify end of streaming
-        xTaskNotify(player.audio_output_task_handle_, 0, eNoAction);
+        xTaskNotify(player.audio_output_task_handle_, DECODING_COMPLETE, eSetBits);
 
-        ESP_LOGI(TAG, "Streaming and decoding complete");
+        ESP_LOGI(TAG, "Decoding complete");
         vTaskDelete(NULL);
     }
 
@@ -120,26 +344,82 @@ private:
         // End flag
         bool end_of_stream = false;
 
-        while (!end_of_stream)
+        // The DMA played silence until the audio was prebuffered, that isn't an underrun
+        bool resuming = true;
+
+        // The previous song faded out
+        xSemaphoreTake(player.mutex_, portMAX_DELAY);
+        player.sink.fade_in();
+        xSemaphoreGive(player.mutex_);
+
+        // The decoded audio left once the decoder finished is played too, in whole stereo samples
+        while (!end_of_stream ||
+                (player.decoder_to_audio_ring_.used_space() >= 4 && !player.force_stop_))
         {
             // Check if streaming is done
-            uint32_t notification_value = 0;
+            uint32_t notifications = 0;
 
-            if (pdTRUE == xTaskNotifyWait(0, 0, &notification_value, 0))
+            if (pdTRUE == xTaskNotifyWait(0, UINT32_MAX, &notifications, 0) && (notifications & DECODING_COMPLETE) != 0)
             {
                 // This shall be done first to allow taking last data from the decoder
                 end_of_stream = true;
             }
 
-            // Feed the audio sink with data from the decoder
+            // Wait until enough audio is buffered to survive network dips
+            if (!player.prebuffered_ && !end_of_stream)
+            {
+                resuming = true;
+                vTaskDelay(pdMS_TO_TICKS(10));
+                continue;
+            }
+
+            if (resuming)
+            {
+                player.sink.take_starved_buffers();
+                resuming = false;
+            }
+
+            // Feed the audio sink with data from the decoder, a whole DMA buffer at least until the stream ends
             xSemaphoreTake(player.mutex_, portMAX_DELAY);
-            player.sink.write(player.decoder_to_audio_ring_);
+            bool ready = end_of_stream || player.decoder_to_audio_ring_.used_space() >= player.sink.chunk_bytes();
+
+            if (ready)
+            {
+                player.sink.write(player.decoder_to_audio_ring_);
+            }
+
             xSemaphoreGive(player.mutex_);
 
-            // Give other tasks a chance to run
-            taskYIELD();
+            if (ready)
+            {
+                // The decoder may be waiting for room
+                xSemaphoreGive(player.decoder_wake_);
+            }
+
+            // The ring is empty after every write, the output only starves when the decoder can't keep up
+            if (player.sink.take_starved_buffers() > 0 && !end_of_stream && !player.force_stop_)
+            {
+                ESP_LOGW(TAG, "Audio output starved, prebuffering again");
+                player.underruns_.add();
+                player.song_underruns_++;
+                player.prebuffered_ = false;
+            }
+
+            if (ready)
+            {
+                // Give other tasks a chance to run
+                taskYIELD();
+            }
+            else if (pdTRUE == xTaskNotifyWait(0, UINT32_MAX, &notifications, pdMS_TO_TICKS(OUTPUT_WAIT_MS)) &&
+                    (notifications & DECODING_COMPLETE) != 0)
+            {
+                // Woken as soon as the decoder wrote more audio or finished
+                end_of_stream = true;
+            }
         }
 
+        player.output_runtime_us_ = ulTaskGetRunTimeCounter(NULL);
+        player.end_time_ = esp_timer_get_time();
         player.is_finished_ = true;
 
         EventQueue::get_instance().push(Event::SONG_END);
@@ -148,19 +428,116 @@ private:
         vTaskDelete(NULL);
     }
 
-    HTTPStream stream;
-    MP3Decoder decoder;
+    /**
+     * @brief Creates the decoder once enough of the stream is buffered to recognize its format
+     */
+    bool create_decoder(
+            bool stream_finished)
+    {
+        if (http_to_decoder_ring_.used_space() < DecoderFactory::SNIFF_SIZE && !stream_finished)
+        {
+            return false;
+        }
+
+        // The ring is read from its start at this point, the head is contiguous
+        decoder = DecoderFactory::create(http_to_decoder_ring_.max_read_slot(), content_type_);
+        decoder_setup_us_ = DecoderPool::get_instance().last_setup_us();
+        ESP_LOGI(TAG, "Decoding %s", decoder->name());
+
+        return true;
+    }
+
+    /**
+     * @brief Gets the duration of the audio buffered, compressed at the stream bitrate plus decoded
+     */
+    uint32_t buffered_ms()
+    {
+        uint32_t bitrate = audio_format_.bitrate > 0 ? audio_format_.bitrate : BandwidthEstimator::DEFAULT_BITRATE_BPS;
+        size_t bytes_per_ms = audio_format_.sample_rate * audio_format_.channel * sizeof(int16_t) / 1000;
+
+        return http_to_decoder_ring_.used_space() * 8000ULL / bitrate +
+               (bytes_per_ms > 0 ? decoder_to_audio_ring_.used_space() / bytes_per_ms : 0);
+    }
+
+    void update_prebuffering()
+    {
+        if (audio_format_.sample_rate == 0)
+        {
+            return;
+        }
+
+        uint32_t buffered = buffered_ms();
+        buffered_.set(buffered);
+
+        if (prebuffered_)
+        {
+            return;
+        }
+
+        uint32_t bitrate = audio_format_.bitrate > 0 ? audio_format_.bitrate : BandwidthEstimator::DEFAULT_BITRATE_BPS;
+        uint32_t capacity_ms = http_to_decoder_ring_.size() * 8000ULL / bitrate;
+        uint32_t prebuffer_ms = std::min(BandwidthEstimator::get_instance().prebuffer_ms(audio_format_.bitrate),
+                        capacity_ms * 3 / 4);
+
+        if (buffered >= prebuffer_ms)
+        {
+            prebuffered_ = true;
+            prebuffer_target_.set(prebuffer_ms);
+
+            if (!started_)
+            {
+                started_ = true;
+
+                int64_t elapsed_ms = (esp_timer_get_time() - start_time_) / 1000;
+                ttfa_ms_ = elapsed_ms;
+                time_to_first_audio_.set(elapsed_ms);
+                ESP_LOGI(TAG, "Prebuffered %lu ms of audio in %lld ms", prebuffer_ms, elapsed_ms);
+            }
+        }
+    }
+
+    std::string url_;
+
+    // Declared before the stream so the time to first audio includes the connection
+    int64_t start_time_ = esp_timer_get_time();
+    int64_t end_time_ = 0;
+
+    std::unique_ptr<StreamSource> stream;
+    std::unique_ptr<AudioDecoder> decoder;
     I2SSink & sink;
 
+    // Guards the sink, reconfigured by the decoder while the output writes to it
     SemaphoreHandle_t mutex_;
-    TaskHandle_t http_decoder_task_handle_;
+    // Given by the stream and the output when the decoder may progress, outlives the decoder task unlike a
+    // notification to it
+    SemaphoreHandle_t decoder_wake_;
+    TaskHandle_t http_stream_task_handle_;
+    TaskHandle_t decoder_task_handle_;
     TaskHandle_t audio_output_task_handle_;
 
     RingBuffer http_to_decoder_ring_;
     RingBuffer decoder_to_audio_ring_;
 
-    esp_audio_simple_dec_info_t audio_format_;
+    std::string content_type_;
+    esp_audio_simple_dec_info_t audio_format_ = {};
+
+    Metric& underruns_;
+    Metric& time_to_first_audio_;
+    Metric& prebuffer_target_;
+    Metric& buffered_;
+
+    PriorityBoost decoder_boost_;
 
     bool is_finished_ = false;
+    bool stream_finished_ = false;
     bool force_stop_ = false;
+    bool prebuffered_ = false;
+    bool started_ = false;
+
+    uint32_t song_underruns_ = 0;
+    int64_t ttfa_ms_ = 0;
+    int64_t decoder_setup_us_ = 0;
+    uint32_t stream_runtime_us_ = 0;
+    uint32_t decoder_runtime_us_ = 0;
+    uint32_t output_runtime_us_ = 0;
 };
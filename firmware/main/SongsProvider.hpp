@@ -2,53 +2,88 @@
 
 #include <string>
 
+#include <sdkconfig.h>
+
+#include <Song.hpp>
+#include <MirrorSet.hpp>
+
 #include <songlists/songs_lofigirl.hpp>
 #include <songlists/songs_rain.hpp>
 #include <songlists/songs_coffee_jazz.hpp>
+#include <songlists/radio_stations.hpp>
+
+#if CONFIG_CACTUS_TEST_SERVER
+#include <songlists/test_scenarios.hpp>
+#endif // CONFIG_CACTUS_TEST_SERVER
 
 class SongsProvider
 {
+    static constexpr size_t PLAYLISTS = 4;
+
 public:
 
     SongsProvider()
+        : lofigirl_mirrors_(songs_lowfigirl_mirrors)
+        , rain_mirrors_(songs_rain_mirrors)
+        , coffee_jazz_mirrors_(songs_coffee_jazz_mirrors)
     {
         srand(time(NULL));
     }
 
-    std::string get_next_song()
+    Song get_next_song()
     {
-        std::string song;
+        Song song;
+
+#if CONFIG_CACTUS_TEST_SERVER
+        // Scenarios are played in order, playlists are ignored
+        song.path = test_scenarios[current_song_index_];
+        song.path = test_scenarios_prefix + song.path;
+        current_song_index_ = (current_song_index_ + 1) % test_scenarios_size;
+
+        return song;
+#endif // CONFIG_CACTUS_TEST_SERVER
 
         if (playlist_ == 0)
         {
-            song = songs_lowfigirl[rand() % songs_lowfigirl_size];
-            song = songs_lowfigirl_prefix + song;
+            song.path = songs_lowfigirl[rand() % songs_lowfigirl_size];
+            song.mirrors = &lofigirl_mirrors_;
             current_song_index_ = (current_song_index_ + 1) % songs_lowfigirl_size;
         }
         else if (playlist_ == 1)
         {
-            song = songs_rain[rand() % songs_rain_size];
-            song = songs_rain_prefix + song;
+            song.path = songs_rain[rand() % songs_rain_size];
+            song.mirrors = &rain_mirrors_;
             current_song_index_ = (current_song_index_ + 1) % songs_rain_size;
         }
         else if (playlist_ == 2)
         {
-            song = songs_coffee_jazz[rand() % songs_coffee_jazz_size];
-            song = songs_coffee_jazz_prefix + song;
+            song.path = songs_coffee_jazz[rand() % songs_coffee_jazz_size];
+            song.mirrors = &coffee_jazz_mirrors_;
             current_song_index_ = (current_song_index_ + 1) % songs_coffee_jazz_size;
         }
+        else if (playlist_ == 3)
+        {
+            // Stations are endless streams, a new one is only requested when skipping or on disconnection
+            song.path = radio_stations[current_song_index_];
+            current_song_index_ = (current_song_index_ + 1) % radio_stations_size;
+        }
 
         return song;
     }
 
     void next_playlist()
     {
-        playlist_ = (playlist_ + 1) % 3;
+        playlist_ = (playlist_ + 1) % PLAYLISTS;
         current_song_index_ = 0;
     }
 
 private:
 
+    // Each playlist ranks the mirrors of its own list
+    MirrorSet lofigirl_mirrors_;
+    MirrorSet rain_mirrors_;
+    MirrorSet coffee_jazz_mirrors_;
+
     size_t playlist_ = 0;
     size_t current_song_index_ = 0;
 };
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Source of compressed audio feeding the decoder ring buffer
+ */
+class StreamSource
+{
+public:
+
+    virtual ~StreamSource() = default;
+
+    /**
+     * @brief Gets the amount of data still to read, a positive value if unknown but the stream is alive
+     */
+    virtual int64_t available_data() = 0;
+
+    /**
+     * @brief Reads as much data as available into the buffer
+     */
+    virtual void read_http_stream(
+            RingBuffer& buffer) = 0;
+
+    /**
+     * @brief Gets the title announced by the stream, empty if the stream has none
+     */
+    virtual std::string title()
+    {
+        return "";
+    }
+
+    /**
+     * @brief Tells the nominal bitrate of the audio once the decoder found it, can be called from any task
+     */
+    virtual void set_bitrate(
+            uint32_t bitrate_bps)
+    {
+    }
+
+    /**
+     * @brief Gets the Content-Type announced by the server, empty if unknown
+     */
+    virtual std::string content_type()
+    {
+        return "";
+    }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+
+#include <esp_log.h>
+
+#include <RingBuffer.hpp>
+
+/**
+ * @brief Minimal MPEG-TS demuxer extracting the first audio elementary stream
+ *
+ * Only what HLS audio segments need is supported: PAT and PMT fitting in a single packet and one audio PID.
+ * The PES headers are stripped so the output is the raw MP3 or ADTS AAC stream expected by the decoder.
+ */
+class TSDemuxer
+{
+    static constexpr const char* TAG = "TSDemuxer";
+
+    static constexpr uint16_t PAT_PID = 0x0000;
+    static constexpr uint16_t INVALID_PID = 0xFFFF;
+
+public:
+
+    static constexpr size_t PACKET_SIZE = 188;
+    static constexpr uint8_t SYNC_BYTE = 0x47;
+
+    /**
+     * @brief Demuxes whole packets from input into output
+     *
+     * A packet is only consumed if its payload fits in the output buffer.
+     *
+     * @return Number of input bytes consumed
+     */
+    size_t demux(
+            std::span<const uint8_t> input,
+            RingBuffer& output)
+    {
+        size_t consumed = 0;
+
+        while (input.size() - consumed >= PACKET_SIZE)
+        {
+            const uint8_t* packet = input.data() + consumed;
+
+            // After losing sync a payload byte can look like a sync byte, the packet after it shall start with one
+            bool next_sync = input.size() - consumed < PACKET_SIZE * 2 || packet[PACKET_SIZE] == SYNC_BYTE;
+
+            if (packet[0] != SYNC_BYTE || (!in_sync_ && !next_sync))
+            {
+                // Lost sync, skip bytes until the next sync byte
+                in_sync_ = false;
+                consumed++;
+                continue;
+            }
+
+            in_sync_ = true;
+
+            if (output.free_space() < PACKET_SIZE)
+            {
+                break;
+            }
+
+            process_packet(packet, output);
+            consumed += PACKET_SIZE;
+        }
+
+        return consumed;
+    }
+
+    uint8_t audio_stream_type() const
+    {
+        return audio_stream_type_;
+    }
+
+private:
+
+    void process_packet(
+            const uint8_t* packet,
+            RingBuffer& output)
+    {
+        bool payload_unit_start = packet[1] & 0x40;
+        uint16_t pid = ((packet[1] & 0x1F) << 8) | packet[2];
+        uint8_t adaptation_field_control = (packet[3] >> 4) & 0x03;
+
+        size_t offset = 4;
+
+        if (adaptation_field_control == 0x02 || adaptation_field_control == 0x00)
+        {
+            // No payload
+            return;
+        }
+
+        if (adaptation_field_control == 0x03)
+        {
+            offset += 1 + packet[4];
+        }
+
+        if (offset >= PACKET_SIZE)
+        {
+            return;
+        }
+
+        std::span<const uint8_t> payload(packet + offset, PACKET_SIZE - offset);
+
+        if (pid == PAT_PID)
+        {
+            parse_pat(payload, payload_unit_start);
+        }
+        else if (pid == pmt_pid_)
+        {
+            parse_pmt(payload, payload_unit_start);
+        }
+        else if (pid == audio_pid_)
+        {
+            process_audio(payload, payload_unit_start, output);
+        }
+    }
+
+    static std::span<const uint8_t> section_payload(
+            std::span<const uint8_t> payload,
+            bool payload_unit_start)
+    {
+        if (!payload_unit_start || payload.size() < 1)
+        {
+            return {};
+        }
+
+        // Skip pointer field
+        size_t pointer = payload[0] + 1;
+
+        if (pointer + 3 > payload.size())
+        {
+            return {};
+        }
+
+        payload = payload.subspan(pointer);
+
+        size_t section_length = ((payload[1] & 0x0F) << 8) | payload[2];
+
+        // Whole section without the trailing CRC
+        size_t section_end = std::min(payload.size(), 3 + section_length);
+
+        if (section_end < 3 + 4)
+        {
+            return {};
+        }
+
+        return payload.subspan(0, section_end - 4);
+    }
+
+    void parse_pat(
+            std::span<const uint8_t> payload,
+            bool payload_unit_start)
+    {
+        auto section = section_payload(payload, payload_unit_start);
+
+        // table_id, section_length, transport_stream_id, version, section_number, last_section_number
+        for (size_t i = 8; i + 4 <= section.size(); i += 4)
+        {
+            uint16_t program_number = (section[i] << 8) | section[i + 1];
+            uint16_t pid = ((section[i + 2] & 0x1F) << 8) | section[i + 3];
+
+            if (program_number != 0)
+            {
+                if (pmt_pid_ != pid)
+                {
+                    ESP_LOGD(TAG, "PMT PID: 0x%04x", pid);
+                }
+
+                pmt_pid_ = pid;
+
+                return;
+            }
+        }
+    }
+
+    void parse_pmt(
+            std::span<const uint8_t> payload,
+            bool payload_unit_start)
+    {
+        auto section = section_payload(payload, payload_unit_start);
+
+        if (section.size() < 12)
+        {
+            return;
+        }
+
+        size_t program_info_length = ((section[10] & 0x0F) << 8) | section[11];
+
+        for (size_t i = 12 + program_info_length; i + 5 <= section.size();)
+        {
+            uint8_t stream_type = section[i];
+            uint16_t pid = ((section[i + 1] & 0x1F) << 8) | section[i + 2];
+            size_t es_info_length = ((section[i + 3] & 0x0F) << 8) | section[i + 4];
+
+            // LATM AAC, no decoder parses it
+            if (stream_type == 0x11)
+            {
+                if (!latm_skipped_)
+                {
+                    ESP_LOGW(TAG, "Skipping LATM AAC stream on PID 0x%04x", pid);
+                    latm_skipped_ = true;
+                }
+            }
+            // MPEG-1/2 audio or ADTS AAC
+            else if (stream_type == 0x03 || stream_type == 0x04 || stream_type == 0x0F)
+            {
+                if (audio_pid_ != pid)
+                {
+                    ESP_LOGI(TAG, "Audio PID: 0x%04x, stream type: 0x%02x", pid, stream_type);
+                }
+
+                audio_pid_ = pid;
+                audio_stream_type_ = stream_type;
+
+                return;
+            }
+
+            i += 5 + es_info_length;
+        }
+    }
+
+    void process_audio(
+            std::span<const uint8_t> payload,
+            bool payload_unit_start,
+            RingBuffer& output)
+    {
+        if (payload_unit_start)
+        {
+            // PES header: start code, stream id, length, flags and optional fields
+            if (payload.size() < 9 || payload[0] != 0x00 || payload[1] != 0x00 || payload[2] != 0x01)
+            {
+                ESP_LOGW(TAG, "Invalid PES header");
+
+                return;
+            }
+
+            size_t header_length = 9 + payload[8];
+
+            if (header_length > payload.size())
+            {
+                return;
+            }
+
+            payload = payload.subspan(header_length);
+        }
+
+        output.write(payload);
+    }
+
+    uint16_t pmt_pid_ = INVALID_PID;
+    uint16_t audio_pid_ = INVALID_PID;
+    uint8_t audio_stream_type_ = 0;
+    bool in_sync_ = true;
+    bool latm_skipped_ = false;
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <NotificationClips.hpp>
+
+/**
+ * @brief Fixed set of voices playing the notification clips, mixed over the music
+ *
+ * Clips are triggered from any task through a queue, the voices themselves are only touched by the task mixing
+ * them, so the mixer never waits for the control path. When all voices are busy the clip steals the voice of the
+ * lowest priority closest to its end, if that priority isn't above its own.
+ */
+class VoicePool
+{
+    static constexpr const char* TAG = "VoicePool";
+
+    static constexpr size_t QUEUE_SIZE = 8;
+
+public:
+
+    static constexpr size_t MAX_VOICES = 4;
+
+    VoicePool()
+    {
+        queue_ = xQueueCreate(QUEUE_SIZE, sizeof(Trigger));
+
+        // Loaded now rather than by the mixer the first time a clip plays
+        NotificationClips::get(ClipId::START);
+    }
+
+    ~VoicePool()
+    {
+        vQueueDelete(queue_);
+    }
+
+    /**
+     * @brief Starts playing a clip at the next mixed chunk, can be called from any task
+     */
+    void trigger(
+            ClipId id)
+    {
+        Trigger trigger = {id, esp_timer_get_time()};
+
+        if (pdTRUE != xQueueSend(queue_, &trigger, 0))
+        {
+            ESP_LOGW(TAG, "Too many clips triggered, dropping clip %d", static_cast<int>(id));
+        }
+    }
+
+    /**
+     * @brief Gets the next samples of every playing voice, from the mixer task
+     *
+     * @param samples Samples to mix
+     * @param voices Receives the samples of each voice, a voice ending gives fewer samples
+     * @return Number of voices playing
+     */
+    size_t next(
+            size_t samples,
+            std::array<std::span<const int16_t>, MAX_VOICES>& voices)
+    {
+        Trigger trigger;
+        last_trigger_us_ = 0;
+
+        while (pdTRUE == xQueueReceive(queue_, &trigger, 0))
+        {
+            start(trigger.id);
+
+            if (last_trigger_us_ == 0)
+            {
+                last_trigger_us_ = trigger.time_us;
+            }
+        }
+
+        size_t count = 0;
+
+        for (Voice& voice : voices_)
+        {
+            if (voice.remaining.empty())
+            {
+                continue;
+            }
+
+            size_t size = std::min(samples, voice.remaining.size());
+            voices[count++] = voice.remaining.first(size);
+            voice.remaining = voice.remaining.subspan(size);
+        }
+
+        return count;
+    }
+
+    /**
+     * @brief Gets when the first clip started by the last call to next was triggered, 0 if none started
+     */
+    int64_t last_trigger_us() const
+    {
+        return last_trigger_us_;
+    }
+
+private:
+
+    struct Trigger
+    {
+        ClipId id;
+        int64_t time_us;
+    };
+
+    struct Voice
+    {
+        ClipId id = ClipId::COUNT;
+        std::span<const int16_t> remaining;
+        uint8_t priority = 0;
+    };
+
+    void start(
+            ClipId id)
+    {
+        const Clip& clip = NotificationClips::get(id);
+        Voice* target = nullptr;
+
+        if (clip.restart)
+        {
+            for (Voice& voice : voices_)
+            {
+                if (voice.id == id && !voice.remaining.empty())
+                {
+                    target = &voice;
+                    break;
+                }
+            }
+        }
+
+        for (Voice& voice : voices_)
+        {
+            if (target == nullptr && voice.remaining.empty())
+            {
+                target = &voice;
+            }
+        }
+
+        if (target == nullptr)
+        {
+            for (Voice& voice : voices_)
+            {
+                if (voice.priority <= clip.priority && (target == nullptr || voice.priority < target->priority ||
+                        (voice.priority == target->priority && voice.remaining.size() < target->remaining.size())))
+                {
+                    target = &voice;
+                }
+            }
+        }
+
+        if (target == nullptr)
+        {
+            ESP_LOGW(TAG, "No voice available for clip %d", static_cast<int>(id));
+
+            return;
+        }
+
+        target->id = id;
+        target->remaining = clip.samples;
+        target->priority = clip.priority;
+    }
+
+    QueueHandle_t queue_;
+    std::array<Voice, MAX_VOICES> voices_;
+    int64_t last_trigger_us_ = 0;
+};
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
 #include <span>
 
 #include <esp_log.h>
@@ -11,6 +14,187 @@
 #include <ButtonController.hpp>
 #include <RotaryController.hpp>
 #include <SongsProvider.hpp>
+#include <ControlServer.hpp>
+
+#if CONFIG_CACTUS_TEST_SERVER
+#include <ScenarioReporter.hpp>
+#include <CpuStress.hpp>
+#endif // CONFIG_CACTUS_TEST_SERVER
+
+#if CONFIG_CACTUS_DSP_BENCHMARK
+#include <DSPBenchmark.hpp>
+#endif // CONFIG_CACTUS_DSP_BENCHMARK
+
+#if CONFIG_CACTUS_MP3_BENCHMARK
+#include <MP3Benchmark.hpp>
+#endif // CONFIG_CACTUS_MP3_BENCHMARK
+
+// The sink, the songs provider and the player of the current track live on the stack of the controller task
+static constexpr uint32_t CONTROLLER_STACK_SIZE = 4096;
+static constexpr uint32_t CONTROLLER_STACK_MARGIN = 512;
+
+/**
+ * @brief Selects the latency profile of the next tracks, e.g. POST /latency?profile=low_latency
+ */
+esp_err_t serve_latency(
+        httpd_req_t* req)
+{
+    I2SSink& sink = *static_cast<I2SSink*>(req->user_ctx);
+
+    char query[64];
+    char name[16];
+
+    if (ESP_OK != httpd_req_get_url_query_str(req, query, sizeof(query)) ||
+            ESP_OK != httpd_query_key_value(query, "profile", name, sizeof(name)))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing profile");
+    }
+
+    for (size_t i = 0; i < std::size(I2SSink::PROFILES); i++)
+    {
+        if (strcmp(name, I2SSink::PROFILES[i].name) == 0)
+        {
+            sink.set_latency_profile(static_cast<I2SSink::LatencyProfile>(i));
+
+            return httpd_resp_send(req, "Applied from the next track", HTTPD_RESP_USE_STRLEN);
+        }
+    }
+
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown profile");
+}
+
+/**
+ * @brief Lists the equalizer settings, one section per line
+ */
+esp_err_t serve_eq(
+        httpd_req_t* req)
+{
+    I2SSink& sink = *static_cast<I2SSink*>(req->user_ctx);
+    Equalizer::Settings settings = sink.equalizer().settings();
+
+    char line[160];
+    snprintf(line, sizeof(line), "preamp %.1f dB\n", settings.preamp_db);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send_chunk(req, line, HTTPD_RESP_USE_STRLEN);
+
+    for (size_t i = 0; i < settings.sections.size(); i++)
+    {
+        const Equalizer::Section& section = settings.sections[i];
+        const Biquad::Coefficients& c = section.coefficients;
+
+        snprintf(line, sizeof(line), "%zu %s %.1f Hz %.1f dB Q %.2f, b %.8f %.8f %.8f, a %.8f %.8f\n", i,
+                Biquad::name(section.type), section.frequency, section.gain_db, section.q, Biquad::to_double(c.b0),
+                Biquad::to_double(c.b1), Biquad::to_double(c.b2), Biquad::to_double(c.a1), Biquad::to_double(c.a2));
+        httpd_resp_send_chunk(req, line, HTTPD_RESP_USE_STRLEN);
+    }
+
+    return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+/**
+ * @brief Changes the equalizer and saves it, e.g. POST /eq?section=0&type=peaking&freq=120&gain=-4&q=1.4,
+ * /eq?section=1&type=raw&b0=..&b1=..&b2=..&a1=..&a2=.., /eq?section=0&type=off or /eq?preamp=-6
+ */
+esp_err_t serve_eq_update(
+        httpd_req_t* req)
+{
+    Equalizer& equalizer = static_cast<I2SSink*>(req->user_ctx)->equalizer();
+
+    char query[256];
+    char value[32];
+
+    if (ESP_OK != httpd_req_get_url_query_str(req, query, sizeof(query)))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing parameters");
+    }
+
+    // Missing numbers read as 0, rejected by the range checks where it matters
+    auto number = [&](const char* key)
+    {
+        return ESP_OK == httpd_query_key_value(query, key, value, sizeof(value)) ? strtod(value, nullptr) : 0.0;
+    };
+
+    bool applied = false;
+
+    if (ESP_OK == httpd_query_key_value(query, "preamp", value, sizeof(value)))
+    {
+        applied = equalizer.set_preamp(strtof(value, nullptr));
+    }
+    else if (ESP_OK == httpd_query_key_value(query, "type", value, sizeof(value)))
+    {
+        Biquad::Type type;
+        size_t index = number("section");
+
+        if (!Biquad::parse(value, type))
+        {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown type");
+        }
+
+        if (type == Biquad::Type::RAW)
+        {
+            applied = equalizer.set_coefficients(index, number("b0"), number("b1"), number("b2"), number("a1"),
+                    number("a2"));
+        }
+        else
+        {
+            applied = equalizer.set_section(index, type, number("freq"), number("gain"), number("q"));
+        }
+    }
+
+    if (!applied)
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid settings");
+    }
+
+    if (!equalizer.save())
+    {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Applied but not saved");
+    }
+
+    return httpd_resp_send(req, "Saved", HTTPD_RESP_USE_STRLEN);
+}
+
+#if CONFIG_CACTUS_AUDIO_ANALYZER
+extern const uint8_t visualizer_html_start[] asm("_binary_visualizer_html_start");
+extern const uint8_t visualizer_html_end[] asm("_binary_visualizer_html_end");
+
+/**
+ * @brief Levels of the output over the last 50 ms and its spectrum, as JSON
+ */
+esp_err_t serve_spectrum(
+        httpd_req_t* req)
+{
+    AudioAnalyzer::Snapshot snapshot = static_cast<I2SSink*>(req->user_ctx)->analyzer().snapshot();
+
+    char json[640];
+    int length = snprintf(json, sizeof(json),
+            "{\"sequence\":%lu,\"peak\":[%.1f,%.1f],\"rms\":[%.1f,%.1f],\"clipped\":%lu,\"dropped\":%lu,\"bands\":[",
+            static_cast<unsigned long>(snapshot.sequence), snapshot.peak_dbfs[0], snapshot.peak_dbfs[1],
+            snapshot.rms_dbfs[0], snapshot.rms_dbfs[1], static_cast<unsigned long>(snapshot.clipped),
+            static_cast<unsigned long>(snapshot.dropped_frames));
+
+    for (size_t i = 0; i < snapshot.bands_db.size(); i++)
+    {
+        length += snprintf(json + length, sizeof(json) - length, i == 0 ? "%.1f" : ",%.1f", snapshot.bands_db[i]);
+    }
+
+    snprintf(json + length, sizeof(json) - length, "]}");
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    return httpd_resp_send(req, json, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t serve_visualizer(
+        httpd_req_t* req)
+{
+    httpd_resp_set_type(req, "text/html");
+
+    return httpd_resp_send(req, reinterpret_cast<const char*>(visualizer_html_start),
+            visualizer_html_end - visualizer_html_start);
+}
+#endif // CONFIG_CACTUS_AUDIO_ANALYZER
 
 void player_task(
         void* arg)
@@ -18,6 +202,15 @@ void player_task(
     I2SSink sink;
     SongsProvider songs_provider;
 
+    ControlServer::get_instance().register_uri("/latency", HTTP_POST, serve_latency, &sink);
+    ControlServer::get_instance().register_uri("/eq", HTTP_GET, serve_eq, &sink);
+    ControlServer::get_instance().register_uri("/eq", HTTP_POST, serve_eq_update, &sink);
+
+#if CONFIG_CACTUS_AUDIO_ANALYZER
+    ControlServer::get_instance().register_uri("/spectrum", HTTP_GET, serve_spectrum, &sink);
+    ControlServer::get_instance().register_uri("/visualizer", HTTP_GET, serve_visualizer, &sink);
+#endif // CONFIG_CACTUS_AUDIO_ANALYZER
+
     ButtonController button_controller;
     RotaryController rotary_controller;
     EventQueue& event_queue = EventQueue::get_instance();
@@ -27,9 +220,13 @@ void player_task(
     while (true)
     {
         ESP_LOGI("app_main", "Getting next song");
-        const std::string& song = songs_provider.get_next_song();
+        Song song = songs_provider.get_next_song();
+
+        ESP_LOGI("app_main", "Playing song %s", song.url().c_str());
 
-        ESP_LOGI("app_main", "Playing song %s", song.c_str());
+        // The previous player is gone, the DMA geometry and the loudness correction can change
+        sink.apply_latency_profile();
+        sink.begin_track(song.url());
 
         SongPlayer player(song, sink);
 
@@ -79,11 +276,34 @@ void player_task(
                     ESP_LOGI("app_main", "Song ended");
                     break;
 
+                case Event::STREAM_TITLE_CHANGED:
+                    ESP_LOGI("app_main", "Now playing: %s", player.title().c_str());
+                    break;
+
                 default:
                     ESP_LOGW("app_main", "Unknown event %d", static_cast<int>(event));
                     break;
             }
         }
+
+#if CONFIG_CACTUS_TEST_SERVER
+        if (player.finished())
+        {
+            ScenarioReporter::post(player.report());
+        }
+#endif // CONFIG_CACTUS_TEST_SERVER
+
+        // Deepest use so far, in bytes, warns before members grown inline overflow it
+        uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+
+        if (stack_free < CONTROLLER_STACK_MARGIN)
+        {
+            ESP_LOGW("app_main", "Controller stack: %lu of %lu bytes left", stack_free, CONTROLLER_STACK_SIZE);
+        }
+        else
+        {
+            ESP_LOGI("app_main", "Controller stack: %lu of %lu bytes left", stack_free, CONTROLLER_STACK_SIZE);
+        }
     }
 
     vTaskDelete(NULL);
@@ -141,8 +361,26 @@ extern "C" void app_main(
     WifiManager wifi_manager("CactusSpeaker");
     wifi_manager.wait_for_connection();
 
+    // Start the control server to export metrics
+    ControlServer::get_instance().start();
+
+#if CONFIG_CACTUS_MP3_BENCHMARK
+    MP3Benchmark::run();
+#endif // CONFIG_CACTUS_MP3_BENCHMARK
+
+#if CONFIG_CACTUS_TEST_SERVER
+    if (CONFIG_CACTUS_CPU_STRESS_PCT > 0)
+    {
+        CpuStress::start(CONFIG_CACTUS_CPU_STRESS_PCT);
+    }
+#endif // CONFIG_CACTUS_TEST_SERVER
+
     // ------------------------
     // Application Logic
     // ------------------------
-    xTaskCreate(player_task, "ControllerTask", 4096, NULL, 6, NULL);
+#if CONFIG_CACTUS_DSP_BENCHMARK
+    DSPBenchmark::run();
+#endif // CONFIG_CACTUS_DSP_BENCHMARK
+
+    xTaskCreate(player_task, "ControllerTask", CONTROLLER_STACK_SIZE, NULL, 6, NULL);
 }
@@ -0,0 +1,12 @@
+#include <array>
+#include <string>
+
+static constexpr size_t radio_stations_size = 4;
+
+// Stations stream 24/7 MP3 with ICY metadata, a station is only reconnected when the server closes it
+static const char* const radio_stations[] = {
+    "https://ice1.somafm.com/groovesalad-128-mp3",
+    "https://ice1.somafm.com/lush-128-mp3",
+    "https://ice1.somafm.com/dronezone-128-mp3",
+    "https://ice1.somafm.com/deepspaceone-128-mp3"
+};
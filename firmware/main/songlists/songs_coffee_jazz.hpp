@@ -1,9 +1,17 @@
 #include <array>
 #include <string>
 
+#include <sdkconfig.h>
+
 static constexpr size_t songs_coffee_jazz_size = 467;
 
-static const char* const songs_coffee_jazz_prefix = "https://cdn.pixabay.com/audio/";
+// Mirrors serving the same paths, ranked at runtime by MirrorSet
+static const char* const songs_coffee_jazz_mirrors[] = {
+#if CONFIG_CACTUS_LAN_MIRROR
+    CONFIG_CACTUS_LAN_MIRROR_URL "/pixabay/",
+#endif // CONFIG_CACTUS_LAN_MIRROR
+    "https://cdn.pixabay.com/audio/"
+};
 
 static const char* const songs_coffee_jazz[] = {
     "2023/08/31/audio_d2149da47a.mp3",
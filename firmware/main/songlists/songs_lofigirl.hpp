@@ -1,9 +1,17 @@
 #include <array>
 #include <string>
 
+#include <sdkconfig.h>
+
 static constexpr size_t songs_lowfigirl_size = 3789;
 
-static const char* const songs_lowfigirl_prefix = "https://lofigirl.com/wp-content/uploads/";
+// Mirrors serving the same paths, ranked at runtime by MirrorSet
+static const char* const songs_lowfigirl_mirrors[] = {
+#if CONFIG_CACTUS_LAN_MIRROR
+    CONFIG_CACTUS_LAN_MIRROR_URL "/lofigirl/",
+#endif // CONFIG_CACTUS_LAN_MIRROR
+    "https://lofigirl.com/wp-content/uploads/"
+};
 
 static const char* const songs_lowfigirl[] = {
     "2022/11/001-The-Descent.mp3",
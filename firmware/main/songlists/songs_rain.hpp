@@ -1,9 +1,17 @@
 #include <array>
 #include <string>
 
+#include <sdkconfig.h>
+
 static constexpr size_t songs_rain_size = 3;
 
-static const char* const songs_rain_prefix = "https://cdn.pixabay.com/audio/";
+// Mirrors serving the same paths, ranked at runtime by MirrorSet
+static const char* const songs_rain_mirrors[] = {
+#if CONFIG_CACTUS_LAN_MIRROR
+    CONFIG_CACTUS_LAN_MIRROR_URL "/pixabay/",
+#endif // CONFIG_CACTUS_LAN_MIRROR
+    "https://cdn.pixabay.com/audio/"
+};
 
 static const char* const songs_rain[] = {
     "2022/07/10/audio_be2a209861.mp3",
@@ -0,0 +1,32 @@
+#include <array>
+#include <string>
+
+#include <sdkconfig.h>
+
+static constexpr size_t test_scenarios_size = 18;
+
+static const char* const test_scenarios_prefix = CONFIG_CACTUS_TEST_SERVER_URL "/";
+
+// Scenarios defined in tools/stream_server.py, slow_tls needs the TLS port and is not listed
+static const char* const test_scenarios[] = {
+    "baseline/song.mp3",
+    "fast_lan/song.mp3",
+    "slow_160k/song.mp3",
+    "tight_136k/song.mp3",
+    "high_latency/song.mp3",
+    "jitter/song.mp3",
+    "disconnect/song.mp3",
+    "outage_10s/song.mp3",
+    "outage_30s/song.mp3",
+    "redirects/song.mp3",
+    "chunked/song.mp3",
+    // Same song in every codec to compare the decoding cost
+    "fast_lan/song.aac",
+    "fast_lan/song.m4a",
+    "fast_lan/song.flac",
+    "fast_lan/song.opus",
+    "fast_lan/song.wav",
+    // Whole tracks decoded with a frame buffer, the write position crosses the end of the ring many times
+    "ring_wrap/song.flac",
+    "ring_wrap/song.aac"
+};
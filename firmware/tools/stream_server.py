@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the audio CDNs with network fault injection.
+
+Serves the files in a fixtures directory under /<scenario>/<file>, shaping each response with the faults of the
+scenario. Scenario parameters can be overridden with query parameters, e.g. /baseline/song.mp3?bw=20000&jitter=200
+
+Firmware built with CONFIG_CACTUS_TEST_SERVER plays every scenario in songlists/test_scenarios.hpp and posts a
+playback report to /report at the end of each one. Reports are printed and appended to the results file.
+
+Usage:
+    stream_server.py --fixtures fixtures/ [--port 8080] [--tls-port 8443 --cert cert.pem --key key.pem]
+"""
+
+import argparse
+import json
+import os
+import random
+import socket
+import ssl
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+# Fault parameters:
+#   bw          bandwidth limit in bytes per second (0 = unlimited)
+#   latency     delay before the response headers in ms
+#   jitter      random delay up to this value in ms before each chunk
+#   disconnect  close the connection after this many body bytes (0 = never)
+#   stall       pause the body for stall_ms after this many bytes (0 = never)
+#   stall_ms    stall duration in ms
+#   redirects   number of 302 redirects before serving the file
+#   chunked     use chunked transfer encoding instead of Content-Length
+#   tls_delay   delay before the TLS handshake in ms (TLS port only)
+SCENARIOS = {
+    "baseline": {},
+    "fast_lan": {"bw": 0, "latency": 2},
+    "slow_160k": {"bw": 20000},
+    "tight_136k": {"bw": 17000, "jitter": 50},
+    "high_latency": {"latency": 800},
+    "jitter": {"jitter": 300},
+    "disconnect": {"disconnect": 300000},
+    "outage_10s": {"stall": 200000, "stall_ms": 10000},
+    "outage_30s": {"stall": 200000, "stall_ms": 30000},
+    "redirects": {"redirects": 3},
+    "chunked": {"chunked": 1},
+    "slow_tls": {"tls_delay": 2000},
+    # Lossless and AAC throttled near their bitrate, the PCM ring drains and wraps at any position
+    "ring_wrap": {"bw": 120000, "jitter": 100},
+}
+
+DEFAULTS = {
+    "bw": 0,
+    "latency": 0,
+    "jitter": 0,
+    "disconnect": 0,
+    "stall": 0,
+    "stall_ms": 0,
+    "redirects": 0,
+    "chunked": 0,
+    "tls_delay": 0,
+}
+
+CHUNK_SIZE = 1024
+
+CONTENT_TYPES = {
+    ".mp3": "audio/mpeg",
+    ".aac": "audio/aac",
+    ".m4a": "audio/mp4",
+    ".flac": "audio/flac",
+    ".opus": "audio/ogg",
+    ".wav": "audio/wav",
+}
+
+
+class Throttle:
+    """Token bucket limiting the body rate."""
+
+    def __init__(self, bytes_per_second):
+        self.rate = bytes_per_second
+        self.start = time.monotonic()
+        self.sent = 0
+
+    def wait(self, size):
+        if self.rate <= 0:
+            return
+        self.sent += size
+        ahead = self.sent / self.rate - (time.monotonic() - self.start)
+        if ahead > 0:
+            time.sleep(ahead)
+
+
+class StreamHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "CactusStreamServer/1.0"
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            super().log_message(format, *args)
+
+    def scenario_parameters(self, scenario, query):
+        parameters = dict(DEFAULTS)
+        parameters.update(SCENARIOS.get(scenario, {}))
+        for key, values in query.items():
+            if key in parameters:
+                parameters[key] = int(values[0])
+        return parameters
+
+    def do_HEAD(self):
+        self.serve(send_body=False)
+
+    def do_GET(self):
+        self.serve(send_body=True)
+
+    def do_POST(self):
+        url = urlparse(self.path)
+        if url.path not in ("/report", "/benchmark"):
+            self.send_error(404)
+            return
+
+        length = int(self.headers.get("Content-Length", 0))
+        try:
+            report = json.loads(self.rfile.read(length))
+        except json.JSONDecodeError:
+            self.send_error(400)
+            return
+
+        self.server.add_report(report)
+
+        self.send_response(204)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def serve(self, send_body):
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        parts = url.path.strip("/").split("/", 1)
+
+        if len(parts) != 2:
+            self.send_error(404)
+            return
+
+        scenario, name = parts
+        if scenario not in SCENARIOS:
+            self.send_error(404, "Unknown scenario")
+            return
+
+        path = os.path.join(self.server.fixtures, os.path.basename(name))
+        if not os.path.isfile(path):
+            self.send_error(404, "Unknown fixture")
+            return
+
+        parameters = self.scenario_parameters(scenario, query)
+
+        # Redirects count down through a query parameter so each hop is a new request
+        if parameters["redirects"] > 0:
+            query["redirects"] = [str(parameters["redirects"] - 1)]
+            location = url.path + "?" + "&".join(f"{key}={values[0]}" for key, values in query.items())
+            self.send_response(302)
+            self.send_header("Location", location)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+
+        time.sleep(parameters["latency"] / 1000.0)
+
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        range_header = self.headers.get("Range")
+
+        if range_header and range_header.startswith("bytes="):
+            first, _, last = range_header[6:].partition("-")
+            if first:
+                start = int(first)
+                end = min(int(last), size - 1) if last else size - 1
+            else:
+                # Suffix range, the last bytes of the file
+                start = max(size - int(last), 0)
+            if start >= size or start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", f"bytes */{size}")
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header("Content-Range", f"bytes {start}-{end}/{size}")
+        else:
+            self.send_response(200)
+
+        self.send_header("Content-Type", CONTENT_TYPES.get(os.path.splitext(path)[1], "application/octet-stream"))
+        self.send_header("Accept-Ranges", "bytes")
+
+        if parameters["chunked"]:
+            self.send_header("Transfer-Encoding", "chunked")
+        else:
+            self.send_header("Content-Length", str(end - start + 1))
+
+        self.end_headers()
+
+        if send_body:
+            self.send_body(path, start, end, parameters)
+
+    def send_body(self, path, start, end, parameters):
+        throttle = Throttle(parameters["bw"])
+        sent = 0
+        stalled = False
+
+        with open(path, "rb") as file:
+            file.seek(start)
+            remaining = end - start + 1
+
+            while remaining > 0:
+                chunk = file.read(min(CHUNK_SIZE, remaining))
+                if not chunk:
+                    break
+                remaining -= len(chunk)
+
+                if parameters["jitter"]:
+                    time.sleep(random.uniform(0, parameters["jitter"]) / 1000.0)
+
+                if parameters["stall"] and not stalled and sent >= parameters["stall"]:
+                    stalled = True
+                    time.sleep(parameters["stall_ms"] / 1000.0)
+
+                if parameters["disconnect"] and sent + len(chunk) > parameters["disconnect"]:
+                    self.wfile.flush()
+                    self.connection.shutdown(socket.SHUT_RDWR)
+                    self.close_connection = True
+                    return
+
+                throttle.wait(len(chunk))
+
+                if parameters["chunked"]:
+                    self.wfile.write(f"{len(chunk):x}\r\n".encode() + chunk + b"\r\n")
+                else:
+                    self.wfile.write(chunk)
+
+                sent += len(chunk)
+
+        if parameters["chunked"]:
+            self.wfile.write(b"0\r\n\r\n")
+
+
+class StreamServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, fixtures, results, verbose):
+        super().__init__(address, StreamHandler)
+        self.fixtures = fixtures
+        self.results = results
+        self.verbose = verbose
+        self.lock = threading.Lock()
+        self.reports = []
+
+    def add_report(self, report):
+        with self.lock:
+            self.reports.append(report)
+            with open(self.results, "a") as file:
+                file.write(json.dumps(report) + "\n")
+
+        print(format_benchmark(report) if "benchmark" in report else format_report(report), flush=True)
+
+
+class TLSStreamServer(StreamServer):
+    """Same server behind TLS, the handshake is delayed by the tls_delay parameter of the slow_tls scenario."""
+
+    def __init__(self, address, fixtures, results, verbose, cert, key):
+        super().__init__(address, fixtures, results, verbose)
+        self.context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        self.context.load_cert_chain(cert, key)
+
+    def finish_request(self, request, client_address):
+        time.sleep(SCENARIOS["slow_tls"]["tls_delay"] / 1000.0)
+        try:
+            request = self.context.wrap_socket(request, server_side=True)
+        except (ssl.SSLError, OSError) as error:
+            print(f"TLS handshake failed: {error}")
+            return
+        super().finish_request(request, client_address)
+
+
+def format_report(report):
+    # Reports of older firmwares lack the newer fields
+    report = {"codec": "?", "decoder_setup_us": 0, "stream_cpu_pct": 0.0, "compressed_kb": 0, "pcm_kb": 0,
+              "decoder_boosts": 0, "decoder_boosted_ms": 0, "cpu_stress_pct": 0, **report}
+    return ("{url:<60} {codec:<5} buffers={compressed_kb}/{pcm_kb} KB  underruns={underruns:<3} ttfa={ttfa_ms:>6} ms  "
+            "decoder_setup={decoder_setup_us:>6} us  stress={cpu_stress_pct:>2}%  "
+            "boosts={decoder_boosts:<3} boosted={decoder_boosted_ms:>6} ms  "
+            "stream_cpu={stream_cpu_pct:5.1f}%  decoder_cpu={decoder_cpu_pct:5.1f}%  output_cpu={output_cpu_pct:5.1f}%  "
+            "duration={duration_ms:>7} ms").format(**report)
+
+
+def format_benchmark(result):
+    return ("{benchmark} {file:<16} {backend:<16} rtf={realtime_factor:.4f}  heap={peak_heap_bytes:>6} B  "
+            "stack={stack_bytes:>5} B  exact={exact_frames}/{frames}  errors={errors}  crc={crc}").format(**result)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--fixtures", default=os.path.join(os.path.dirname(__file__), "fixtures"),
+                        help="directory with the MP3 fixtures")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--tls-port", type=int, default=0, help="also serve over TLS on this port")
+    parser.add_argument("--cert", help="TLS certificate (PEM)")
+    parser.add_argument("--key", help="TLS private key (PEM)")
+    parser.add_argument("--results", default="stream_server_results.jsonl", help="file the reports are appended to")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    servers = [StreamServer(("", args.port), args.fixtures, args.results, args.verbose)]
+
+    if args.tls_port:
+        if not args.cert or not args.key:
+            parser.error("--tls-port requires --cert and --key")
+        servers.append(TLSStreamServer(("", args.tls_port), args.fixtures, args.results, args.verbose,
+                                       args.cert, args.key))
+
+    for server in servers[1:]:
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    print(f"Serving {args.fixtures} on port {args.port}" + (f" and TLS port {args.tls_port}" if args.tls_port else ""))
+    print("Scenarios: " + ", ".join(SCENARIOS))
+
+    try:
+        servers[0].serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+    print("\nSummary:")
+    for report in servers[0].reports + sum((server.reports for server in servers[1:]), []):
+        print(format_report(report))
+
+
+if __name__ == "__main__":
+    main()